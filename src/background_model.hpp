@@ -0,0 +1,159 @@
+#ifndef BACKGROUND_MODEL_HPP
+#define BACKGROUND_MODEL_HPP
+
+#include <cstring>
+#include <opencv2/opencv.hpp>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Per-pixel exponential running average of a grey scene, kept as 8.8
+// fixed point in 16 bits and optionally paired with a running variance.
+// A single pass over each frame compares it against the model, writes the
+// foreground mask, optionally sums the mask per block, and then moves the
+// model by 2^-shift towards the frame.
+//
+// Without variance a pixel is foreground when it differs from the mean by
+// more than threshold grey levels. With variance the test is
+// d^2 > k^2 * max(var, threshold^2 / k^2) instead, so the noise floor
+// adapts to each pixel.
+class BackgroundModel {
+public:
+	BackgroundModel(int shift = 5, bool use_variance = false,
+					int threshold = 20, int k_sigma = 3)
+		: shift(shift), use_variance(use_variance), threshold(threshold),
+		  k_sigma(k_sigma < 1 ? 1 : k_sigma) {}
+
+	void reset() { mean.release(); var.release(); }
+
+	// grey is CV_8UC1. fg receives a CV_8UC1 mask (255 = foreground).
+	// When block_sums is given it receives the sum of the mask over each
+	// block_size x block_size block (block_size a multiple of 8).
+	void apply(const cv::Mat &grey, cv::Mat &fg,
+			   unsigned *block_sums = NULL, int block_size = 16) {
+		fg.create(grey.size(), CV_8UC1);
+		int grid_w = (grey.cols + block_size - 1) / block_size;
+		int grid_h = (grey.rows + block_size - 1) / block_size;
+		if (block_sums)
+			memset(block_sums, 0, sizeof(unsigned) * grid_w * grid_h);
+
+		if (mean.size() != grey.size()) {
+			grey.convertTo(mean, CV_16U, 256);
+			var.create(grey.size(), CV_16U);
+			var.setTo(cv::Scalar(minVar()));
+			fg.setTo(cv::Scalar(0));
+			return;
+		}
+
+		for (int y = 0; y < grey.rows; ++y) {
+			applyRow(grey.ptr<uchar>(y), mean.ptr<ushort>(y),
+					 var.ptr<ushort>(y), fg.ptr<uchar>(y), grey.cols,
+					 block_sums ? block_sums + (y / block_size) * grid_w
+								: NULL,
+					 block_size);
+		}
+	}
+
+	// Current background estimate as an 8-bit image
+	void background(cv::Mat &dst) const { mean.convertTo(dst, CV_8U, 1/256.0); }
+
+private:
+	ushort minVar() const {
+		int v = (threshold * threshold) / (k_sigma * k_sigma);
+		return (ushort) (v < 1 ? 1 : v);
+	}
+
+	void applyRow(const uchar *src, ushort *m, ushort *v, uchar *mask,
+				  int width, unsigned *sums, int block_size) const {
+		const ushort min_var = minVar();
+		// d^2 / k^2 is taken as the high half of d^2 * (65536 / k^2)
+		const ushort inv_ksq = (ushort) (65535 / (k_sigma * k_sigma));
+		int x = 0;
+#ifdef __SSE2__
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i vthr = _mm_set1_epi16((short) threshold);
+		const __m128i vmin = _mm_set1_epi16((short) min_var);
+		const __m128i vinv = _mm_set1_epi16((short) inv_ksq);
+		const __m128i vsh  = _mm_cvtsi32_si128(shift);
+
+		for (; x + 16 <= width; x += 16) {
+			__m128i px = _mm_loadu_si128((const __m128i*)(src + x));
+			__m128i fgm[2];
+			for (int h = 0; h < 2; ++h) {
+				__m128i *pm = (__m128i*)(m + x + 8*h);
+				__m128i *pv = (__m128i*)(v + x + 8*h);
+				__m128i x8 = _mm_slli_epi16(h ? _mm_unpackhi_epi8(px, zero)
+											  : _mm_unpacklo_epi8(px, zero), 8);
+				__m128i mv = _mm_loadu_si128(pm);
+
+				// |x - mean| as two saturated differences, one of them 0
+				__m128i up   = _mm_subs_epu16(x8, mv);
+				__m128i down = _mm_subs_epu16(mv, x8);
+				__m128i d    = _mm_srli_epi16(_mm_or_si128(up, down), 8);
+
+				_mm_storeu_si128(pm, _mm_sub_epi16(
+					_mm_add_epi16(mv, _mm_srl_epi16(up, vsh)),
+					_mm_srl_epi16(down, vsh)));
+
+				__m128i over;
+				if (use_variance) {
+					__m128i vv = _mm_loadu_si128(pv);
+					__m128i d2 = _mm_mullo_epi16(d, d);
+					// max(var, min_var) without an unsigned 16-bit max
+					__m128i floor_v = _mm_add_epi16(vmin,
+													_mm_subs_epu16(vv, vmin));
+					over = _mm_subs_epu16(_mm_mulhi_epu16(d2, vinv), floor_v);
+
+					__m128i vup   = _mm_subs_epu16(d2, vv);
+					__m128i vdown = _mm_subs_epu16(vv, d2);
+					_mm_storeu_si128(pv, _mm_sub_epi16(
+						_mm_add_epi16(vv, _mm_srl_epi16(vup, vsh)),
+						_mm_srl_epi16(vdown, vsh)));
+				} else {
+					over = _mm_subs_epu16(d, vthr);
+				}
+				// 0xffff where over != 0
+				fgm[h] = _mm_xor_si128(_mm_cmpeq_epi16(over, zero),
+									   _mm_cmpeq_epi16(zero, zero));
+			}
+			__m128i out = _mm_packs_epi16(fgm[0], fgm[1]);
+			_mm_storeu_si128((__m128i*)(mask + x), out);
+
+			if (sums) {
+				__m128i s = _mm_sad_epu8(out, zero);
+				sums[ x      / block_size] += _mm_cvtsi128_si32(s);
+				sums[(x + 8) / block_size] += _mm_cvtsi128_si32(
+												_mm_srli_si128(s, 8));
+			}
+		}
+#endif
+		for (; x < width; ++x) {
+			int x8 = src[x] << 8;
+			int up   = x8 > m[x] ? x8 - m[x] : 0;
+			int down = m[x] > x8 ? m[x] - x8 : 0;
+			int d = (up | down) >> 8;
+			m[x] = (ushort) (m[x] + (up >> shift) - (down >> shift));
+
+			bool over;
+			if (use_variance) {
+				int d2 = d * d;
+				int floor_v = v[x] > min_var ? v[x] : min_var;
+				over = (int) (((unsigned) d2 * inv_ksq) >> 16) > floor_v;
+				int vup   = d2 > v[x] ? d2 - v[x] : 0;
+				int vdown = v[x] > d2 ? v[x] - d2 : 0;
+				v[x] = (ushort) (v[x] + (vup >> shift) - (vdown >> shift));
+			} else {
+				over = d > threshold;
+			}
+			mask[x] = over ? 255 : 0;
+			if (sums) sums[x / block_size] += mask[x];
+		}
+	}
+
+	int shift;
+	bool use_variance;
+	int threshold, k_sigma;
+	cv::Mat mean, var;
+};
+
+#endif
@@ -0,0 +1,464 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <thread>
+#include <atomic>
+#include <sys/resource.h>
+#include <opencv2/opencv.hpp>
+#include "libpdi.hpp"
+#include "scale_space.hpp"
+#include "frame_stream.hpp"
+#include "tuning.hpp"
+
+using namespace cv;
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+// Times every stage of the tools on synthetic images at several sizes and
+// prints the results as JSON, one stage per line, so two runs can be
+// diffed. Progress goes to stderr. allocations and reuses count the
+// buffer pool's work after the first run of a stage: in steady state
+// every request should be a reuse.
+
+struct Resolution {
+	const char *name;
+	int width, height;
+};
+
+static const Resolution resolutions[] = {
+	{"vga", 640, 480},
+	{"1080p", 1920, 1080},
+	{"4k", 3840, 2160},
+	{"50mp", 8660, 5774},
+};
+
+struct Inputs {
+	Mat noise;    // uniform noise, BGR
+	Mat gradient; // diagonal ramp plus a little noise, BGR
+	Mat bubbles;  // white discs on black, some with holes, grey
+	Mat scene;    // shapes and lines over a gradient, BGR
+};
+
+void make_inputs(Size size, Inputs &in) {
+	RNG rng(12345);
+	in.noise.create(size, CV_8UC3);
+	rng.fill(in.noise, RNG::UNIFORM, Scalar::all(0), Scalar::all(256));
+
+	in.gradient.create(size, CV_8UC3);
+	for (int y = 0; y < size.height; ++y) {
+		Vec3b *p = in.gradient.ptr<Vec3b>(y);
+		for (int x = 0; x < size.width; ++x) {
+			int v = 255 * (x + y) / (size.width + size.height);
+			p[x] = Vec3b(v, (v + 85) % 256, 255 - v);
+		}
+	}
+	Mat grain(size, CV_8UC3);
+	rng.fill(grain, RNG::UNIFORM, Scalar::all(0), Scalar::all(16));
+	in.gradient += grain;
+
+	// Disc radius and count scale with the image, so every size has about
+	// the same density of bubbles
+	in.bubbles = Mat::zeros(size, CV_8UC1);
+	int radius = max(4, size.width / 80);
+	int count = size.area() / (radius * radius * 12);
+	for (int i = 0; i < count; ++i) {
+		Point c(rng.uniform(0, size.width), rng.uniform(0, size.height));
+		int r = rng.uniform(radius / 2, radius + 1);
+		circle(in.bubbles, c, r, Scalar(255), -1);
+		if (rng.uniform(0, 4) == 0)
+			circle(in.bubbles, c, r / 3, Scalar(0), -1);
+	}
+
+	in.gradient.copyTo(in.scene);
+	int shapes = max(50, size.area() / 4000);
+	for (int i = 0; i < shapes; ++i) {
+		Point a(rng.uniform(0, size.width), rng.uniform(0, size.height));
+		Point b = a + Point(rng.uniform(-200, 200), rng.uniform(-200, 200));
+		Scalar color(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256));
+		switch (rng.uniform(0, 3)) {
+		case 0: rectangle(in.scene, a, b, color, -1); break;
+		case 1: line(in.scene, a, b, color, rng.uniform(1, 4)); break;
+		default: circle(in.scene, a, rng.uniform(5, 60), color, -1); break;
+		}
+	}
+}
+
+// Peak RSS since the last reset, in kB. Writing 5 to clear_refs resets
+// VmHWM on Linux 4.0 and later; where it does not, the peak is the
+// process's so far.
+bool reset_peak_rss() {
+	FILE *f = fopen("/proc/self/clear_refs", "w");
+	if (!f) return false;
+	bool ok = fputs("5", f) >= 0;
+	return fclose(f) == 0 && ok;
+}
+
+long peak_rss_kb() {
+	FILE *f = fopen("/proc/self/status", "r");
+	if (f) {
+		char line[256];
+		long kb = -1;
+		while (fgets(line, sizeof(line), f))
+			if (sscanf(line, "VmHWM: %ld", &kb) == 1) break;
+		fclose(f);
+		if (kb >= 0) return kb;
+	}
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+struct Options {
+	double seconds;  // time budget per stage and size
+	int min_iterations, max_iterations;
+	vector<string> sizes, stages; // empty: all
+};
+
+bool selected(const vector<string> &names, const string &name) {
+	return names.empty() || find(names.begin(), names.end(), name) != names.end();
+}
+
+// Runs f once to warm up, then until both the time budget and the minimum
+// iteration count are spent, and prints a JSON object with the stats
+class Runner {
+public:
+	Runner(const Options &opt, ostream &out) : opt(opt), out(out), first(true) {}
+
+	const vector<string>& stages() const { return opt.stages; }
+
+	void run(const string &stage, const string &input, const Resolution &res,
+			 const function<void()> &f) {
+		if (!selected(opt.stages, stage)) return;
+		cerr << res.name << " " << stage << "..." << flush;
+
+		reset_peak_rss();
+		f();
+		// Everything after the warm-up run should come from the pool
+		frame_pool().resetStats();
+		vector<double> ms;
+		Clock::time_point start = Clock::now();
+		while ((int) ms.size() < opt.max_iterations &&
+			   ((int) ms.size() < opt.min_iterations ||
+				chrono::duration<double>(Clock::now() - start).count() < opt.seconds)) {
+			Clock::time_point t0 = Clock::now();
+			f();
+			ms.push_back(chrono::duration<double, milli>(Clock::now() - t0).count());
+		}
+		long rss = peak_rss_kb();
+		BufferPool::Stats pool = frame_pool().stats();
+
+		sort(ms.begin(), ms.end());
+		double median = ms.size() % 2 ? ms[ms.size() / 2] :
+			(ms[ms.size() / 2 - 1] + ms[ms.size() / 2]) / 2;
+		// Nearest rank
+		double p99 = ms[min(ms.size() - 1, (size_t) ceil(0.99 * ms.size()) - 1)];
+		double mpix = (double) res.width * res.height / 1e6;
+		cerr << " " << median << " ms" << endl;
+
+		char line[512];
+		snprintf(line, sizeof(line),
+				 "{\"stage\": \"%s\", \"input\": \"%s\", \"resolution\": \"%s\", "
+				 "\"width\": %d, \"height\": %d, \"iterations\": %d, "
+				 "\"median_ms\": %.3f, \"p99_ms\": %.3f, \"mpix_per_s\": %.2f, "
+				 "\"peak_rss_kb\": %ld, \"allocations\": %lu, \"reuses\": %lu}",
+				 stage.c_str(), input.c_str(), res.name, res.width, res.height,
+				 (int) ms.size(), median, p99, mpix / (median / 1000), rss,
+				 pool.allocations, pool.reuses);
+		out << (first ? "\n    " : ",\n    ") << line;
+		out.flush();
+		first = false;
+	}
+
+private:
+	const Options &opt;
+	ostream &out;
+	bool first;
+};
+
+// One frame out through a pipe and back, as between two chained tools:
+// conversion, the write (vmsplice with PDI_VMSPLICE=1), the read and the
+// conversion back. A reader thread plays the next tool.
+void bench_stream(const string &stage, bool raw, const Mat &frame,
+				  const Resolution &res, Runner &runner) {
+	int fds[2];
+	if (pipe(fds) != 0) return;
+	FrameSink sink;
+	if (!sink.openFd(fds[1], raw, frame.size(), 30, false)) {
+		close(fds[0]);
+		close(fds[1]);
+		return;
+	}
+	FrameSource source;
+	atomic<unsigned long> received(0);
+	thread reader([&] {
+		if (!source.openFd(fds[0], raw, frame.size())) {
+			received = ~0UL; // lets the writer through
+			return;
+		}
+		Mat back;
+		while (source.read(back)) received++;
+	});
+
+	unsigned long sent = 0;
+	runner.run(stage, "scene", res, [&] {
+		sink.write(frame);
+		sent++;
+		while (received < sent) this_thread::yield();
+	});
+	close(fds[1]);
+	reader.join();
+}
+
+void bench_resolution(const Resolution &res, Runner &runner) {
+	Inputs in;
+	make_inputs(Size(res.width, res.height), in);
+	Mat grey, out, scratch;
+	cvtColor(in.gradient, grey, CV_BGR2GRAY);
+	Mat noise_grey;
+	cvtColor(in.noise, noise_grey, CV_BGR2GRAY);
+
+	pdi::TiltShift tiltshift;
+	pdi::TiltShiftParams ts_params(30, 60, 50, 40);
+	runner.run("tiltshift_blur", "scene", res, [&] { tiltshift.setImage(in.scene); });
+	tiltshift.setImage(in.scene);
+	runner.run("tiltshift_blend", "scene", res, [&] {
+		ts_params.center_focus = ts_params.center_focus == 50 ? 60 : 50;
+		tiltshift.render(ts_params, out);
+	});
+
+	pdi::HomomorphicFilter homomorphic;
+	pdi::HomomorphicParams hf_params;
+	runner.run("homomorphic_fft", "gradient", res, [&] { homomorphic.setImage(grey); });
+	homomorphic.setImage(grey);
+	// Alternating gamma_h, like a trackbar moving, so the filter is rebuilt
+	Mat filtered;
+	runner.run("homomorphic_refilter", "gradient", res, [&] {
+		hf_params.gamma_h = hf_params.gamma_h == 0.5f ? 1.5f : 0.5f;
+		homomorphic.apply(hf_params, filtered);
+	});
+
+	TiledEqualizer clahe;
+	SampledEqualizer sampled;
+	runner.run("equalize_global", "gradient", res, [&] { equalize_global(grey, out); });
+	runner.run("equalize_adaptive", "gradient", res, [&] { clahe.apply(grey, out); });
+	runner.run("equalize_sampled", "gradient", res, [&] {
+		sampled.reset();
+		sampled.apply(grey, out);
+	});
+
+	static const char *filters[] = {"mean", "gauss", "horizontal", "vertical",
+									"laplacian", "log"};
+	for (int f = 0; f < 6; ++f)
+		runner.run(string("laplgauss_") + filters[f], "noise", res, [&] {
+			pdi::spatial_filter(noise_grey, out, (pdi::SpatialFilter) f, true, scratch);
+		});
+	Mat planes[BANK_SIZE];
+	for (int f = 0; f < BANK_SIZE; ++f)
+		planes[f].create(noise_grey.size(), CV_8UC1);
+	runner.run("laplgauss_bank", "noise", res, [&] {
+		filter_bank(noise_grey, planes, true, scratch);
+	});
+	runner.run("laplgauss_fused_log", "noise", res, [&] {
+		fused_filter<LaplacianOfGaussianKernel>(in.noise, out, true);
+	});
+	ScaleSpaceLoG scale_space;
+	double sigmas[] = {1, 2, 4, 8};
+	scale_space.setScales(vector<double>(sigmas, sigmas + 4));
+	vector<Mat> responses;
+	runner.run("laplgauss_scale_space", "noise", res, [&] {
+		scale_space.apply(noise_grey, responses);
+	});
+
+	pdi::BubbleCounter bubbles;
+	runner.run("bubbles_ccl", "bubbles", res, [&] { bubbles.count(in.bubbles); });
+
+	// The grid of big dots alone, then with the edge rounds on top
+	pdi::Pointillism pointillism(1);
+	pdi::PointillismParams grid_only;
+	grid_only.rounds = 0;
+	runner.run("pointillism_grid", "scene", res, [&] {
+		pointillism.reseed(1);
+		pointillism.render(in.scene, out, grid_only);
+	});
+	runner.run("pointillism", "scene", res, [&] {
+		pointillism.reseed(1);
+		pointillism.render(in.scene, out);
+	});
+
+	if (selected(runner.stages(), "stream_y4m"))
+		bench_stream("stream_y4m", false, in.scene, res, runner);
+	if (selected(runner.stages(), "stream_raw"))
+		bench_stream("stream_raw", true, in.scene, res, runner);
+}
+
+// Median of runs calls of f, after one warm-up call
+double median_ms(const function<void()> &f, int runs) {
+	f();
+	vector<double> ms;
+	for (int i = 0; i < runs; ++i) {
+		Clock::time_point t0 = Clock::now();
+		f();
+		ms.push_back(chrono::duration<double, milli>(Clock::now() - t0).count());
+	}
+	sort(ms.begin(), ms.end());
+	return ms[ms.size() / 2];
+}
+
+// Times the thread counts and then the fused filter tile sizes on a 1080p
+// frame, and saves the fastest of each for this machine. A candidate must
+// beat the current choice by 3% to replace it, so ties go to fewer threads
+// and to the default tile.
+void autotune(const string &path) {
+	Inputs in;
+	make_inputs(Size(1920, 1080), in);
+	Mat grey, out;
+	cvtColor(in.gradient, grey, CV_BGR2GRAY);
+	pdi::TiltShift tiltshift;
+	pdi::TiltShiftParams ts_params(30, 60, 50, 40);
+	tiltshift.setImage(in.scene);
+
+	cerr << "isa " << cpu_level_name(cpu_level()) << endl;
+
+	// Everything that runs on parallel_for_: blend, equalization, filter
+	function<void()> parallel_work = [&] {
+		tiltshift.render(ts_params, out);
+		equalize_global(grey, out);
+		fused_filter<LaplacianOfGaussianKernel>(in.noise, out, true);
+	};
+	Tuning best;
+	int cpus = max(1, (int) thread::hardware_concurrency());
+	vector<int> counts;
+	for (int n = 1; n < cpus; n *= 2) counts.push_back(n);
+	counts.push_back(cpus);
+	double best_ms = 0;
+	for (size_t i = 0; i < counts.size(); ++i) {
+		setNumThreads(counts[i]);
+		double ms = median_ms(parallel_work, 15);
+		cerr << "threads " << counts[i] << ": " << ms << " ms" << endl;
+		if (i == 0 || ms < best_ms * 0.97) {
+			best_ms = ms;
+			best.threads = counts[i];
+		}
+	}
+	setNumThreads(best.threads);
+
+	best.fused_tile_bytes = FUSED_TILE_BYTES;
+	best_ms = median_ms([&] {
+		fused_filter_tiled<LaplacianOfGaussianKernel>(in.noise, out, true,
+													  FUSED_TILE_BYTES);
+	}, 15);
+	cerr << "tile " << FUSED_TILE_BYTES << ": " << best_ms << " ms" << endl;
+	for (int bytes = 16 << 10; bytes <= 1 << 20; bytes *= 2) {
+		if (bytes == FUSED_TILE_BYTES) continue;
+		double ms = median_ms([&] {
+			fused_filter_tiled<LaplacianOfGaussianKernel>(in.noise, out, true,
+														  bytes);
+		}, 15);
+		cerr << "tile " << bytes << ": " << ms << " ms" << endl;
+		if (ms < best_ms * 0.97) {
+			best_ms = ms;
+			best.fused_tile_bytes = bytes;
+		}
+	}
+
+	if (!save_tuning(path, best)) {
+		cout << "Could not write " << path << endl;
+		exit(1);
+	}
+	cout << "threads = " << best.threads << ", fused_tile_bytes = "
+		 << best.fused_tile_bytes << ", saved to " << path << endl;
+}
+
+vector<string> split_list(const string &s) {
+	vector<string> items;
+	stringstream ss(s);
+	string item;
+	while (getline(ss, item, ','))
+		if (!item.empty()) items.push_back(item);
+	return items;
+}
+
+int main(int argc, char** argv){
+	Options opt;
+	opt.seconds = 1;
+	opt.min_iterations = 3;
+	opt.max_iterations = 1000;
+	string label, out_path;
+	bool tune = false;
+
+	for (int i = 1; i < argc; ++i) {
+		string a = argv[i];
+		bool has_value = i + 1 < argc;
+		if (a == "--sizes" && has_value) opt.sizes = split_list(argv[++i]);
+		else if (a == "--stages" && has_value) opt.stages = split_list(argv[++i]);
+		else if (a == "--time" && has_value) opt.seconds = atof(argv[++i]);
+		else if (a == "--min-iterations" && has_value)
+			opt.min_iterations = max(1, atoi(argv[++i]));
+		else if (a == "--label" && has_value) label = argv[++i];
+		else if (a == "-o" && has_value) out_path = argv[++i];
+		else if (a == "--autotune") tune = true;
+		else {
+			cout << "usage: " << argv[0] << " [--sizes vga,1080p,4k,50mp]"
+				 << " [--stages name,...] [--time seconds] [--min-iterations n]"
+				 << " [--label text] [-o out.json]" << endl
+				 << "       " << argv[0] << " --autotune [-o tuning_file]" << endl
+				 << "\tTimes each stage for at least --time seconds (default 1)"
+				 << " and --min-iterations runs (default 3)." << endl
+				 << "\tStages: tiltshift_blur tiltshift_blend homomorphic_fft"
+				 << " homomorphic_refilter equalize_global equalize_adaptive"
+				 << " equalize_sampled laplgauss_<mean|gauss|horizontal|vertical"
+				 << "|laplacian|log> laplgauss_bank laplgauss_fused_log"
+				 << " laplgauss_scale_space bubbles_ccl pointillism_grid"
+				 << " pointillism stream_y4m stream_raw" << endl
+				 << "\tKernels run the widest variant the CPU has; PDI_ISA="
+				 << "generic|sse4.2|avx2 caps it." << endl
+				 << "\t--autotune times thread counts and fused filter tile "
+				 << "sizes and saves the fastest to tuning_file (default "
+				 << "$PDI_TUNING or ~/.pdi_tuning), which the tools then "
+				 << "read on this machine." << endl;
+			exit(1);
+		}
+	}
+
+	if (tune) {
+		autotune(out_path.empty() ? tuning_path() : out_path);
+		return 0;
+	}
+
+	// Measure what the tools would run with on this machine
+	apply_tuning();
+
+	ofstream file;
+	if (!out_path.empty()) {
+		file.open(out_path.c_str());
+		if (!file) {
+			cout << "Could not open " << out_path << endl;
+			exit(1);
+		}
+	}
+	ostream &out = out_path.empty() ? cout : file;
+
+	out << "{\n  \"label\": \"" << label << "\",\n"
+		<< "  \"threads\": " << getNumThreads() << ",\n"
+		<< "  \"isa\": \"" << cpu_level_name(cpu_level()) << "\",\n"
+		<< "  \"fused_tile_bytes\": " << fused_tile_bytes() << ",\n"
+		<< "  \"rss_reset\": " << (reset_peak_rss() ? "true" : "false") << ",\n"
+		<< "  \"results\": [";
+	Runner runner(opt, out);
+	for (size_t r = 0; r < sizeof(resolutions) / sizeof(resolutions[0]); ++r)
+		if (selected(opt.sizes, resolutions[r].name))
+			bench_resolution(resolutions[r], runner);
+	out << "\n  ]\n}" << endl;
+
+	return 0;
+}
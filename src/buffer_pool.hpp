@@ -0,0 +1,114 @@
+#ifndef BUFFER_POOL_HPP
+#define BUFFER_POOL_HPP
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <opencv2/opencv.hpp>
+
+// Frame-sized buffers handed out by size and type and taken back when done,
+// so a video loop that needs the same temporaries every frame allocates
+// them on the first frame only. Buffers an object keeps across frames go
+// through ensure() instead, which only counts.
+//
+// The counters say how many buffers had to be allocated and how many
+// requests were served without allocating; bench reports them per stage.
+class BufferPool {
+public:
+	struct Stats {
+		unsigned long allocations, reuses;
+		size_t bytes_allocated;
+	};
+
+	BufferPool() { resetStats(); }
+
+	// A free buffer of this size and type, or a new one. Its contents are
+	// whatever the last user left.
+	cv::Mat acquire(cv::Size size, int type) {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			for (size_t i = 0; i < free.size(); ++i) {
+				if (free[i].size() == size && free[i].type() == type) {
+					cv::Mat m = free[i];
+					free[i] = free.back();
+					free.pop_back();
+					reuses++;
+					return m;
+				}
+			}
+		}
+		allocations++;
+		bytes_allocated += (size_t) size.area() * CV_ELEM_SIZE(type);
+		return cv::Mat(size, type);
+	}
+
+	// Takes back a buffer from acquire(). The caller must hold the only
+	// reference to it; m is left empty.
+	void release(cv::Mat &m) {
+		if (m.empty()) return;
+		std::lock_guard<std::mutex> lock(mtx);
+		free.push_back(m);
+		m.release();
+	}
+
+	// m.create(size, type), counted as a reuse when m already fits
+	void ensure(cv::Mat &m, cv::Size size, int type) {
+		if (m.data && m.size() == size && m.type() == type) {
+			reuses++;
+			return;
+		}
+		allocations++;
+		bytes_allocated += (size_t) size.area() * CV_ELEM_SIZE(type);
+		m.create(size, type);
+	}
+
+	Stats stats() const {
+		Stats s = {allocations, reuses, bytes_allocated};
+		return s;
+	}
+
+	void resetStats() {
+		allocations = 0;
+		reuses = 0;
+		bytes_allocated = 0;
+	}
+
+	// Frees every buffer not in use
+	void clear() {
+		std::lock_guard<std::mutex> lock(mtx);
+		free.clear();
+	}
+
+private:
+	BufferPool(const BufferPool&);
+	BufferPool& operator=(const BufferPool&);
+
+	std::mutex mtx;
+	std::vector<cv::Mat> free;
+	std::atomic<unsigned long> allocations, reuses;
+	std::atomic<size_t> bytes_allocated;
+};
+
+// The pool the tools and libpdi share
+inline BufferPool& frame_pool() {
+	static BufferPool pool;
+	return pool;
+}
+
+// A buffer from a pool for the length of a scope
+class PooledMat {
+public:
+	PooledMat(cv::Size size, int type, BufferPool &pool = frame_pool())
+		: pool(pool) { mat = pool.acquire(size, type); }
+	~PooledMat() { pool.release(mat); }
+
+	cv::Mat mat;
+
+private:
+	PooledMat(const PooledMat&);
+	PooledMat& operator=(const PooledMat&);
+
+	BufferPool &pool;
+};
+
+#endif
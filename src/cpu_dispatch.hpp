@@ -0,0 +1,74 @@
+#ifndef CPU_DISPATCH_HPP
+#define CPU_DISPATCH_HPP
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+// Runtime choice between ISA variants of the hot kernels. The Makefile
+// builds for the baseline (SSE2 on x86-64); the wider variants are
+// compiled per function with the target attribute, and picked from the
+// CPUID bits of the machine the binary runs on. PDI_ISA=generic, sse4.2
+// or avx2 caps the level, to compare variants on one machine.
+//
+// A variant marked PDI_AVX2 may only call functions marked PDI_AVX2 (or
+// plain ones) and must only run when cpu_level() >= CPU_AVX2.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PDI_DISPATCH 1
+#include <immintrin.h>
+#define PDI_SSE42  __attribute__((target("sse4.2")))
+#define PDI_AVX2   __attribute__((target("avx2")))
+#define PDI_AVX512 __attribute__((target("avx512f,avx512bw")))
+#define PDI_AVX512_VBMI __attribute__((target("avx512f,avx512bw,avx512vbmi")))
+#endif
+
+enum CpuLevel { CPU_GENERIC, CPU_SSE42, CPU_AVX2, CPU_AVX512 };
+
+inline const char* cpu_level_name(CpuLevel level) {
+	static const char *names[] = {"generic", "sse4.2", "avx2", "avx512"};
+	return names[level];
+}
+
+// What the CPU (and the OS, for the AVX register state) supports
+inline CpuLevel detect_cpu_level() {
+#ifdef PDI_DISPATCH
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+		return CPU_AVX512;
+	if (__builtin_cpu_supports("avx2"))
+		return CPU_AVX2;
+	if (__builtin_cpu_supports("sse4.2"))
+		return CPU_SSE42;
+#endif
+	return CPU_GENERIC;
+}
+
+// The level the kernels use: the detected one, capped by PDI_ISA
+inline CpuLevel cpu_level() {
+	static const CpuLevel level = [] {
+		CpuLevel detected = detect_cpu_level();
+		const char *cap = getenv("PDI_ISA");
+		if (!cap || !*cap) return detected;
+		for (int l = CPU_GENERIC; l <= CPU_AVX512; ++l)
+			if (strcmp(cap, cpu_level_name((CpuLevel) l)) == 0)
+				return l < detected ? (CpuLevel) l : detected;
+		std::cerr << "PDI_ISA: unknown level " << cap << ", using "
+				  << cpu_level_name(detected) << std::endl;
+		return detected;
+	}();
+	return level;
+}
+
+// vpermb and friends, on top of CPU_AVX512
+inline bool cpu_has_vbmi() {
+#ifdef PDI_DISPATCH
+	static const bool vbmi = cpu_level() >= CPU_AVX512 &&
+		__builtin_cpu_supports("avx512vbmi");
+	return vbmi;
+#else
+	return false;
+#endif
+}
+
+#endif
@@ -1,66 +1,227 @@
 #include <iostream>
 #include <cstdlib>
+#include <chrono>
 #include <opencv2/opencv.hpp>
+#include "equalize_engine.hpp"
+#include "buffer_pool.hpp"
+#include "trace.hpp"
+#include "frame_stream.hpp"
+#include "tuning.hpp"
 
 using namespace cv;
 using namespace std;
 
-int main(int argc, char** argv){
-	Mat image, grey;
-	int width, height;
-	VideoCapture cap;
+typedef chrono::steady_clock Clock;
 
+// The original float calcHist equalization, kept as the reference the
+// integer engine is checked and timed against
+void equalize_reference(Mat &grey) {
 	int histSize = 256;
 	float range[] = {0, 256};
 	const float* histRange = {range};
 	Mat hist;
 
-	cap.open(0);
+	calcHist(&grey, 1, 0, Mat(), hist, 1, &histSize, &histRange);
+
+	// Calculate accumulated histogram
+	for (int i = 1; i < hist.rows; ++i) {
+		hist.at<float>(i) += hist.at<float>(i-1);
+	}
+
+	// Normalize the accumulated histogram
+	for (int i = 0; i < hist.rows; ++i) {
+		hist.at<float>(i) *= 255/((float)(grey.rows*grey.cols));
+	}
+
+	// Repaint the new equalized image
+	for (int i = 0; i < grey.rows; i++) {
+		for (int j = 0; j < grey.cols; j++) {
+			grey.at<uchar>(i, j) = (uchar) hist.at<float>(grey.at<uchar>(i, j));
+		}
+	}
+}
+
+template<typename F>
+double time_ms(F f, int iterations) {
+	Clock::time_point t0 = Clock::now();
+	for (int i = 0; i < iterations; ++i) f();
+	return chrono::duration<double, milli>(Clock::now() - t0).count()
+		   / iterations;
+}
+
+// Times the reference and the integer engine on a synthetic frame (noise
+// over a gradient, so every bin is populated) and checks they agree.
+void bench(int width, int height, int iterations) {
+	Mat grey(height, width, CV_8UC1), noise(height, width, CV_8UC1);
+	for (int i = 0; i < height; ++i)
+		grey.row(i).setTo(Scalar(i * 200 / height));
+	randu(noise, Scalar(0), Scalar(56));
+	add(grey, noise, grey);
+
+	Mat ref = grey.clone(), out;
+	equalize_reference(ref);
+	equalize_global(grey, out);
+	bool exact = countNonZero(ref != out) == 0;
+
+	Mat work;
+	double t_ref = time_ms([&] { grey.copyTo(work); equalize_reference(work); },
+						   iterations);
+	double t_copy = time_ms([&] { grey.copyTo(work); }, iterations);
+	double t_int = time_ms([&] { equalize_global(grey, out); }, iterations);
+
+	unsigned hist[256];
+	uchar lut[256];
+	double t_hist = time_ms([&] { compute_histogram(grey, hist); }, iterations);
+	histogram_to_lut(hist, grey.total(), lut);
+	double t_lut = time_ms([&] { apply_lut(grey, out, lut); }, iterations);
+
+	TiledEqualizer clahe;
+	clahe.apply(grey, out);
+	double t_clahe = time_ms([&] { clahe.apply(grey, out); }, iterations);
+
+	SampledEqualizer sampled(0.01, 0.5, true);
+	double t_sampled = time_ms([&] { sampled.apply(grey, out); }, iterations);
+	double t_sampled_hist = 0, t_sampled_remap = 0;
+	for (int i = 0; i < iterations; ++i) {
+		sampled.apply(grey, out);
+		t_sampled_hist  += sampled.histogramMs() / iterations;
+		t_sampled_remap += sampled.remapMs() / iterations;
+	}
+
+	cout << "###### Equalization " << width << "x" << height << " ######" << endl
+		 << "Reference (float)  = " << t_ref - t_copy << " ms" << endl
+		 << "Integer engine     = " << t_int << " ms" << endl
+		 << "  histogram        = " << t_hist << " ms" << endl
+		 << "  LUT remap        = " << t_lut << " ms" << endl
+		 << "Adaptive (8x8)     = " << t_clahe << " ms" << endl
+		 << "Sampled (1%, 1/" << sampled.sampleStride() << ")  = "
+		 << t_sampled << " ms" << endl
+		 << "  histogram        = " << t_sampled_hist << " ms" << endl
+		 << "  LUT remap        = " << t_sampled_remap << " ms" << endl
+		 << "Threads            = " << getNumThreads() << endl
+		 << "Bit-exact          = " << (exact ? "yes" : "NO") << endl
+		 << "##############################" << endl;
+}
+
+int main(int argc, char** argv){
+	apply_tuning();
+
+	if (argc >= 2 && string(argv[1]) == "--bench") {
+		bench(argc > 2 ? atoi(argv[2]) : 1920,
+			  argc > 3 ? atoi(argv[3]) : 1080,
+			  argc > 4 ? atoi(argv[4]) : 100);
+		exit(0);
+	}
+
+	string source = "0", output;
+	bool options_ok = take_stream_options(argc, argv, source, output);
+
+	string mode = argc >= 2 ? argv[1] : "global";
+	if (!options_ok || argc > 4 || (mode != "global" && mode != "adaptive" &&
+					 mode != "sampled")) {
+		cout << "usage: " << argv[0] << " [-i source] [-o output] [global]"
+			 << endl
+			 << "       " << argv[0] << " adaptive [clip_limit]" << endl
+			 << "       " << argv[0] << " sampled [max_error] [smoothing]"
+			 << endl
+			 << "       " << argv[0] << " --bench [width] [height] [iterations]"
+			 << endl
+			 << "\tadaptive equalizes 8x8 tiles separately, with histogram "
+			 << "bins clipped at clip_limit times their mean (default 4), "
+			 << "and blends between tiles." << endl
+			 << "\tsampled estimates the histogram from enough pixels to "
+			 << "keep the CDF within max_error (default 0.01), and blends "
+			 << "it with the previous frame's CDF by smoothing (0 to 1, "
+			 << "default 0.5)." << endl
+			 << "\t-i reads a camera number (default 0), a video file, - "
+			 << "for Y4M on stdin or raw:WIDTHxHEIGHT[@FPS]:- for raw BGR. "
+			 << "-o writes the equalized frames to - (Y4M), a .y4m file or "
+			 << "raw:- / raw:file (BGR) instead of showing them." << endl;
+		exit(1);
+	}
+	TiledEqualizer clahe(8, 8, argc > 2 ? atof(argv[2]) : 4);
+	SampledEqualizer sampled(argc > 2 ? atof(argv[2]) : 0.01,
+							 argc > 3 ? atof(argv[3]) : 0.5, true);
+	int frame_count = 0;
+
+	Mat image, grey, equalized;
+	int width, height;
+	FrameSource cap;
+	FrameSink sink;
 
-	if (!cap.isOpened()){
-		cout << "No cameras available" << endl;
+	if (!cap.open(source)){
+		if (source == "0") cout << "No cameras available" << endl;
+		else               cout << cap.error() << endl;
 		exit(1);
 	}
 
-	width  = cap.get(CV_CAP_PROP_FRAME_WIDTH);
-	height = cap.get(CV_CAP_PROP_FRAME_HEIGHT);
+	width  = cap.size().width;
+	height = cap.size().height;
+
+	if (!output.empty()) {
+		if (!sink.open(output, cap.size(), cap.fps(), true)) {
+			cout << "Could not write " << output << ": " << sink.error()
+				 << endl;
+			exit(1);
+		}
+		if (sink.toStdout()) move_messages_to_stderr();
+	}
 	
 	cout << "###### Image dimensions ######" << endl	
 		 << "Width = " << width << endl
 		 << "Height  = " << height << endl
 		 << "##############################" << endl;
 
-	namedWindow("grey", WINDOW_NORMAL);
-	namedWindow("equalized", WINDOW_NORMAL);
+	// Streaming runs without windows, until the input ends
+	bool show = output.empty();
+	if (show) {
+		namedWindow("grey", WINDOW_NORMAL);
+		namedWindow("equalized", WINDOW_NORMAL);
+	}
 
 	while (1) {
-		cap >> image;
-		if(image.empty()) exit(1);
+		{
+			TRACE_SCOPE("decode");
+			if (!cap.read(image)) image.release();
+		}
+		if(image.empty()) exit(show ? 1 : 0);
 
-		cvtColor(image, grey, CV_BGR2GRAY);
+		// Same buffers every frame, allocated on the first one
+		frame_pool().ensure(grey, image.size(), CV_8UC1);
+		frame_pool().ensure(equalized, image.size(), CV_8UC1);
+		{
+			TRACE_SCOPE("grey");
+			cvtColor(image, grey, CV_BGR2GRAY);
+		}
 
-		imshow("grey", grey);
+		if (show) imshow("grey", grey);
 
-		calcHist(&grey, 1, 0, Mat(), hist, 1, &histSize, &histRange);
-		
-		// Calculate accumulated histogram
-		for (int i = 1; i < hist.rows; ++i) {
-			hist.at<float>(i) += hist.at<float>(i-1);
-		}
-		
-		// Normalize the accumulated histogram
-		for (int i = 0; i < hist.rows; ++i) {
-			hist.at<float>(i) *= 255/((float)(width*height));
+		if (mode == "adaptive") {
+			TRACE_SCOPE("equalize_adaptive");
+			clahe.apply(grey, equalized);
+		} else if (mode == "sampled") {
+			TRACE_SCOPE("equalize_sampled");
+			sampled.apply(grey, equalized);
+			if (++frame_count % 30 == 0) {
+				cout << "histogram " << sampled.histogramMs() << " ms "
+					 << "(1/" << sampled.sampleStride() << " stride), "
+					 << "remap " << sampled.remapMs() << " ms" << endl;
+			}
+		} else {
+			TRACE_SCOPE("equalize_global");
+			equalize_global(grey, equalized);
 		}
 
-		// Repaint the new equalized image
-		for (int i = 0; i < height; i++) {
-			for (int j = 0; j < width; j++) {
-				grey.at<uchar>(i, j) = (uchar) hist.at<float>(grey.at<uchar>(i, j));
-			}
+		if (!show) {
+			TRACE_SCOPE("encode");
+			if (!sink.write(equalized)) exit(0);
+			continue;
 		}
 
-		imshow("equalized", grey);
+		{
+			TRACE_SCOPE("display");
+			imshow("equalized", equalized);
+		}
 	
 		if(waitKey(30) >= 0) break;
 	}
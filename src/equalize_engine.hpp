@@ -0,0 +1,437 @@
+#ifndef EQUALIZE_ENGINE_HPP
+#define EQUALIZE_ENGINE_HPP
+
+#include <cstring>
+#include <cmath>
+#include <stdint.h>
+#include <opencv2/opencv.hpp>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "cpu_dispatch.hpp"
+
+// Integer histogram equalization of 8-bit grey images: histogram, CDF
+// and LUT are all integer, only the final scale of the 256 LUT entries is
+// done in float, exactly as the original calcHist based loop did, so the
+// output is bit-exact with it.
+
+// Frames with at least this many pixels are split over threads
+#define EQUALIZE_PARALLEL_PIXELS (1 << 19)
+
+// Histogram of rows [y0, y1) of src, added to hist. Four private
+// sub-histograms keep consecutive equal pixels from serialising on the
+// same counter (store-to-load forwarding stalls).
+inline void histogram_rows(const cv::Mat &src, int y0, int y1,
+						   unsigned hist[256]) {
+	unsigned sub[4][256];
+	memset(sub, 0, sizeof(sub));
+	for (int y = y0; y < y1; ++y) {
+		const uchar *p = src.ptr<uchar>(y);
+		int x = 0;
+		for (; x + 8 <= src.cols; x += 8) {
+			uint64_t v;
+			memcpy(&v, p + x, 8);
+			sub[0][ v        & 0xff]++;
+			sub[1][(v >>  8) & 0xff]++;
+			sub[2][(v >> 16) & 0xff]++;
+			sub[3][(v >> 24) & 0xff]++;
+			sub[0][(v >> 32) & 0xff]++;
+			sub[1][(v >> 40) & 0xff]++;
+			sub[2][(v >> 48) & 0xff]++;
+			sub[3][ v >> 56        ]++;
+		}
+		for (; x < src.cols; ++x)
+			sub[0][p[x]]++;
+	}
+	for (int i = 0; i < 256; ++i)
+		hist[i] += sub[0][i] + sub[1][i] + sub[2][i] + sub[3][i];
+}
+
+#ifdef PDI_DISPATCH
+// vpermi2b looks up 64 bytes in a 128-entry table; bit 7 of the pixel
+// picks which half of the LUT the answer comes from. Returns the first
+// column left for the scalar loop.
+PDI_AVX512_VBMI inline int apply_lut_avx512(const uchar *s, uchar *d, int n,
+											const uchar lut[256]) {
+	const __m512i t0 = _mm512_loadu_si512(lut);
+	const __m512i t1 = _mm512_loadu_si512(lut + 64);
+	const __m512i t2 = _mm512_loadu_si512(lut + 128);
+	const __m512i t3 = _mm512_loadu_si512(lut + 192);
+	int x = 0;
+	for (; x + 64 <= n; x += 64) {
+		__m512i idx = _mm512_loadu_si512(s + x);
+		__m512i lo = _mm512_permutex2var_epi8(t0, idx, t1);
+		__m512i hi = _mm512_permutex2var_epi8(t2, idx, t3);
+		__mmask64 m = _mm512_movepi8_mask(idx);
+		_mm512_storeu_si512(d + x, _mm512_mask_blend_epi8(m, lo, hi));
+	}
+	return x;
+}
+#endif
+
+// Maps each row of [y0, y1) of src through lut into dst (may alias src)
+inline void apply_lut_rows(const cv::Mat &src, cv::Mat &dst, int y0, int y1,
+						   const uchar lut[256]) {
+	bool vbmi = cpu_has_vbmi();
+	for (int y = y0; y < y1; ++y) {
+		const uchar *s = src.ptr<uchar>(y);
+		uchar *d = dst.ptr<uchar>(y);
+		int x = 0;
+#ifdef PDI_DISPATCH
+		if (vbmi) x = apply_lut_avx512(s, d, src.cols, lut);
+#endif
+		// Eight lookups per 64-bit load and store
+		for (; x + 8 <= src.cols; x += 8) {
+			uint64_t v, r;
+			memcpy(&v, s + x, 8);
+			r =  (uint64_t) lut[ v        & 0xff]
+			  | ((uint64_t) lut[(v >>  8) & 0xff] <<  8)
+			  | ((uint64_t) lut[(v >> 16) & 0xff] << 16)
+			  | ((uint64_t) lut[(v >> 24) & 0xff] << 24)
+			  | ((uint64_t) lut[(v >> 32) & 0xff] << 32)
+			  | ((uint64_t) lut[(v >> 40) & 0xff] << 40)
+			  | ((uint64_t) lut[(v >> 48) & 0xff] << 48)
+			  | ((uint64_t) lut[ v >> 56        ] << 56);
+			memcpy(d + x, &r, 8);
+		}
+		for (; x < src.cols; ++x)
+			d[x] = lut[s[x]];
+	}
+}
+
+// Equalization LUT of a histogram covering total pixels. The float scale
+// is the same 255/(float)total product the float CDF loop used.
+inline void histogram_to_lut(const unsigned hist[256], size_t total,
+							 uchar lut[256]) {
+	float scale = 255 / ((float) total);
+	unsigned cdf = 0;
+	for (int i = 0; i < 256; ++i) {
+		cdf += hist[i];
+		lut[i] = (uchar) ((float) cdf * scale);
+	}
+}
+
+class HistogramBody : public cv::ParallelLoopBody {
+public:
+	HistogramBody(const cv::Mat &src, int bands, unsigned (*hists)[256])
+		: src(src), bands(bands), hists(hists) {}
+
+	void operator()(const cv::Range &r) const {
+		for (int b = r.start; b < r.end; ++b)
+			histogram_rows(src, src.rows * b / bands,
+						   src.rows * (b + 1) / bands, hists[b]);
+	}
+
+private:
+	const cv::Mat &src;
+	int bands;
+	unsigned (*hists)[256];
+};
+
+class LutBody : public cv::ParallelLoopBody {
+public:
+	LutBody(const cv::Mat &src, cv::Mat &dst, int bands, const uchar *lut)
+		: src(src), dst(dst), bands(bands), lut(lut) {}
+
+	void operator()(const cv::Range &r) const {
+		for (int b = r.start; b < r.end; ++b)
+			apply_lut_rows(src, dst, src.rows * b / bands,
+						   src.rows * (b + 1) / bands, lut);
+	}
+
+private:
+	const cv::Mat &src;
+	cv::Mat &dst;
+	int bands;
+	const uchar *lut;
+};
+
+inline int equalize_bands(const cv::Mat &src) {
+	if (src.total() < EQUALIZE_PARALLEL_PIXELS) return 1;
+	int bands = cv::getNumThreads();
+	return bands < 1 ? 1 : (bands > src.rows ? src.rows : bands);
+}
+
+// Histogram of a CV_8UC1 image, split in row bands over threads when large
+inline void compute_histogram(const cv::Mat &src, unsigned hist[256]) {
+	int bands = equalize_bands(src);
+	memset(hist, 0, 256 * sizeof(unsigned));
+	if (bands == 1) {
+		histogram_rows(src, 0, src.rows, hist);
+		return;
+	}
+	std::vector<unsigned> buf(256 * bands, 0);
+	unsigned (*hists)[256] = (unsigned (*)[256]) &buf[0];
+	cv::parallel_for_(cv::Range(0, bands), HistogramBody(src, bands, hists));
+	for (int b = 0; b < bands; ++b)
+		for (int i = 0; i < 256; ++i)
+			hist[i] += hists[b][i];
+}
+
+// dst = lut[src] for a CV_8UC1 image; dst may be src
+inline void apply_lut(const cv::Mat &src, cv::Mat &dst, const uchar lut[256]) {
+	dst.create(src.size(), CV_8UC1);
+	int bands = equalize_bands(src);
+	if (bands == 1)
+		apply_lut_rows(src, dst, 0, src.rows, lut);
+	else
+		cv::parallel_for_(cv::Range(0, bands), LutBody(src, dst, bands, lut));
+}
+
+// Global histogram equalization of a CV_8UC1 image; dst may be src
+inline void equalize_global(const cv::Mat &src, cv::Mat &dst) {
+	unsigned hist[256];
+	uchar lut[256];
+	compute_histogram(src, hist);
+	histogram_to_lut(hist, src.total(), lut);
+	apply_lut(src, dst, lut);
+}
+
+// Contrast limited adaptive equalization (CLAHE). The frame is cut into
+// tiles_x x tiles_y tiles, each tile gets its own clipped histogram and
+// LUT, and every pixel is a bilinear blend of the LUTs of the four tile
+// centres around it. Tiles are computed in parallel; the blend is a single
+// fused pass with 7-bit fixed point weights.
+class TiledEqualizer {
+public:
+	TiledEqualizer(int tiles_x = 8, int tiles_y = 8, double clip_limit = 4)
+		: tiles_x(tiles_x < 1 ? 1 : tiles_x),
+		  tiles_y(tiles_y < 1 ? 1 : tiles_y), clip_limit(clip_limit) {}
+
+	void setClipLimit(double c) { clip_limit = c; }
+
+	// CV_8UC1 in and out; dst may not be src
+	void apply(const cv::Mat &src, cv::Mat &dst) {
+		dst.create(src.size(), CV_8UC1);
+		if (src.size() != size) prepare(src.size());
+
+		luts.resize(tiles_x * tiles_y * 256);
+		cv::parallel_for_(cv::Range(0, tiles_x * tiles_y), TileBody(*this, src));
+
+		int bands = equalize_bands(src);
+		if (bands == 1)
+			blendRows(src, dst, 0, src.rows);
+		else
+			cv::parallel_for_(cv::Range(0, bands),
+							  BlendBody(*this, src, dst, bands));
+	}
+
+private:
+	// Tile boundaries, and for each column and row the pair of tiles it is
+	// blended between plus the weight of the second one (0-127)
+	void prepare(cv::Size s) {
+		size = s;
+		mapAxis(s.width, tiles_x, col_t0, col_t1, col_w, x_edges);
+		mapAxis(s.height, tiles_y, row_t0, row_t1, row_w, y_edges);
+	}
+
+	static void mapAxis(int n, int tiles, std::vector<int> &t0,
+						std::vector<int> &t1, std::vector<short> &w,
+						std::vector<int> &edges) {
+		edges.resize(tiles + 1);
+		for (int k = 0; k <= tiles; ++k) edges[k] = n * k / tiles;
+		t0.resize(n); t1.resize(n); w.resize(n);
+		int k = 0;
+		for (int i = 0; i < n; ++i) {
+			while (k + 1 < tiles && i >= (edges[k+1] + edges[k+2]) / 2) k++;
+			int c0 = (edges[k] + edges[k+1]) / 2;
+			if (i < c0 || k + 1 >= tiles) {
+				t0[i] = t1[i] = k; w[i] = 0;
+			} else {
+				int c1 = (edges[k+1] + edges[k+2]) / 2;
+				t0[i] = k; t1[i] = k + 1;
+				w[i] = (short) ((i - c0) * 128 / (c1 - c0));
+			}
+		}
+	}
+
+	void buildTileLut(const cv::Mat &src, int t) {
+		int tx = t % tiles_x, ty = t / tiles_x;
+		cv::Mat tile = src(cv::Rect(x_edges[tx], y_edges[ty],
+									x_edges[tx+1] - x_edges[tx],
+									y_edges[ty+1] - y_edges[ty]));
+		unsigned hist[256] = {0};
+		histogram_rows(tile, 0, tile.rows, hist);
+
+		// Clip every bin and hand the excess back out evenly
+		unsigned total = tile.total();
+		unsigned limit = clip_limit > 0 ?
+			std::max(1u, (unsigned) (clip_limit * total / 256)) : total;
+		unsigned excess = 0;
+		for (int i = 0; i < 256; ++i) {
+			if (hist[i] > limit) { excess += hist[i] - limit; hist[i] = limit; }
+		}
+		unsigned each = excess / 256, rest = excess % 256;
+		for (int i = 0; i < 256; ++i)
+			hist[i] += each + (i * rest / 256 != (i + 1) * rest / 256);
+
+		uchar *lut = &luts[t * 256];
+		unsigned cdf = 0;
+		for (int i = 0; i < 256; ++i) {
+			cdf += hist[i];
+			lut[i] = (uchar) std::min(255u,
+				(unsigned) (((uint64_t) cdf * 255 + total / 2) / (total ? total : 1)));
+		}
+	}
+
+	void blendRows(const cv::Mat &src, cv::Mat &dst, int y0, int y1) const {
+		short top[8], bot[8];
+		for (int y = y0; y < y1; ++y) {
+			const uchar *s = src.ptr<uchar>(y);
+			uchar *d = dst.ptr<uchar>(y);
+			const uchar *lt = &luts[row_t0[y] * tiles_x * 256];
+			const uchar *lb = &luts[row_t1[y] * tiles_x * 256];
+			int wy = row_w[y];
+			int x = 0;
+#ifdef __SSE2__
+			const __m128i vwy = _mm_set1_epi16((short) (wy << 8));
+			const __m128i half = _mm_set1_epi16(64);
+			for (; x + 8 <= src.cols; x += 8) {
+				// The four lookups are gathers; the blend is vector math
+				for (int k = 0; k < 8; ++k)
+					horizontal(lt, lb, s[x+k], x + k, top[k], bot[k]);
+				__m128i t = _mm_loadu_si128((const __m128i*) top);
+				__m128i b = _mm_loadu_si128((const __m128i*) bot);
+				__m128i v = _mm_add_epi16(t, _mm_slli_epi16(
+								_mm_mulhi_epi16(_mm_sub_epi16(b, t), vwy), 1));
+				v = _mm_srai_epi16(_mm_add_epi16(v, half), 7);
+				_mm_storel_epi64((__m128i*) (d + x), _mm_packus_epi16(v, v));
+			}
+#endif
+			for (; x < src.cols; ++x) {
+				horizontal(lt, lb, s[x], x, top[0], bot[0]);
+				int diff = bot[0] - top[0];
+				int v = top[0] + 2 * ((diff * (wy << 8)) >> 16);
+				d[x] = (uchar) ((v + 64) >> 7);
+			}
+		}
+	}
+
+	// Horizontal blend of the tile row above and below, 7-bit fixed point
+	inline void horizontal(const uchar *lt, const uchar *lb, uchar v, int x,
+						   short &top, short &bot) const {
+		int a = col_t0[x] * 256 + v, b = col_t1[x] * 256 + v, w = col_w[x];
+		top = (short) ((lt[a] << 7) + (lt[b] - lt[a]) * w);
+		bot = (short) ((lb[a] << 7) + (lb[b] - lb[a]) * w);
+	}
+
+	class TileBody : public cv::ParallelLoopBody {
+	public:
+		TileBody(TiledEqualizer &eq, const cv::Mat &src) : eq(eq), src(src) {}
+		void operator()(const cv::Range &r) const {
+			for (int t = r.start; t < r.end; ++t) eq.buildTileLut(src, t);
+		}
+	private:
+		TiledEqualizer &eq;
+		const cv::Mat &src;
+	};
+
+	class BlendBody : public cv::ParallelLoopBody {
+	public:
+		BlendBody(const TiledEqualizer &eq, const cv::Mat &src, cv::Mat &dst,
+				  int bands) : eq(eq), src(src), dst(dst), bands(bands) {}
+		void operator()(const cv::Range &r) const {
+			for (int b = r.start; b < r.end; ++b)
+				eq.blendRows(src, dst, src.rows * b / bands,
+							 src.rows * (b + 1) / bands);
+		}
+	private:
+		const TiledEqualizer &eq;
+		const cv::Mat &src;
+		cv::Mat &dst;
+		int bands;
+	};
+
+	int tiles_x, tiles_y;
+	double clip_limit;
+	cv::Size size;
+	std::vector<int> x_edges, y_edges, col_t0, col_t1, row_t0, row_t1;
+	std::vector<short> col_w, row_w;
+	std::vector<uchar> luts;
+};
+
+// Equalization for live video from a histogram estimated on a subset of
+// pixels. By the Dvoretzky-Kiefer-Wolfowitz inequality n samples keep the
+// estimated CDF within max_error of the true one with 95% confidence when
+// n >= ln(2/0.05) / (2 max_error^2), so the sampling stride follows from
+// the error bound, not from the frame size. Samples sit on a grid of that
+// stride, optionally with a random column offset per row.
+//
+// The CDF can also be smoothed over time (previous frame weight between
+// 0 and 1), which removes flicker when the scene is steady.
+class SampledEqualizer {
+public:
+	SampledEqualizer(double max_error = 0.01, double smoothing = 0,
+					 bool random = false)
+		: max_error(max_error), smoothing(smoothing), random(random),
+		  have_prev(false), seed(0x9e3779b9u), stride(1),
+		  hist_ms(0), remap_ms(0) {}
+
+	void reset() { have_prev = false; }
+
+	void apply(const cv::Mat &src, cv::Mat &dst) {
+		int64 t0 = cv::getTickCount();
+
+		double n = log(2 / 0.05) / (2 * max_error * max_error);
+		stride = std::max(1, (int) sqrt(src.total() / n));
+
+		unsigned hist[256] = {0};
+		unsigned samples = sampleHistogram(src, hist);
+
+		float cdf_now[256];
+		unsigned cdf = 0;
+		for (int i = 0; i < 256; ++i) {
+			cdf += hist[i];
+			cdf_now[i] = (float) cdf / samples;
+		}
+
+		float a = (float) smoothing;
+		uchar lut[256];
+		for (int i = 0; i < 256; ++i) {
+			prev_cdf[i] = have_prev ? a * prev_cdf[i] + (1 - a) * cdf_now[i]
+									: cdf_now[i];
+			lut[i] = (uchar) std::min(255.0f, prev_cdf[i] * 255);
+		}
+		have_prev = true;
+
+		int64 t1 = cv::getTickCount();
+		apply_lut(src, dst, lut);
+		int64 t2 = cv::getTickCount();
+
+		hist_ms  = (t1 - t0) * 1000.0 / cv::getTickFrequency();
+		remap_ms = (t2 - t1) * 1000.0 / cv::getTickFrequency();
+	}
+
+	int sampleStride() const { return stride; }
+	double histogramMs() const { return hist_ms; }
+	double remapMs() const { return remap_ms; }
+
+private:
+	unsigned sampleHistogram(const cv::Mat &src, unsigned hist[256]) {
+		unsigned samples = 0;
+		for (int y = stride / 2; y < src.rows; y += stride) {
+			const uchar *p = src.ptr<uchar>(y);
+			int x = stride / 2;
+			if (random) {
+				// xorshift32, cheap and good enough for picking offsets
+				seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+				x = seed % stride;
+			}
+			for (; x < src.cols; x += stride) {
+				hist[p[x]]++;
+				samples++;
+			}
+		}
+		return samples ? samples : 1;
+	}
+
+	double max_error, smoothing;
+	bool random, have_prev;
+	unsigned seed;
+	int stride;
+	float prev_cdf[256];
+	double hist_ms, remap_ms;
+};
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef EVENT_LOG_HPP
+#define EVENT_LOG_HPP
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <cstring>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Motion events in a fixed-size ring kept in a memory-mapped file, so other
+// local processes can tail it without parsing console output.
+//
+// One writer appends; any number of readers map the file read-only. Event
+// n (counting from 1) lives in slot (n-1) % capacity. The writer clears the
+// slot's seq, fills the payload, then publishes seq = n and finally bumps
+// the header's write_seq. A reader checks seq == n before and after
+// looking at the payload, seqlock style, and so detects a slot the writer
+// has lapped in the meantime. Neither side takes a lock.
+
+#define EVENT_LOG_MAGIC   0x31474f4c544f4d50ULL // "PMOTLOG1"
+#define EVENT_LOG_VERSION 1
+
+struct MotionEvent {
+	std::atomic<uint64_t> seq;
+	int64_t  timestamp_us; // since the epoch
+	uint64_t frame;
+	uint32_t stream;
+	uint32_t blocks;
+	float    score;
+	uint32_t reserved;
+};
+
+struct EventLogHeader {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t capacity;
+	std::atomic<uint64_t> write_seq;
+	char pad[64 - 4 * sizeof(uint64_t)];
+};
+
+class EventLog {
+public:
+	EventLog() : fd(-1), map(NULL), map_size(0), header(NULL),
+				 records(NULL) {}
+	~EventLog() { close(); }
+
+	// Opens path for writing, creating a log of capacity events or
+	// continuing an existing one of the same shape.
+	bool create(const std::string &path, uint64_t capacity) {
+		close();
+		fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+		if (fd < 0) return false;
+		map_size = sizeof(EventLogHeader) + capacity * sizeof(MotionEvent);
+
+		struct stat sb;
+		bool fresh = fstat(fd, &sb) != 0 || (size_t) sb.st_size != map_size;
+		if (fresh && ftruncate(fd, 0) != 0) return fail();
+		if (fresh && ftruncate(fd, map_size) != 0) return fail();
+		if (!mapFile(PROT_READ | PROT_WRITE)) return false;
+
+		if (fresh || header->magic != EVENT_LOG_MAGIC ||
+			header->version != EVENT_LOG_VERSION ||
+			header->capacity != capacity) {
+			memset(map, 0, map_size);
+			header->magic       = EVENT_LOG_MAGIC;
+			header->version     = EVENT_LOG_VERSION;
+			header->record_size = sizeof(MotionEvent);
+			header->capacity    = capacity;
+			header->write_seq.store(0, std::memory_order_release);
+		}
+		return true;
+	}
+
+	// Opens an existing log read-only
+	bool openForReading(const std::string &path) {
+		close();
+		fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat sb;
+		if (fstat(fd, &sb) != 0 ||
+			(size_t) sb.st_size < sizeof(EventLogHeader)) return fail();
+		map_size = sb.st_size;
+		if (!mapFile(PROT_READ)) return false;
+
+		if (header->magic != EVENT_LOG_MAGIC ||
+			header->version != EVENT_LOG_VERSION ||
+			header->record_size != sizeof(MotionEvent) ||
+			sizeof(EventLogHeader) + header->capacity * sizeof(MotionEvent)
+				> map_size) return fail();
+		return true;
+	}
+
+	void close() {
+		if (map) munmap(map, map_size);
+		if (fd >= 0) ::close(fd);
+		fd = -1; map = NULL; header = NULL; records = NULL;
+	}
+
+	bool isOpen() const { return map != NULL; }
+	uint64_t capacity() const { return header->capacity; }
+
+	// Sequence number of the last published event (0 when empty)
+	uint64_t lastSeq() const {
+		return header->write_seq.load(std::memory_order_acquire);
+	}
+
+	// Writer side. Only one thread of one process may append at a time.
+	uint64_t append(uint32_t stream, uint64_t frame, float score,
+					uint32_t blocks) {
+		uint64_t n = header->write_seq.load(std::memory_order_relaxed) + 1;
+		MotionEvent &ev = records[(n - 1) % header->capacity];
+
+		ev.seq.store(0, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		ev.timestamp_us = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+		ev.frame  = frame;
+		ev.stream = stream;
+		ev.blocks = blocks;
+		ev.score  = score;
+		ev.seq.store(n, std::memory_order_release);
+
+		header->write_seq.store(n, std::memory_order_release);
+		return n;
+	}
+
+	// Reader side. Returns event n in place, or NULL when it has not been
+	// written yet or was already overwritten. The fields must be
+	// re-validated with stillValid() after they have been used.
+	const MotionEvent* at(uint64_t n) const {
+		if (n == 0) return NULL;
+		const MotionEvent *ev = &records[(n - 1) % header->capacity];
+		if (ev->seq.load(std::memory_order_acquire) != n) return NULL;
+		return ev;
+	}
+
+	bool stillValid(const MotionEvent *ev, uint64_t n) const {
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return ev->seq.load(std::memory_order_relaxed) == n;
+	}
+
+private:
+	bool mapFile(int prot) {
+		void *p = mmap(NULL, map_size, prot, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED) return fail();
+		map = p;
+		header = (EventLogHeader*) map;
+		records = (MotionEvent*) ((char*) map + sizeof(EventLogHeader));
+		return true;
+	}
+
+	bool fail() {
+		close();
+		return false;
+	}
+
+	int fd;
+	void *map;
+	size_t map_size;
+	EventLogHeader *header;
+	MotionEvent *records;
+};
+
+#endif
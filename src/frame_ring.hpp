@@ -0,0 +1,106 @@
+#ifndef FRAME_RING_HPP
+#define FRAME_RING_HPP
+
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <opencv2/opencv.hpp>
+
+// Fixed ring of preallocated frames shared by one producer (capture) and
+// one consumer (analysis). The producer always writes into a slot that is
+// not being read, so the consumer can work on the newest frame in place
+// while capture keeps going. Frames the consumer never got to are counted
+// as dropped.
+//
+// A lossless ring is for sources that are not live (files, pipes): the
+// producer waits until the consumer has taken the newest frame, so every
+// frame is analysed, in order.
+class FrameRing {
+public:
+	explicit FrameRing(int capacity = 4)
+		: slots(capacity < 3 ? 3 : capacity), seqs(slots.size(), 0),
+		  writing(-1), reading(-1), newest(-1), seq(0), consumed_seq(0),
+		  stopped(false), lossless(false), dropped(0) {}
+
+	// Set before the producer starts
+	void setLossless(bool on) { lossless = on; }
+
+	// Returns the slot the producer should fill next. The Mat keeps its
+	// buffer between laps, so VideoCapture::read() reuses it in place.
+	cv::Mat& beginWrite() {
+		std::unique_lock<std::mutex> lock(mtx);
+		while (lossless && !stopped && newest >= 0 &&
+			   seqs[newest] != consumed_seq)
+			cond.wait(lock);
+		int n = slots.size();
+		int next = (newest + 1) % n;
+		while (next == reading) next = (next + 1) % n;
+		writing = next;
+		return slots[writing];
+	}
+
+	// Publishes the slot returned by beginWrite() as the newest frame.
+	void endWrite() {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			seqs[writing] = ++seq;
+			newest = writing;
+			writing = -1;
+		}
+		cond.notify_all();
+	}
+
+	// Blocks until a frame newer than the last one consumed is available,
+	// then pins it for reading. Once the ring is stopped, the newest frame
+	// is still handed out if it was not consumed yet; after that, NULL.
+	const cv::Mat* beginRead(unsigned long *frame_seq = NULL) {
+		std::unique_lock<std::mutex> lock(mtx);
+		while (!stopped && (newest < 0 || seqs[newest] == consumed_seq))
+			cond.wait(lock);
+		if (newest < 0 || seqs[newest] == consumed_seq) return NULL;
+
+		reading = newest;
+		dropped += seqs[reading] - consumed_seq - 1;
+		consumed_seq = seqs[reading];
+		if (frame_seq) *frame_seq = consumed_seq;
+		lock.unlock();
+		cond.notify_all(); // a lossless producer may go on
+		return &slots[reading];
+	}
+
+	void endRead() {
+		std::lock_guard<std::mutex> lock(mtx);
+		reading = -1;
+	}
+
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stopped = true;
+		}
+		cond.notify_all();
+	}
+
+	unsigned long written() {
+		std::lock_guard<std::mutex> lock(mtx);
+		return seq;
+	}
+
+	unsigned long droppedFrames() {
+		std::lock_guard<std::mutex> lock(mtx);
+		return dropped;
+	}
+
+private:
+	std::vector<cv::Mat> slots;
+	std::vector<unsigned long> seqs;
+	int writing, reading, newest;
+	unsigned long seq, consumed_seq;
+	bool stopped, lossless;
+	unsigned long dropped;
+
+	std::mutex mtx;
+	std::condition_variable cond;
+};
+
+#endif
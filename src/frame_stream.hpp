@@ -0,0 +1,462 @@
+#ifndef FRAME_STREAM_HPP
+#define FRAME_STREAM_HPP
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <opencv2/opencv.hpp>
+
+// Uncompressed frames through pipes and files, so the video tools can be
+// chained with each other and with an external encoder without encoding
+// and decoding at every step. Two formats:
+//
+//   Y4M       YUV4MPEG2 with 4:2:0 chroma (C420jpeg, C420mpeg2, C420paldv
+//             or none given) or Cmono. What ffmpeg and x264 read and write.
+//   raw BGR   bare frames, 3 bytes a pixel, size given on the command line
+//             (ffmpeg -f rawvideo -pix_fmt bgr24).
+//
+// Sources and sinks are named like this:
+//
+//   -                         Y4M on stdin / stdout
+//   clip.y4m                  Y4M file
+//   raw:WIDTHxHEIGHT[@FPS]:-  raw BGR on stdin (source), size required
+//   raw:-                     raw BGR on stdout (sink)
+//   raw:WIDTHxHEIGHT:path     raw BGR file; the sink takes raw:path too
+//   0, 1, ...                 camera (source only)
+//   anything else             a video file or URL for VideoCapture
+//
+// Input goes through stdio with a large buffer; whole frames are read
+// straight into the destination. Output is written a whole frame per
+// writev call. With PDI_VMSPLICE=1 and stdout a pipe, frames are handed to
+// the kernel with vmsplice instead of copied (see FrameSink::write); only
+// do that when the next process read()s the pipe. One that moves the
+// pages on with splice(2), like pv, keeps references to our buffers, and
+// sees them overwritten two frames later.
+
+#define FRAME_STREAM_BUFFER (4 << 20)
+
+// "WIDTHxHEIGHT[@FPS]" into size and fps (left alone when absent)
+inline bool parse_frame_size(const std::string &s, cv::Size &size, double &fps) {
+	int w, h, n = 0;
+	double f;
+	if (sscanf(s.c_str(), "%dx%d%n", &w, &h, &n) != 2 || w <= 0 || h <= 0)
+		return false;
+	size = cv::Size(w, h);
+	if ((size_t) n == s.size()) return true;
+	if (s[n] != '@' || sscanf(s.c_str() + n + 1, "%lf", &f) != 1 || f <= 0)
+		return false;
+	fps = f;
+	return true;
+}
+
+inline bool is_y4m_name(const std::string &s) {
+	return s == "-" ||
+		(s.size() > 4 && s.compare(s.size() - 4, 4, ".y4m") == 0);
+}
+
+class FrameSource {
+public:
+	FrameSource() : file(NULL), raw(false), mono(false), live(false),
+					frame_rate(0) {}
+	~FrameSource() { close(); }
+
+	bool open(const std::string &spec) {
+		close();
+		if (spec.compare(0, 4, "raw:") == 0) {
+			size_t colon = spec.find(':', 4);
+			if (colon == std::string::npos ||
+				!parse_frame_size(spec.substr(4, colon - 4), frame_size, frame_rate)) {
+				err = "raw sources need raw:WIDTHxHEIGHT[@FPS]:path";
+				return false;
+			}
+			return openFile(spec.substr(colon + 1), true);
+		}
+		if (is_y4m_name(spec))
+			return openFile(spec, false);
+
+		bool device = !spec.empty() &&
+			spec.find_first_not_of("0123456789") == std::string::npos;
+		live = device || spec.find("://") != std::string::npos;
+		if (device) cap.open(atoi(spec.c_str()));
+		else        cap.open(spec);
+		if (!cap.isOpened()) {
+			err = "could not open " + spec;
+			return false;
+		}
+		frame_size = cv::Size(cap.get(CV_CAP_PROP_FRAME_WIDTH),
+							  cap.get(CV_CAP_PROP_FRAME_HEIGHT));
+		frame_rate = cap.get(CV_CAP_PROP_FPS);
+		return true;
+	}
+
+	// Reads from an open descriptor, which the source then owns. Raw frames
+	// need their size.
+	bool openFd(int fd, bool raw_bgr, cv::Size raw_size = cv::Size(),
+				double fps = 0) {
+		close();
+		frame_size = raw_size;
+		frame_rate = fps;
+		FILE *f = fdopen(fd, "rb");
+		if (!f) {
+			err = "could not read the stream";
+			return false;
+		}
+		return attach(f, raw_bgr);
+	}
+
+	void close() {
+		if (file && file != stdin) fclose(file);
+		file = NULL;
+		live = false;
+		cap.release();
+	}
+
+	bool isOpened() const { return file != NULL || cap.isOpened(); }
+	// A camera or network stream, which will not wait for its reader
+	bool isLive() const { return live; }
+	cv::Size size() const { return frame_size; }
+	// 0 when the source does not say
+	double fps() const { return frame_rate; }
+	const std::string& error() const { return err; }
+
+	// Next frame, always BGR. False at the end or on a short frame.
+	bool read(cv::Mat &bgr) {
+		if (!file)
+			return cap.read(bgr) && !bgr.empty();
+
+		if (raw) {
+			bgr.create(frame_size, CV_8UC3);
+			return readFull(bgr.data, bgr.total() * 3);
+		}
+
+		// "FRAME" and optional parameters up to the newline
+		char tag[5];
+		if (fread(tag, 1, 5, file) != 5 || memcmp(tag, "FRAME", 5) != 0)
+			return false;
+		for (int c = getc(file); c != '\n'; c = getc(file))
+			if (c == EOF) return false;
+
+		if (mono) {
+			yuv.create(frame_size, CV_8UC1);
+			if (!readFull(yuv.data, yuv.total())) return false;
+			cv::cvtColor(yuv, bgr, CV_GRAY2BGR);
+			return true;
+		}
+		yuv.create(frame_size.height * 3 / 2, frame_size.width, CV_8UC1);
+		if (!readFull(yuv.data, yuv.total())) return false;
+		cv::cvtColor(yuv, bgr, CV_YUV2BGR_I420);
+		return true;
+	}
+
+private:
+	FrameSource(const FrameSource&);
+	FrameSource& operator=(const FrameSource&);
+
+	bool openFile(const std::string &path, bool raw_bgr) {
+		FILE *f = path == "-" ? stdin : fopen(path.c_str(), "rb");
+		if (!f) {
+			err = "could not open " + path;
+			return false;
+		}
+		return attach(f, raw_bgr);
+	}
+
+	bool attach(FILE *f, bool raw_bgr) {
+		file = f;
+		raw = raw_bgr;
+		buffer.resize(FRAME_STREAM_BUFFER);
+		setvbuf(file, &buffer[0], _IOFBF, buffer.size());
+#ifdef F_SETPIPE_SZ
+		// Fewer, larger reads from a pipe; harmless when it is not one
+		fcntl(fileno(file), F_SETPIPE_SZ, 1 << 20);
+#endif
+		if (raw) return true;
+		if (!readHeader()) {
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	// YUV4MPEG2 W<w> H<h> [F<n>:<d>] [I<i>] [A<n>:<d>] [C<c>] [X<...>]
+	bool readHeader() {
+		std::string line;
+		for (int c = getc(file); c != '\n'; c = getc(file)) {
+			if (c == EOF || line.size() > 1024) {
+				err = "not a Y4M stream";
+				return false;
+			}
+			line += (char) c;
+		}
+		if (line.compare(0, 10, "YUV4MPEG2 ") != 0) {
+			err = "not a Y4M stream";
+			return false;
+		}
+		std::string chroma = "420";
+		int w = 0, h = 0, n, d;
+		size_t pos = 10;
+		while (pos < line.size()) {
+			size_t end = line.find(' ', pos);
+			if (end == std::string::npos) end = line.size();
+			std::string tok = line.substr(pos, end - pos);
+			pos = end + 1;
+			if (tok.empty()) continue;
+			switch (tok[0]) {
+			case 'W': w = atoi(tok.c_str() + 1); break;
+			case 'H': h = atoi(tok.c_str() + 1); break;
+			case 'C': chroma = tok.substr(1); break;
+			case 'F':
+				if (sscanf(tok.c_str() + 1, "%d:%d", &n, &d) == 2 && d > 0)
+					frame_rate = (double) n / d;
+				break;
+			}
+		}
+		mono = chroma == "mono";
+		if (w <= 0 || h <= 0) {
+			err = "Y4M header without a frame size";
+			return false;
+		}
+		// 8-bit only: C420p10 and the like have two bytes per sample
+		if (!mono && chroma != "420" && chroma != "420jpeg" &&
+			chroma != "420mpeg2" && chroma != "420paldv") {
+			err = "Y4M chroma C" + chroma + " is not supported, only 4:2:0 and mono";
+			return false;
+		}
+		if (!mono && (w % 2 || h % 2)) {
+			err = "4:2:0 Y4M needs an even width and height";
+			return false;
+		}
+		frame_size = cv::Size(w, h);
+		return true;
+	}
+
+	bool readFull(uchar *dst, size_t n) {
+		return fread(dst, 1, n, file) == n;
+	}
+
+	cv::VideoCapture cap;
+	FILE *file;
+	std::vector<char> buffer;
+	bool raw, mono, live;
+	cv::Size frame_size;
+	double frame_rate;
+	cv::Mat yuv;
+	std::string err;
+};
+
+class FrameSink {
+public:
+	FrameSink() : fd(-1), own_fd(false), raw(false), grey(false),
+				  splice(false), slot(0) {}
+	~FrameSink() { close(); }
+
+	// Frames written must then be of this size, BGR, or CV_8UC1 when grey.
+	// Grey frames go out as Cmono Y4M, or expanded to BGR when raw.
+	bool open(const std::string &spec, cv::Size size, double fps, bool grey) {
+		close();
+		std::string path = spec;
+		bool raw_bgr = false;
+		if (spec.compare(0, 4, "raw:") == 0) {
+			raw_bgr = true;
+			path = spec.substr(4);
+			// raw:WxH:path is accepted, the size comes from the frames
+			size_t colon = path.find(':');
+			cv::Size ignored;
+			double ignored_fps;
+			if (colon != std::string::npos &&
+				parse_frame_size(path.substr(0, colon), ignored, ignored_fps))
+				path = path.substr(colon + 1);
+		}
+		int f = path == "-" ? STDOUT_FILENO :
+			::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (f < 0) {
+			err = "could not open " + path;
+			return false;
+		}
+		own_fd = f != STDOUT_FILENO;
+		return openFd(f, raw_bgr, size, fps, grey);
+	}
+
+	bool openFd(int f, bool raw_bgr, cv::Size size, double fps, bool grey_frames) {
+		fd = f;
+		raw = raw_bgr;
+		grey = grey_frames;
+		frame_size = size;
+		if (!raw && !grey && (size.width % 2 || size.height % 2)) {
+			err = "4:2:0 Y4M needs an even width and height, use raw:";
+			close();
+			return false;
+		}
+
+		size_t bytes = frameBytes();
+		for (int i = 0; i < 3; ++i)
+			ring[i].create(1, (int) bytes, CV_8UC1);
+		splice = canSplice(bytes);
+
+		if (!raw) {
+			// Frame rate as a fraction with a 1000 denominator covers 29.97
+			int num = (int) ((fps > 0 ? fps : 30) * 1000 + 0.5);
+			char header[128];
+			int len = snprintf(header, sizeof(header),
+							   "YUV4MPEG2 W%d H%d F%d:1000 Ip A1:1 C%s\n",
+							   size.width, size.height, num,
+							   grey ? "mono" : "420jpeg");
+			if (!writeFull(header, len)) {
+				err = "could not write the stream header";
+				close();
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void close() {
+		if (own_fd && fd >= 0) ::close(fd);
+		fd = -1;
+		own_fd = false;
+	}
+
+	bool isOpened() const { return fd >= 0; }
+	bool usesVmsplice() const { return splice; }
+	bool toStdout() const { return fd == STDOUT_FILENO; }
+	const std::string& error() const { return err; }
+
+	// Converts frame into the next of three output buffers and writes it
+	// whole. With vmsplice, the pipe keeps pointing at the buffer's pages
+	// until the reader gets to them. The pipe is never larger than a frame,
+	// so once a frame has gone in entirely, everything before it has been
+	// read, and the buffer two frames back is free again; that holds only
+	// if the reader copies the data out, hence PDI_VMSPLICE.
+	bool write(const cv::Mat &frame) {
+		if (fd < 0 || frame.size() != frame_size ||
+			frame.type() != (grey ? CV_8UC1 : CV_8UC3))
+			return false;
+
+		cv::Mat &out = ring[slot];
+		slot = (slot + 1) % 3;
+		cv::Mat view;
+		if (raw) {
+			view = cv::Mat(frame_size, CV_8UC3, out.data);
+			if (grey) cv::cvtColor(frame, view, CV_GRAY2BGR);
+			else      frame.copyTo(view);
+		} else if (grey) {
+			view = cv::Mat(frame_size, CV_8UC1, out.data);
+			frame.copyTo(view);
+		} else {
+			view = cv::Mat(frame_size.height * 3 / 2, frame_size.width,
+						   CV_8UC1, out.data);
+			cv::cvtColor(frame, view, CV_BGR2YUV_I420);
+		}
+
+		static const char tag[] = "FRAME\n";
+		struct iovec iov[2];
+		int n = 0;
+		if (!raw) {
+			iov[n].iov_base = (void*) tag;
+			iov[n++].iov_len = 6;
+		}
+		iov[n].iov_base = out.data;
+		iov[n++].iov_len = out.total();
+		return writeVec(iov, n);
+	}
+
+private:
+	FrameSink(const FrameSink&);
+	FrameSink& operator=(const FrameSink&);
+
+	size_t frameBytes() const {
+		size_t pixels = (size_t) frame_size.width * frame_size.height;
+		if (raw) return pixels * 3;
+		return grey ? pixels : pixels * 3 / 2;
+	}
+
+	bool canSplice(size_t frame_bytes) {
+#if defined(__linux__) && defined(F_SETPIPE_SZ) && defined(SPLICE_F_GIFT)
+		const char *opt = getenv("PDI_VMSPLICE");
+		if (!opt || strcmp(opt, "1") != 0) return false;
+		struct stat st;
+		if (fstat(fd, &st) != 0 || !S_ISFIFO(st.st_mode)) return false;
+		// Largest power of two up to a frame, at most 1 MB
+		int want = 1 << 16;
+		while ((size_t) want * 2 <= frame_bytes && want < (1 << 20)) want *= 2;
+		fcntl(fd, F_SETPIPE_SZ, want);
+		int have = fcntl(fd, F_GETPIPE_SZ);
+		return have > 0 && (size_t) have <= frame_bytes;
+#else
+		(void) frame_bytes;
+		return false;
+#endif
+	}
+
+	bool writeFull(const void *p, size_t n) {
+		struct iovec iov;
+		iov.iov_base = (void*) p;
+		iov.iov_len = n;
+		return writeVec(&iov, 1);
+	}
+
+	bool writeVec(struct iovec *iov, int n) {
+		while (n > 0) {
+			ssize_t done;
+#if defined(__linux__) && defined(SPLICE_F_GIFT)
+			if (splice)
+				done = vmsplice(fd, iov, n, 0);
+			else
+#endif
+				done = writev(fd, iov, n);
+			if (done < 0) return false;
+			// Skip what went out, resume inside a partly written vector
+			while (n > 0 && (size_t) done >= iov->iov_len) {
+				done -= iov->iov_len;
+				iov++;
+				n--;
+			}
+			if (n > 0) {
+				iov->iov_base = (char*) iov->iov_base + done;
+				iov->iov_len -= done;
+			}
+		}
+		return true;
+	}
+
+	int fd;
+	bool own_fd, raw, grey, splice;
+	cv::Size frame_size;
+	cv::Mat ring[3];
+	int slot;
+	std::string err;
+};
+
+// Takes "-i <source>" and "-o <sink>" out of argv, wherever they are, so
+// the tools' own arguments keep their positions. False when one has no
+// value.
+inline bool take_stream_options(int &argc, char **argv, std::string &source,
+								std::string &sink) {
+	int kept = 1;
+	for (int i = 1; i < argc; ++i) {
+		std::string a = argv[i];
+		if (a == "-i" || a == "-o") {
+			if (i + 1 == argc) return false;
+			(a == "-i" ? source : sink) = argv[++i];
+		} else {
+			argv[kept++] = argv[i];
+		}
+	}
+	argc = kept;
+	argv[argc] = NULL;
+	return true;
+}
+
+// With frames going to stdout, the tools' messages go to stderr instead
+inline void move_messages_to_stderr() {
+	std::cout.rdbuf(std::cerr.rdbuf());
+}
+
+#endif
@@ -1,9 +1,21 @@
 #include <iostream>
 #include <opencv2/opencv.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include "libpdi.hpp"
+#include "trace.hpp"
+#include "progressive.hpp"
+#include "render_worker.hpp"
+#include "tuning.hpp"
 
 #define RADIUS 100
 
+// Enquanto um slider se move, filtra uma copia reduzida com no maximo
+// PREVIEW_PIXELS pixels; com os sliders parados por REFINE_IDLE_MS, filtra
+// a imagem inteira. d0 conta em amostras do espectro, que correspondem as
+// mesmas frequencias na copia reduzida.
+#define PREVIEW_PIXELS (512 * 512)
+#define REFINE_IDLE_MS 150
+
 using namespace cv;
 using namespace std;
 
@@ -25,46 +37,34 @@ int c_slider_max = 100;
 
 char TrackbarName[50];
 
-Mat imaginaryInput, complexImage, multsp;
-Mat padded, filter, mag;
-Mat_<float> realInput, zeros;
-vector<Mat> planos;
-
-// valor do ruido
-float mean;
+// espectro calculado uma vez por nivel, em libpdi.hpp
+pdi::HomomorphicFilter homomorphic, preview;
+bool progressive = false;
+RefineTimer refine(REFINE_IDLE_MS);
+Mat image, imagegray, filtered;
 
 // guarda tecla capturada
 char key;
-Mat image, imagegray, tmp; 
-// valores ideais dos tamanhos da imagem
-// para calculo da DFT
-int dft_M, dft_N;
-
-char *filename;
-
-// troca os quadrantes da imagem da DFT
-void deslocaDFT(Mat& image ){
-    Mat tmp2, A, B, C, D;
-
-    // se a imagem tiver tamanho impar, recorta a regiao para
-    // evitar cópias de tamanho desigual
-    image = image(Rect(0, 0, image.cols & -2, image.rows & -2));
-    int cx = image.cols/2;
-    int cy = image.rows/2;
-
-    // reorganiza os quadrantes da transformada
-    // A B   ->  D C
-    // C D       B A
-    A = image(Rect(0, 0, cx, cy));
-    B = image(Rect(cx, 0, cx, cy));
-    C = image(Rect(0, cy, cx, cy));
-    D = image(Rect(cx, cy, cx, cy));
-
-    // A <-> D
-    A.copyTo(tmp2);  D.copyTo(A);  tmp2.copyTo(D);
-
-    // C <-> B
-    C.copyTo(tmp2);  B.copyTo(C);  tmp2.copyTo(B);
+
+// os callbacks so enviam pedidos; o filtro roda numa thread separada e o
+// loop principal mostra o ultimo resultado pronto
+struct Request {
+    pdi::HomomorphicParams params;
+    bool full;
+};
+
+bool render(const Request &r, Mat &out, const RenderCancel &cancelled) {
+    TRACE_SCOPE(r.full ? "refine" : "preview");
+    return (r.full ? homomorphic : preview).apply(r.params, out, cancelled);
+}
+
+RenderWorker<Request, Mat> *worker;
+
+void post_render(bool full) {
+    Request r;
+    r.params = pdi::HomomorphicParams(gl, gh, d0, c);
+    r.full = full;
+    worker->post(r);
 }
 
 void on_trackbar_homomorphic(int, void*) {
@@ -78,72 +78,14 @@ void on_trackbar_homomorphic(int, void*) {
     cout << "d0 = " << d0 << endl;
     cout << "c = "  << c  << endl;
 
-    image = imread(filename);
-    cvtColor(image, imagegray, CV_BGR2GRAY);
-    imshow("original", imagegray);
-
-    // realiza o padding da imagem
-    copyMakeBorder(imagegray, padded, 0,
-                   dft_M - image.rows, 0,
-                   dft_N - image.cols,
-                   BORDER_CONSTANT, Scalar::all(0));
-
-    // limpa o array de matrizes que vao compor a
-    // imagem complexa
-    planos.clear();
-    // cria a compoente real
-    realInput = Mat_<float>(padded);
-    // insere as duas componentes no array de matrizes
-    planos.push_back(realInput);
-    planos.push_back(zeros);
-
-    // combina o array de matrizes em uma unica
-    // componente complexa
-    merge(planos, complexImage);
-
-    // calcula o dft
-    dft(complexImage, complexImage);
-
-    // realiza a troca de quadrantes
-    deslocaDFT(complexImage);
-    
-    // filtro homomorfico
-	for(int i=0; i < tmp.rows; i++){
-		for(int j=0; j < tmp.cols; j++){
-			float d2 = (i-dft_M/2)*(i-dft_M/2)+(j-dft_N/2)*(j-dft_N/2);
-            //cout << "d2 = " << d2 << endl;
-			tmp.at<float> (i,j) = (gh-gl)*(1.0 - (float)exp(-(c*d2/(d0*d0)))) + gl;
-		}
-	}
-
-    // cria a matriz com as componentes do filtro e junta
-    // ambas em uma matriz multicanal complexa
-    Mat comps[]= {tmp, tmp};
-    merge(comps, 2, filter);
-    
-    // aplica o filtro frequencial
-    mulSpectrums(complexImage,filter,complexImage,0);
-
-    // troca novamente os quadrantes
-    deslocaDFT(complexImage);
-
-    // calcula a DFT inversa
-    idft(complexImage, complexImage);
-
-    // limpa o array de planos
-    planos.clear();
-
-    // separa as partes real e imaginaria da
-    // imagem filtrada
-    split(complexImage, planos);
-
-    // normaliza a parte real para exibicao
-    normalize(planos[0], planos[0], 0, 1, CV_MINMAX);
-    imshow("filtrada", planos[0]);
-
+    // filtro homomorfico sobre o espectro ja calculado
+    post_render(!progressive);
+    if (progressive)
+        refine.touch();
 }
 
 int main(int argc, char** argv){
+    apply_tuning();
     
     namedWindow("original", WINDOW_NORMAL);
     namedWindow("filtrada", WINDOW_NORMAL);
@@ -153,35 +95,32 @@ int main(int argc, char** argv){
         return 1;
     }
 
-    filename = argv[1];
-    image = imread(filename);
-
-    // identifica os tamanhos otimos para
-    // calculo do FFT
-    dft_M = getOptimalDFTSize(image.rows);
-    dft_N = getOptimalDFTSize(image.cols);
-
-    // realiza o padding da imagem
-    copyMakeBorder(image, padded, 0,
-                   dft_M - image.rows, 0,
-                   dft_N - image.cols,
-                   BORDER_CONSTANT, Scalar::all(0));
-
-    // parte imaginaria da matriz complexa (preenchida com zeros)
-    zeros = Mat_<float>::zeros(padded.size());
+    {
+        TRACE_SCOPE("decode");
+        image = imread(argv[1]);
+    }
+    if (!image.data) {
+        cerr << "Could not open " << argv[1] << endl;
+        return 1;
+    }
+    {
+        TRACE_SCOPE("grey");
+        cvtColor(image, imagegray, CV_BGR2GRAY);
+    }
+    imshow("original", imagegray);
 
-    // prepara a matriz complexa para ser preenchida
-    complexImage = Mat(padded.size(), CV_32FC2, Scalar(0));
+    // padding, DFT e troca de quadrantes
+    homomorphic.setImage(imagegray);
 
-    // a função de transferência (filtro frequencial) deve ter o
-    // mesmo tamanho e tipo da matriz complexa
-    filter = complexImage.clone();
+    vector<Mat> pyramid;
+    build_pyramid(imagegray, pyramid, PREVIEW_PIXELS);
+    progressive = pyramid.size() > 1;
+    if (progressive)
+        preview.setImage(pyramid.back());
 
-    // cria uma matriz temporária para criar as componentes real
-    // e imaginaria do filtro ideal
-    tmp = Mat(dft_M, dft_N, CV_32F);
+    RenderWorker<Request, Mat> render_worker(render);
+    worker = &render_worker;
 
-    
     // Inicializar trackbars
 	sprintf( TrackbarName, "gamma_l" );
 	createTrackbar( TrackbarName, "filtrada",
@@ -212,6 +151,13 @@ int main(int argc, char** argv){
     while (1) {
         key = (char) waitKey(10);
         if( key == 27 ) break; // esc pressed!
+        // imagem inteira, com os parametros do ultimo preview
+        if (refine.due())
+            post_render(true);
+        if (worker->take(filtered)) {
+            TRACE_SCOPE("display");
+            imshow("filtrada", filtered);
+        }
     }
 
     return 0;
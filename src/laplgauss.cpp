@@ -1,9 +1,64 @@
 #include <iostream>
+#include <cstdlib>
+#include <chrono>
 #include <opencv2/opencv.hpp>
+#include "spatial_kernels.hpp"
+#include "scale_space.hpp"
+#include "trace.hpp"
+#include "frame_stream.hpp"
+#include "tuning.hpp"
 
 using namespace cv;
 using namespace std;
 
+typedef chrono::steady_clock Clock;
+
+// Scale-space mode: four octave-spaced sigmas starting at this one,
+// and the gain applied to the normalised responses for display
+#define SCALE_SPACE_SIGMA 1.0
+#define SCALE_SPACE_GAIN  4
+
+// Integer kernel for each mask, see spatial_kernels.hpp: on the grey
+// frame, or fused with the grey conversion and mirroring of the capture
+typedef void (*FilterFn)(const Mat&, Mat&, bool, Mat&);
+typedef void (*FusedFn)(const Mat&, Mat&, bool);
+
+struct Filter {
+	FilterFn grey;
+	FusedFn fused;
+};
+
+template<class Kernel> Filter make_filter() {
+	Filter f = {apply_kernel<Kernel>, fused_filter<Kernel>};
+	return f;
+}
+
+float media[] = {1,1,1,
+				 1,1,1,
+				 1,1,1};
+
+float gauss[] = {1,2,1,
+				 2,4,2,
+				 1,2,1};
+
+float horizontal[]={-1,0,1,
+					-2,0,2,
+					-1,0,1};
+
+float vertical[]={-1,-2,-1,
+				   0,0,0,
+				   1,2,1};
+
+float laplacian[]={0,-1,0,
+				  -1,4,-1,
+				   0,-1,0};
+
+float laplacian_of_gaussian[] = {0,-1,-2,-1,0,
+								 -1,0,2,0,-1,
+								 -2,2,8,2,-2,
+								 -1,0,2,0,-1,
+								 0,-1,-2,-1,0};
+
 void printmask(Mat &m){
 	for(int i=0; i<m.size().height; i++){
 		for(int j=0; j<m.size().width; j++){
@@ -22,85 +77,337 @@ void menu(){
 		 << "h - horizontal" << endl
 		 << "l - laplacian" << endl
 		 << "x - laplacian of gaussian" << endl
+		 << "f - fused pipeline on/off (original then shows the raw frame)" << endl
+		 << "b - filter bank on/off (every filter at once, as a mosaic)" << endl
+		 << "s - scale-space laplacian of gaussian on/off (+/- change sigma)" << endl
 		 << "esc - exit" << endl;
 }
 
+// filter2D on float, abs() and convertTo(CV_8U): the original pipeline
+void filter_float(const Mat &frame, Mat &result, const Mat &mask, bool absolut) {
+	Mat frame32f, frameFiltered;
+	frame.convertTo(frame32f, CV_32F);
+	filter2D(frame32f, frameFiltered, frame32f.depth(), mask,
+			 Point(mask.cols/2, mask.rows/2), 0);
+	if(absolut){
+		frameFiltered=abs(frameFiltered);
+	}
+	frameFiltered.convertTo(result, CV_8U);
+}
+
+// Sampled -sigma^2 * LoG kernel, zero sum, for the direct convolution
+Mat log_kernel(double sigma) {
+	int r = (int) ceil(3 * sigma);
+	Mat k(2 * r + 1, 2 * r + 1, CV_32F);
+	for (int i = -r; i <= r; ++i)
+		for (int j = -r; j <= r; ++j) {
+			double q = (i * i + j * j) / (2 * sigma * sigma);
+			k.at<float>(i + r, j + r) =
+				(float) ((2 - 2 * q) * exp(-q) / (2 * CV_PI * sigma * sigma));
+		}
+	return k - mean(k)[0];
+}
+
+// Sigmas shown by the scale-space mode, as a 2x2 mosaic
+// responses is kept by the caller so its buffers last from frame to frame
+void scale_space_mosaic(ScaleSpaceLoG &ss, const Mat &frame, Mat &result,
+						vector<Mat> &responses, bool absolut) {
+	ss.apply(frame, responses);
+	frame_pool().ensure(result, Size(2 * frame.cols, 2 * frame.rows), CV_8UC1);
+	for (size_t i = 0; i < responses.size() && i < 4; ++i) {
+		Mat tile = result(Rect((i % 2) * frame.cols, (i / 2) * frame.rows,
+							   frame.cols, frame.rows));
+		// |x * gain| is |x| * gain, without a temporary for |x|
+		if (absolut)
+			convertScaleAbs(responses[i], tile, SCALE_SPACE_GAIN);
+		else
+			responses[i].convertTo(tile, CV_8U, SCALE_SPACE_GAIN);
+	}
+}
+
+// Times every mask through filter2D on float and through its integer
+// kernel on a synthetic grey frame, and counts differing pixels.
+void bench(int width, int height, int iterations) {
+	Mat frame(height, width, CV_8UC1), noise(height, width, CV_8UC1);
+	for (int i = 0; i < height; ++i)
+		frame.row(i).setTo(Scalar(i * 255 / height));
+	for (int k = 0; k < 20; ++k)
+		rectangle(frame, Rect(rand() % width, rand() % height,
+							  width / 8, height / 8),
+				  Scalar(rand() % 256), k % 2 ? 3 : -1);
+	randu(noise, Scalar(0), Scalar(32));
+	add(frame, noise, frame);
+
+	struct { const char *name; Mat mask; Filter fn; } filters[] = {
+		{"mean",       Mat(3, 3, CV_32F, media) / 9.0,  make_filter<BoxKernel>()},
+		{"gauss",      Mat(3, 3, CV_32F, gauss) / 16.0, make_filter<GaussKernel>()},
+		{"horizontal", Mat(3, 3, CV_32F, horizontal),   make_filter<HorizontalKernel>()},
+		{"vertical",   Mat(3, 3, CV_32F, vertical),     make_filter<VerticalKernel>()},
+		{"laplacian",  Mat(3, 3, CV_32F, laplacian),    make_filter<LaplacianKernel>()},
+		{"laplgauss",  Mat(5, 5, CV_32F, laplacian_of_gaussian),
+					   make_filter<LaplacianOfGaussianKernel>()},
+	};
+
+	// The camera frame the fused pipeline starts from
+	Mat bgr, grey;
+	cvtColor(frame, bgr, CV_GRAY2BGR);
+
+	cout << "###### Filters " << width << "x" << height << " ######" << endl;
+	Mat ref, out, fused, border;
+	for (size_t f = 0; f < sizeof(filters) / sizeof(filters[0]); ++f) {
+		Clock::time_point t0 = Clock::now();
+		for (int i = 0; i < iterations; ++i)
+			filter_float(frame, ref, filters[f].mask, true);
+		Clock::time_point t1 = Clock::now();
+		for (int i = 0; i < iterations; ++i)
+			filters[f].fn.grey(frame, out, true, border);
+		Clock::time_point t2 = Clock::now();
+		for (int i = 0; i < iterations; ++i) {
+			cvtColor(bgr, grey, CV_BGR2GRAY);
+			flip(grey, grey, 1);
+			filters[f].fn.grey(grey, out, true, border);
+		}
+		Clock::time_point t3 = Clock::now();
+		for (int i = 0; i < iterations; ++i)
+			filters[f].fn.fused(bgr, fused, true);
+		Clock::time_point t4 = Clock::now();
+
+		double ms_float = chrono::duration<double, milli>(t1 - t0).count() / iterations;
+		double ms_int   = chrono::duration<double, milli>(t2 - t1).count() / iterations;
+		double ms_staged = chrono::duration<double, milli>(t3 - t2).count() / iterations;
+		double ms_fused  = chrono::duration<double, milli>(t4 - t3).count() / iterations;
+		// out holds the staged result by now, redo the grey one
+		filters[f].fn.grey(frame, out, true, border);
+		int differ = countNonZero(ref != out);
+		cout << filters[f].name << ": float " << ms_float << " ms, integer "
+			 << ms_int << " ms (" << ms_float / ms_int << "x), "
+			 << differ << " pixels differ" << endl;
+
+		cvtColor(bgr, grey, CV_BGR2GRAY);
+		flip(grey, grey, 1);
+		filters[f].fn.grey(grey, out, true, border);
+		cout << "  from BGR: staged " << ms_staged << " ms, fused "
+			 << ms_fused << " ms, " << countNonZero(out != fused)
+			 << " pixels differ" << endl;
+	}
+
+	// All six filters one after the other against the bank's single pass
+	const int count = sizeof(filters) / sizeof(filters[0]);
+	Mat planes[BANK_SIZE], mosaic;
+	Clock::time_point t0 = Clock::now();
+	for (int i = 0; i < iterations; ++i)
+		for (int f = 0; f < count; ++f)
+			filters[f].fn.grey(frame, planes[f], true, border);
+	Clock::time_point t1 = Clock::now();
+	for (int i = 0; i < iterations; ++i)
+		filter_bank_mosaic(frame, mosaic, true, border);
+	Clock::time_point t2 = Clock::now();
+
+	double ms_seq  = chrono::duration<double, milli>(t1 - t0).count() / iterations;
+	double ms_bank = chrono::duration<double, milli>(t2 - t1).count() / iterations;
+	int differ = 0;
+	for (int f = 0; f < count; ++f)
+		differ += countNonZero(planes[f] != mosaic(Rect((f % 3) * width,
+			(f / 3) * height, width, height)));
+	cout << "bank: sequential " << ms_seq << " ms, one pass " << ms_bank
+		 << " ms (" << ms_seq / ms_bank << "x), " << differ
+		 << " pixels differ" << endl;
+
+	// Direct convolution with a sampled kernel grows with sigma; the
+	// pyramid does not. Error is RMS relative to the direct response.
+	double sigmas[] = {1, 2, 4, 8, 16};
+	const int num_sigmas = sizeof(sigmas) / sizeof(sigmas[0]);
+	Mat frame32f, direct;
+	vector<Mat> responses;
+	ScaleSpaceLoG ss;
+	frame.convertTo(frame32f, CV_32F);
+	for (int s = 0; s < num_sigmas; ++s) {
+		Mat kernel = log_kernel(sigmas[s]);
+		Clock::time_point t0 = Clock::now();
+		for (int i = 0; i < iterations; ++i)
+			filter2D(frame32f, direct, CV_32F, kernel, Point(-1, -1), 0,
+					 BORDER_REFLECT_101);
+		Clock::time_point t1 = Clock::now();
+		ss.setScales(vector<double>(1, sigmas[s]));
+		for (int i = 0; i < iterations; ++i)
+			ss.apply(frame, responses);
+		Clock::time_point t2 = Clock::now();
+
+		double ms_direct = chrono::duration<double, milli>(t1 - t0).count() / iterations;
+		double ms_ss     = chrono::duration<double, milli>(t2 - t1).count() / iterations;
+		cout << "LoG sigma " << sigmas[s] << " (" << kernel.cols << "x"
+			 << kernel.rows << "): direct " << ms_direct << " ms, scale space "
+			 << ms_ss << " ms (octave " << ss.octaveOf(0) << "), error "
+			 << norm(responses[0], direct) / norm(direct) << endl;
+	}
+	ss.setScales(vector<double>(sigmas, sigmas + num_sigmas));
+	Clock::time_point t0s = Clock::now();
+	for (int i = 0; i < iterations; ++i)
+		ss.apply(frame, responses);
+	double ms_all = chrono::duration<double, milli>(Clock::now() - t0s).count()
+		/ iterations;
+	cout << "LoG all " << num_sigmas << " sigmas in one call: " << ms_all
+		 << " ms" << endl;
+	cout << "##############################" << endl;
+}
+
 int main(int argvc, char** argv){
-	VideoCapture video;
-	float media[] = {1,1,1,
-					 1,1,1,
-					 1,1,1};
-	
-	float gauss[] = {1,2,1,
-					 2,4,2,
-					 1,2,1};
-	
-	float horizontal[]={-1,0,1,
-						-2,0,2,
-						-1,0,1};
-	
-	float vertical[]={-1,-2,-1,
-					   0,0,0,
-					   1,2,1};
-	
-	float laplacian[]={0,-1,0,
-					  -1,4,-1,
-					   0,-1,0};
-
-	float laplacian_of_gaussian[] = {0,-1,-2,-1,0,
-									 -1,0,2,0,-1,
-									 -2,2,8,2,-2,
-									 -1,0,2,0,-1,
-									 0,-1,-2,-1,0};
-
-	Mat cap, frame, frame32f, frameFiltered;
+	apply_tuning();
+
+	if (argvc >= 2 && string(argv[1]) == "--bench") {
+		bench(argvc > 2 ? atoi(argv[2]) : 1920,
+			  argvc > 3 ? atoi(argv[3]) : 1080,
+			  argvc > 4 ? atoi(argv[4]) : 50);
+		return 0;
+	}
+
+	string source = "0", output, keys;
+	if (!take_stream_options(argvc, argv, source, output) || argvc > 3 ||
+		(argvc == 3 && string(argv[1]) != "-k") || argvc == 2) {
+		cout << "usage: " << argv[0] << " [-i source] [-o output] [-k keys]"
+			 << endl
+			 << "       " << argv[0] << " --bench [width] [height] [iterations]"
+			 << endl
+			 << "\t-i reads a camera number (default 0), a video file, - "
+			 << "for Y4M on stdin or raw:WIDTHxHEIGHT[@FPS]:- for raw BGR. "
+			 << "-o writes the filtered frames to - (Y4M), a .y4m file or "
+			 << "raw:- / raw:file (BGR) instead of showing them." << endl
+			 << "\t-k presses the menu keys given, in order, before the "
+			 << "first frame, e.g. -k s for the scale-space mosaic or "
+			 << "-k xf for the fused laplacian of gaussian." << endl;
+		return 1;
+	}
+	if (argvc == 3) keys = argv[2];
+	size_t next_key = 0;
+
+	FrameSource video;
+	Mat cap, frame, border;
 	Mat mask(3,3,CV_32F), mask1;
-	Mat result, result1;
+	Mat result;
+	Filter filter;
 	double width, height, min, max;
-	int absolut;
+	int absolut, fused, bank, scale_space;
+	double sigma = SCALE_SPACE_SIGMA;
+	ScaleSpaceLoG ss;
+	vector<Mat> responses;
 	char key;
 
-	video.open(0); 
-	if(!video.isOpened()) 
+	video.open(source);
+	if(!video.isOpened()) {
+		cout << video.error() << endl;
 		return -1;
+	}
 
-	width=video.get(CV_CAP_PROP_FRAME_WIDTH);
-	height=video.get(CV_CAP_PROP_FRAME_HEIGHT);
+	// Streaming runs without windows, until the input ends
+	bool show = output.empty();
+	FrameSink sink;
+	if (output == "-" || output == "raw:-") move_messages_to_stderr();
+
+	width=video.size().width;
+	height=video.size().height;
 
 	cout << "width=" << width << "\n";;
 	cout << "height =" << height<< "\n";;
 
-	namedWindow("original", WINDOW_NORMAL);
-	namedWindow("spatialfilter", WINDOW_NORMAL);
+	if (show) {
+		namedWindow("original", WINDOW_NORMAL);
+		namedWindow("spatialfilter", WINDOW_NORMAL);
+	}
 
 	mask = Mat(3, 3, CV_32F, media); 
 	scaleAdd(mask, 1/9.0, Mat::zeros(3,3,CV_32F), mask1);
 	swap(mask, mask1);
+	filter = make_filter<BoxKernel>();
 	absolut=1; // calcs abs of the image
+	fused=0;
+	bank=0;
+	scale_space=0;
 
 	menu();
 	for(;;){
-		video >> cap; 
-		cvtColor(cap, frame, CV_BGR2GRAY);
-		flip(frame, frame, 1);
-		imshow("original", frame);
-		frame.convertTo(frame32f, CV_32F);
-		filter2D(frame32f, frameFiltered, frame32f.depth(), mask, Point(1,1), 0);
-		if(absolut){
-			frameFiltered=abs(frameFiltered);
+		if (next_key < keys.size()) {
+			key = keys[next_key++];
+		} else {
+			{
+				TRACE_SCOPE("decode");
+				if (!video.read(cap)) break;
+			}
+			if (scale_space) {
+				// LoG at sigma, 2 sigma, 4 sigma and 8 sigma from one pyramid
+				cvtColor(cap, frame, CV_BGR2GRAY);
+				flip(frame, frame, 1);
+				if (show) imshow("original", frame);
+				double sigmas[] = {sigma, 2 * sigma, 4 * sigma, 8 * sigma};
+				ss.setScales(vector<double>(sigmas, sigmas + 4));
+				TRACE_SCOPE("scale_space");
+				scale_space_mosaic(ss, frame, result, responses, absolut);
+			} else if (bank) {
+				// every mask over the same frame, shown side by side
+				cvtColor(cap, frame, CV_BGR2GRAY);
+				flip(frame, frame, 1);
+				if (show) imshow("original", frame);
+				TRACE_SCOPE("filter_bank");
+				filter_bank_mosaic(frame, result, absolut, border);
+			} else if (fused) {
+				// grey, flip and filter in one pass over the capture
+				if (show) imshow("original", cap);
+				TRACE_SCOPE("filter_fused");
+				filter.fused(cap, result, absolut);
+			} else {
+				cvtColor(cap, frame, CV_BGR2GRAY);
+				flip(frame, frame, 1);
+				if (show) imshow("original", frame);
+				TRACE_SCOPE("filter");
+				filter.grey(frame, result, absolut, border);
+			}
+			if (!show) {
+				// The first frame fixes the output size, every key was
+				// replayed before it
+				if (!sink.isOpened() &&
+					!sink.open(output, result.size(), video.fps(), true)) {
+					cout << "Could not write " << output << ": " << sink.error()
+						 << endl;
+					return 1;
+				}
+				TRACE_SCOPE("encode");
+				if (!sink.write(result)) break;
+				key = 0;
+			} else {
+				imshow("spatialfilter", result);
+				key = (char) waitKey(10);
+			}
 		}
-		frameFiltered.convertTo(result, CV_8U);
-		imshow("spatialfilter", result);
-		key = (char) waitKey(10);
 		if( key == 27 ) break; // esc pressed!
 		switch(key){
 			case 'a':
 				menu();
 				absolut=!absolut;
 				break;
+			case 'f':
+				menu();
+				fused=!fused;
+				break;
+			case 'b':
+				menu();
+				bank=!bank;
+				break;
+			case 's':
+				menu();
+				scale_space=!scale_space;
+				cout << "sigma = " << sigma << endl;
+				break;
+			case '+':
+				sigma *= pow(2, 0.25);
+				cout << "sigma = " << sigma << endl;
+				break;
+			case '-':
+				sigma = std::max(0.5, sigma / pow(2, 0.25));
+				cout << "sigma = " << sigma << endl;
+				break;
 			case 'm':
 				menu();
 				mask = Mat(3, 3, CV_32F, media);
+				filter = make_filter<BoxKernel>();
 				scaleAdd(mask, 1/9.0, Mat::zeros(3,3,CV_32F), mask1);
 				mask = mask1;
 				printmask(mask);
@@ -108,6 +415,7 @@ int main(int argvc, char** argv){
 			case 'g':
 				menu();
 				mask = Mat(3, 3, CV_32F, gauss);
+				filter = make_filter<GaussKernel>();
 				scaleAdd(mask, 1/16.0, Mat::zeros(3,3,CV_32F), mask1);
 				mask = mask1;
 				printmask(mask);
@@ -115,22 +423,27 @@ int main(int argvc, char** argv){
 			case 'h':
 				menu();
 				mask = Mat(3, 3, CV_32F, horizontal);
+				filter = make_filter<HorizontalKernel>();
 				printmask(mask);
 				break;
 			case 'v':
 				menu();
 				mask = Mat(3, 3, CV_32F, vertical);
+				filter = make_filter<VerticalKernel>();
 				printmask(mask);
 				break;
 			case 'l':
 				menu();
 				mask = Mat(3, 3, CV_32F, laplacian);
+				filter = make_filter<LaplacianKernel>();
 				printmask(mask);
 				break;
 			case 'x':
 				menu();
 				mask = Mat(5, 5, CV_32F, laplacian_of_gaussian);
+				filter = make_filter<LaplacianOfGaussianKernel>();
 				printmask(mask);
+				break;
 			default:
 				break;
 		}
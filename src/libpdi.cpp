@@ -0,0 +1,751 @@
+#include "libpdi.hpp"
+#include "trace.hpp"
+#include "cpu_dispatch.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+
+using namespace cv;
+using namespace std;
+
+namespace pdi {
+
+// ---------------------------------------------------------------- tilt-shift
+
+void TiltShift::setImage(const Mat &bgr) {
+	TRACE_SCOPE("tiltshift_blur");
+	BufferPool &pool = frame_pool();
+	pool.ensure(sharp, bgr.size(), bgr.type());
+	pool.ensure(ping, bgr.size(), bgr.type());
+	pool.ensure(blurred_image, bgr.size(), bgr.type());
+	bgr.copyTo(sharp);
+	// Ping-pong between two buffers; same passes as blurring a fresh
+	// clone every time
+	sharp.copyTo(ping);
+	Mat *src = &ping, *dst = &blurred_image;
+	for (int i = 0; i < passes; ++i) {
+		GaussianBlur(*src, *dst, Size(3, 3), 0, 0);
+		swap(src, dst);
+	}
+	if (src != &blurred_image)
+		src->copyTo(blurred_image);
+}
+
+void TiltShift::rowWeights(const TiltShiftParams &p, vector<uchar> &w) const {
+	double den = (p.decay_strength > 0 ? p.decay_strength/10 : 0.1);
+	w.resize(sharp.rows);
+	for (int i = 0; i < sharp.rows; ++i) {
+		double x = (double) i*100.0 / sharp.rows;
+		double func_val =
+			( tanh( (x-p.start_focus)/den ) -
+			  tanh( ( x-(2*p.center_focus-p.start_focus) )/den ) ) / 2;
+		w[i] = (uchar) std::min(255.0, std::max(0.0, 255*func_val));
+	}
+}
+
+void TiltShift::focusImage(const TiltShiftParams &p, Mat &dst) const {
+	vector<uchar> w;
+	rowWeights(p, w);
+	dst.create(sharp.size(), CV_8UC1);
+	for (int i = 0; i < dst.rows; ++i)
+		dst.row(i).setTo(Scalar(w[i]));
+}
+
+// d = s * a + bl * b over n bytes, rounded and saturated like
+// saturate_cast<uchar>. The variants convert 16 pixels at a time to float
+// and do the same two multiplies and one add (no FMA, so the results are
+// bit-exact with the scalar loop), and return the first byte left to it.
+typedef int (*BlendRowFn)(const uchar *s, const uchar *bl, uchar *d, int n,
+						  float a, float b);
+
+static int blend_row_generic(const uchar *, const uchar *, uchar *, int,
+							 float, float) {
+	return 0;
+}
+
+#ifdef PDI_DISPATCH
+PDI_SSE42 static inline __m128i blend4_sse42(__m128i s, __m128i bl,
+											 __m128 a, __m128 b) {
+	__m128 fs = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(s));
+	__m128 fb = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(bl));
+	return _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(fs, a), _mm_mul_ps(fb, b)));
+}
+
+PDI_SSE42 static int blend_row_sse42(const uchar *s, const uchar *bl, uchar *d,
+									 int n, float a, float b) {
+	__m128 va = _mm_set1_ps(a), vb = _mm_set1_ps(b);
+	int x = 0;
+	for (; x + 16 <= n; x += 16) {
+		__m128i s8 = _mm_loadu_si128((const __m128i*) (s + x));
+		__m128i b8 = _mm_loadu_si128((const __m128i*) (bl + x));
+		__m128i r0 = blend4_sse42(s8, b8, va, vb);
+		__m128i r1 = blend4_sse42(_mm_srli_si128(s8, 4), _mm_srli_si128(b8, 4), va, vb);
+		__m128i r2 = blend4_sse42(_mm_srli_si128(s8, 8), _mm_srli_si128(b8, 8), va, vb);
+		__m128i r3 = blend4_sse42(_mm_srli_si128(s8, 12), _mm_srli_si128(b8, 12), va, vb);
+		_mm_storeu_si128((__m128i*) (d + x),
+						 _mm_packus_epi16(_mm_packs_epi32(r0, r1),
+										  _mm_packs_epi32(r2, r3)));
+	}
+	return x;
+}
+
+PDI_AVX2 static inline __m256i blend8_avx2(__m128i s, __m128i bl,
+										   __m256 a, __m256 b) {
+	__m256 fs = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(s));
+	__m256 fb = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bl));
+	return _mm256_cvtps_epi32(_mm256_add_ps(_mm256_mul_ps(fs, a),
+											_mm256_mul_ps(fb, b)));
+}
+
+PDI_AVX2 static int blend_row_avx2(const uchar *s, const uchar *bl, uchar *d,
+								   int n, float a, float b) {
+	__m256 va = _mm256_set1_ps(a), vb = _mm256_set1_ps(b);
+	int x = 0;
+	for (; x + 16 <= n; x += 16) {
+		__m128i s8 = _mm_loadu_si128((const __m128i*) (s + x));
+		__m128i b8 = _mm_loadu_si128((const __m128i*) (bl + x));
+		__m256i lo = blend8_avx2(s8, b8, va, vb);
+		__m256i hi = blend8_avx2(_mm_srli_si128(s8, 8), _mm_srli_si128(b8, 8),
+								 va, vb);
+		// packs works within 128-bit lanes, put the quarters back in order
+		__m256i w = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+		_mm_storeu_si128((__m128i*) (d + x),
+						 _mm_packus_epi16(_mm256_castsi256_si128(w),
+										  _mm256_extracti128_si256(w, 1)));
+	}
+	return x;
+}
+
+PDI_AVX512 static int blend_row_avx512(const uchar *s, const uchar *bl, uchar *d,
+									   int n, float a, float b) {
+	__m512 va = _mm512_set1_ps(a), vb = _mm512_set1_ps(b);
+	int x = 0;
+	for (; x + 16 <= n; x += 16) {
+		__m512 fs = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(
+						_mm_loadu_si128((const __m128i*) (s + x))));
+		__m512 fb = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(
+						_mm_loadu_si128((const __m128i*) (bl + x))));
+		__m512i r = _mm512_cvtps_epi32(_mm512_add_ps(_mm512_mul_ps(fs, va),
+													 _mm512_mul_ps(fb, vb)));
+		_mm_storeu_si128((__m128i*) (d + x), _mm512_cvtusepi32_epi8(r));
+	}
+	return x;
+}
+#endif
+
+static BlendRowFn select_blend_row() {
+#ifdef PDI_DISPATCH
+	switch (cpu_level()) {
+	case CPU_AVX512: return blend_row_avx512;
+	case CPU_AVX2:   return blend_row_avx2;
+	case CPU_SSE42:  return blend_row_sse42;
+	default: break;
+	}
+#endif
+	return blend_row_generic;
+}
+
+// sharp * w + blurred * (1 - w) per row, in the same float operations as
+// the original multiply / addWeighted / convertTo chain
+class TiltBlendBody : public ParallelLoopBody {
+public:
+	TiltBlendBody(const Mat &sharp, const Mat &blurred,
+				  const vector<uchar> &w, Mat &dst)
+		: sharp(sharp), blurred(blurred), w(w), dst(dst),
+		  blend_row(select_blend_row()) {}
+
+	void operator()(const Range &r) const {
+		const float scale = (float) (1.0/255.0);
+		int n = sharp.cols * sharp.channels();
+		for (int y = r.start; y < r.end; ++y) {
+			float a = w[y] * scale, b = (uchar) (255 - w[y]) * scale;
+			const uchar *s = sharp.ptr<uchar>(y), *bl = blurred.ptr<uchar>(y);
+			uchar *d = dst.ptr<uchar>(y);
+			for (int x = blend_row(s, bl, d, n, a, b); x < n; ++x)
+				d[x] = saturate_cast<uchar>(s[x] * a + bl[x] * b);
+		}
+	}
+
+private:
+	const Mat &sharp, &blurred;
+	const vector<uchar> &w;
+	Mat &dst;
+	BlendRowFn blend_row;
+};
+
+bool TiltShift::render(const TiltShiftParams &p, Mat &dst,
+					   const CancelCheck &cancelled) {
+	{
+		TRACE_SCOPE("tiltshift_blend");
+		rowWeights(p, weights);
+		frame_pool().ensure(dst, sharp.size(), sharp.type());
+		parallel_for_(Range(0, sharp.rows),
+					  TiltBlendBody(sharp, blurred_image, weights, dst));
+	}
+	if (cancelled && cancelled()) return false;
+
+	TRACE_SCOPE("tiltshift_saturation");
+	frame_pool().ensure(hsv, dst.size(), CV_8UC3);
+	cvtColor(dst, hsv, CV_BGR2HSV);
+	for (int y = 0; y < hsv.rows; ++y) {
+		uchar *q = hsv.ptr<uchar>(y);
+		for (int x = 0; x < hsv.cols; ++x)
+			q[3*x+1] = saturate_cast<uchar>(q[3*x+1] + p.hue_gain);
+	}
+	cvtColor(hsv, dst, CV_HSV2BGR);
+	return true;
+}
+
+// --------------------------------------------------------------- homomorphic
+
+// Swaps the quadrants of a transform so its origin is in the centre
+static void shift_dft(Mat &image) {
+	Mat tmp, A, B, C, D;
+	int cx = image.cols/2;
+	int cy = image.rows/2;
+
+	// A B   ->  D C
+	// C D       B A
+	A = image(Rect(0, 0, cx, cy));
+	B = image(Rect(cx, 0, cx, cy));
+	C = image(Rect(0, cy, cx, cy));
+	D = image(Rect(cx, cy, cx, cy));
+
+	A.copyTo(tmp);  D.copyTo(A);  tmp.copyTo(D);
+	C.copyTo(tmp);  B.copyTo(C);  tmp.copyTo(B);
+}
+
+// Optimal DFT size, but even so the quadrants swap cleanly
+static int even_dft_size(int n) {
+	int size = getOptimalDFTSize(n);
+	while (size & 1)
+		size = getOptimalDFTSize(size + 1);
+	return size;
+}
+
+void HomomorphicFilter::setImage(const Mat &image) {
+	TRACE_SCOPE("homomorphic_fft");
+	BufferPool &pool = frame_pool();
+	Mat src = image;
+	if (image.channels() == 3) {
+		pool.ensure(grey, image.size(), CV_8UC1);
+		cvtColor(image, grey, CV_BGR2GRAY);
+		src = grey;
+	}
+	image_size = src.size();
+
+	int dft_M = even_dft_size(src.rows);
+	int dft_N = even_dft_size(src.cols);
+	Size dft_size(dft_N, dft_M);
+	pool.ensure(padded, dft_size, CV_8UC1);
+	copyMakeBorder(src, padded, 0, dft_M - src.rows, 0, dft_N - src.cols,
+				   BORDER_CONSTANT, Scalar::all(0));
+
+	planes.resize(2);
+	pool.ensure(planes[0], dft_size, CV_32F);
+	pool.ensure(planes[1], dft_size, CV_32F);
+	pool.ensure(spectrum, dft_size, CV_32FC2);
+	padded.convertTo(planes[0], CV_32F);
+	planes[1].setTo(Scalar::all(0));
+	merge(planes, spectrum);
+	dft(spectrum, spectrum);
+	shift_dft(spectrum);
+}
+
+void HomomorphicFilter::buildFilter(const HomomorphicParams &p) {
+	int dft_M = spectrum.rows, dft_N = spectrum.cols;
+	frame_pool().ensure(gain, spectrum.size(), CV_32F);
+	frame_pool().ensure(filter, spectrum.size(), CV_32FC2);
+	for (int i = 0; i < dft_M; i++) {
+		float *g = gain.ptr<float>(i);
+		for (int j = 0; j < dft_N; j++) {
+			float d2 = (i-dft_M/2)*(i-dft_M/2)+(j-dft_N/2)*(j-dft_N/2);
+			g[j] = (p.gamma_h-p.gamma_l)*(1.0 - (float)exp(-(p.c*d2/(p.d0*p.d0)))) + p.gamma_l;
+		}
+	}
+	Mat comps[] = {gain, gain};
+	merge(comps, 2, filter);
+}
+
+bool HomomorphicFilter::apply(const HomomorphicParams &p, Mat &dst,
+							  const CancelCheck &cancelled) {
+	{
+		TRACE_SCOPE("homomorphic_build_filter");
+		buildFilter(p);
+	}
+	if (cancelled && cancelled()) return false;
+	TRACE_SCOPE("homomorphic_refilter");
+	frame_pool().ensure(work, spectrum.size(), CV_32FC2);
+	frame_pool().ensure(dst, image_size, CV_32F);
+	mulSpectrums(spectrum, filter, work, 0);
+	shift_dft(work);
+	if (cancelled && cancelled()) return false;
+	idft(work, work);
+	if (cancelled && cancelled()) return false;
+	split(work, planes);
+	normalize(planes[0], planes[0], 0, 1, CV_MINMAX);
+	planes[0](Rect(0, 0, image_size.width, image_size.height)).copyTo(dst);
+	return true;
+}
+
+// ------------------------------------------------------------------- bubbles
+
+static int find_root(vector<int> &parent, int i) {
+	while (parent[i] != i) {
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+
+int label_components(const Mat &mask, uchar value, Mat &labels,
+					 vector<int> &parent) {
+	labels.create(mask.size(), CV_32S);
+	parent.assign(1, 0);
+
+	// First pass: provisional labels from the left and upper neighbours,
+	// equivalences recorded in a union-find forest
+	for (int y = 0; y < mask.rows; ++y) {
+		const uchar *m = mask.ptr<uchar>(y);
+		const uchar *mu = y > 0 ? mask.ptr<uchar>(y-1) : NULL;
+		int *l = labels.ptr<int>(y);
+		const int *lu = y > 0 ? labels.ptr<int>(y-1) : NULL;
+		for (int x = 0; x < mask.cols; ) {
+			// Skip to the next run of value; memchr is already CPUID
+			// dispatched by the C library, and the zero fill is a memset
+			const uchar *hit = (const uchar*) memchr(m + x, value, mask.cols - x);
+			int start = hit ? (int) (hit - m) : mask.cols;
+			std::fill(l + x, l + start, 0);
+			for (x = start; x < mask.cols && m[x] == value; ++x) {
+				int left = x > start ? l[x-1] : 0;
+				int up = mu && mu[x] == value ? lu[x] : 0;
+				if (!left && !up) {
+					l[x] = parent.size();
+					parent.push_back(l[x]);
+				} else if (left && up && left != up) {
+					int a = find_root(parent, left), b = find_root(parent, up);
+					if (a < b) parent[b] = a;
+					else parent[a] = b;
+					l[x] = std::min(a, b);
+				} else {
+					l[x] = left ? left : up;
+				}
+			}
+		}
+	}
+
+	// Second pass: roots numbered consecutively in order of appearance
+	vector<int> number(parent.size(), 0);
+	int count = 0;
+	for (size_t i = 1; i < parent.size(); ++i) {
+		int r = find_root(parent, i);
+		if (!number[r]) number[r] = ++count;
+		number[i] = number[r];
+	}
+	for (int y = 0; y < labels.rows; ++y) {
+		int *l = labels.ptr<int>(y);
+		for (int x = 0; x < labels.cols; ++x)
+			l[x] = number[l[x]];
+	}
+	return count;
+}
+
+int BubbleCounter::label(const Mat &m, uchar value, Mat &labels) {
+	return label_components(m, value, labels, parent);
+}
+
+BubbleStats BubbleCounter::count(const Mat &image) {
+	TRACE_SCOPE("bubbles_count");
+	if (image.channels() == 3)
+		cvtColor(image, grey, CV_BGR2GRAY);
+	else
+		image.copyTo(grey);
+	threshold(grey, mask, 127, 255, THRESH_BINARY);
+
+	// Bubbles on the border go to the background
+	int n = label(mask, 255, white_labels);
+	vector<uchar> on_border(n + 1, 0);
+	int rows = mask.rows, cols = mask.cols;
+	for (int x = 0; x < cols; ++x) {
+		on_border[white_labels.at<int>(0, x)] = 1;
+		on_border[white_labels.at<int>(rows-1, x)] = 1;
+	}
+	for (int y = 0; y < rows; ++y) {
+		on_border[white_labels.at<int>(y, 0)] = 1;
+		on_border[white_labels.at<int>(y, cols-1)] = 1;
+	}
+	remap.assign(n + 1, 0);
+	num_bubbles = 0;
+	for (int i = 1; i <= n; ++i)
+		if (!on_border[i]) remap[i] = ++num_bubbles;
+	for (int y = 0; y < rows; ++y) {
+		int *l = white_labels.ptr<int>(y);
+		uchar *m = mask.ptr<uchar>(y);
+		for (int x = 0; x < cols; ++x) {
+			l[x] = remap[l[x]];
+			if (!l[x]) m[x] = 0;
+		}
+	}
+
+	// The region around a bubble is the black one just above its first
+	// pixel in raster order: no hole of that bubble reaches above its
+	// top row. Any other black region it touches is a hole.
+	label(mask, 0, black_labels);
+	outside.assign(num_bubbles + 1, -1);
+	holes.assign(num_bubbles + 1, 0);
+	for (int y = 1; y < rows - 1; ++y) {
+		const int *l = white_labels.ptr<int>(y);
+		const int *bu = black_labels.ptr<int>(y-1);
+		const int *b = black_labels.ptr<int>(y);
+		const int *bd = black_labels.ptr<int>(y+1);
+		for (int x = 1; x < cols - 1; ++x) {
+			int w = l[x];
+			if (!w) continue;
+			if (outside[w] < 0) outside[w] = bu[x];
+			int o = outside[w];
+			if ((bu[x] && bu[x] != o) || (bd[x] && bd[x] != o) ||
+				(b[x-1] && b[x-1] != o) || (b[x+1] && b[x+1] != o))
+				holes[w] = 1;
+		}
+	}
+
+	BubbleStats stats = {num_bubbles, 0};
+	for (int i = 1; i <= num_bubbles; ++i)
+		stats.with_holes += holes[i];
+	return stats;
+}
+
+void BubbleCounter::renderBinary(Mat &dst) const {
+	mask.copyTo(dst);
+}
+
+void BubbleCounter::renderColored(Mat &dst) {
+	TRACE_SCOPE("bubbles_render");
+	colors.resize(num_bubbles + 1);
+	colors[0] = Vec3b(0, 0, 0);
+	for (int i = 1; i <= num_bubbles; ++i) {
+		if (holes[i])
+			colors[i] = Vec3b(255, 0, 0);
+		else
+			colors[i] = Vec3b(rng.uniform(0, 51), rng.uniform(0, 256),
+							  rng.uniform(0, 256));
+	}
+	dst.create(white_labels.size(), CV_8UC3);
+	for (int y = 0; y < dst.rows; ++y) {
+		const int *l = white_labels.ptr<int>(y);
+		Vec3b *d = dst.ptr<Vec3b>(y);
+		for (int x = 0; x < dst.cols; ++x)
+			d[x] = colors[l[x]];
+	}
+}
+
+// --------------------------------------------------------------- pointillism
+
+void Pointillism::ranges(Size size, int step) {
+	xrange.resize(size.height/step);
+	yrange.resize(size.width/step);
+	for (size_t i = 0; i < xrange.size(); ++i)
+		xrange[i] = (i * step) + (step / 2);
+	for (size_t j = 0; j < yrange.size(); ++j)
+		yrange[j] = (j * step) + (step / 2);
+}
+
+void Pointillism::shuffle(vector<int> &v) {
+	for (int i = (int) v.size() - 1; i > 0; --i)
+		std::swap(v[i], v[rng.uniform(0, i + 1)]);
+}
+
+void Pointillism::dot(const Mat &bgr, Mat &dst, int i, int j, int jitter,
+					  int radius) {
+	int x = i + rng.uniform(0, 2*jitter) - jitter + 1;
+	int y = j + rng.uniform(0, 2*jitter) - jitter + 1;
+	x = std::min(std::max(x, 0), bgr.rows - 1);
+	y = std::min(std::max(y, 0), bgr.cols - 1);
+	Vec3b color = bgr.at<Vec3b>(x, y);
+	circle(dst, Point(y, x), radius, Scalar(color), -1, CV_AA);
+}
+
+void Pointillism::render(const Mat &bgr, Mat &dst, const PointillismParams &p) {
+	{
+		TRACE_SCOPE("pointillism_grid");
+		cvtColor(bgr, grey, CV_BGR2GRAY);
+		dst.create(bgr.size(), CV_8UC3);
+		dst.setTo(Scalar(255, 255, 255));
+
+		ranges(bgr.size(), p.step);
+		shuffle(xrange);
+		for (size_t a = 0; a < xrange.size(); ++a) {
+			shuffle(yrange);
+			for (size_t b = 0; b < yrange.size(); ++b)
+				dot(bgr, dst, xrange[a], yrange[b], p.jitter, p.radius);
+		}
+	}
+
+	// Finer grids, smaller dots, only where there are edges
+	for (int r = 0; r < p.rounds; ++r) {
+		int thresh = p.thresh_min +
+			(p.rounds > 1 ? r * (p.thresh_max - p.thresh_min) / (p.rounds - 1) : 0);
+		int step = p.rounds - r;
+		TRACE_SCOPE("pointillism_round");
+		Canny(grey, border, thresh, 3*thresh);
+		ranges(bgr.size(), step);
+		shuffle(xrange);
+		for (size_t a = 0; a < xrange.size(); ++a) {
+			shuffle(yrange);
+			const uchar *e = border.ptr<uchar>(xrange[a]);
+			for (size_t b = 0; b < yrange.size(); ++b)
+				if (e[yrange[b]] == 255)
+					dot(bgr, dst, xrange[a], yrange[b], p.jitter, 5 * step);
+		}
+	}
+}
+
+// ----------------------------------------------------------- spatial filters
+
+void spatial_filter(const Mat &grey, Mat &dst, SpatialFilter f, bool absolute,
+					Mat &scratch) {
+	TRACE_SCOPE("spatial_filter");
+	switch (f) {
+	case FILTER_MEAN:       apply_kernel<BoxKernel>(grey, dst, absolute, scratch); break;
+	case FILTER_GAUSS:      apply_kernel<GaussKernel>(grey, dst, absolute, scratch); break;
+	case FILTER_HORIZONTAL: apply_kernel<HorizontalKernel>(grey, dst, absolute, scratch); break;
+	case FILTER_VERTICAL:   apply_kernel<VerticalKernel>(grey, dst, absolute, scratch); break;
+	case FILTER_LAPLACIAN:  apply_kernel<LaplacianKernel>(grey, dst, absolute, scratch); break;
+	case FILTER_LOG:        apply_kernel<LaplacianOfGaussianKernel>(grey, dst, absolute, scratch); break;
+	}
+}
+
+// ------------------------------------------------------------------ pipeline
+
+enum OpKind {
+	OP_GREY, OP_EQUALIZE, OP_ADAPTIVE, OP_SAMPLED, OP_FILTER, OP_TILTSHIFT,
+	OP_HOMOMORPHIC, OP_BUBBLES, OP_POINTILLISM, OP_NEGATE, OP_SWAP, OP_SAVE
+};
+
+// Stage names for tracing, by OpKind
+static const char *op_stages[] = {
+	"op_grey", "op_equalize", "op_equalize_adaptive", "op_equalize_sampled",
+	"op_filter", "op_tiltshift", "op_homomorphic", "op_bubbles",
+	"op_pointillism", "op_negate", "op_swap", "op_save"
+};
+
+struct Pipeline::Op {
+	OpKind kind;
+	string name;
+	vector<double> args;
+	SpatialFilter filter;
+	bool absolute;
+	string path;
+	vector<Rect> rects;
+	int grid_rows, grid_cols;
+	vector<int> perm;
+};
+
+Pipeline::Pipeline() {}
+
+Pipeline::~Pipeline() {
+	for (size_t i = 0; i < ops.size(); ++i)
+		delete ops[i];
+}
+
+// "a,b,c" into numbers; false if any is not one
+static bool parse_numbers(const string &s, vector<double> &out) {
+	out.clear();
+	stringstream ss(s);
+	string item;
+	while (getline(ss, item, ',')) {
+		char *end;
+		double v = strtod(item.c_str(), &end);
+		if (item.empty() || *end) return false;
+		out.push_back(v);
+	}
+	return true;
+}
+
+bool Pipeline::parse(const string &spec, string &error) {
+	for (size_t i = 0; i < ops.size(); ++i)
+		delete ops[i];
+	ops.clear();
+
+	stringstream ss(spec);
+	string token;
+	while (ss >> token) {
+		size_t colon = token.find(':');
+		string name = token.substr(0, colon);
+		string arg = colon == string::npos ? "" : token.substr(colon + 1);
+		Op *op = new Op();
+		ops.push_back(op);
+		op->name = name;
+		op->absolute = true;
+		bool ok = true;
+
+		if (name == "grey") {
+			op->kind = OP_GREY;
+		} else if (name == "equalize") {
+			op->kind = arg == "adaptive" ? OP_ADAPTIVE :
+					   arg == "sampled" ? OP_SAMPLED : OP_EQUALIZE;
+			ok = arg.empty() || arg == "global" || arg == "adaptive" ||
+				 arg == "sampled";
+		} else if (name == "filter") {
+			static const char *names[] = {"mean", "gauss", "horizontal",
+										  "vertical", "laplacian", "log"};
+			op->kind = OP_FILTER;
+			size_t comma = arg.find(',');
+			string which = arg.substr(0, comma);
+			op->absolute = comma == string::npos || arg.substr(comma + 1) != "signed";
+			ok = false;
+			for (int f = 0; f < 6; ++f)
+				if (which == names[f]) {
+					op->filter = (SpatialFilter) f;
+					ok = true;
+				}
+		} else if (name == "tiltshift") {
+			op->kind = OP_TILTSHIFT;
+			ok = parse_numbers(arg, op->args) && op->args.size() <= 4;
+		} else if (name == "homomorphic") {
+			op->kind = OP_HOMOMORPHIC;
+			ok = parse_numbers(arg, op->args) && op->args.size() <= 4;
+		} else if (name == "bubbles") {
+			op->kind = OP_BUBBLES;
+		} else if (name == "pointillism") {
+			op->kind = OP_POINTILLISM;
+			ok = parse_numbers(arg, op->args) && op->args.size() <= 1;
+		} else if (name == "negate") {
+			op->kind = OP_NEGATE;
+			bool opened;
+			ok = !arg.empty() && read_rectangles(arg, op->rects, &opened) == 0 &&
+				 opened;
+		} else if (name == "swap") {
+			op->kind = OP_SWAP;
+			ok = read_permutation(arg, op->grid_rows, op->grid_cols, op->perm);
+		} else if (name == "save") {
+			op->kind = OP_SAVE;
+			op->path = arg;
+			ok = !arg.empty();
+		} else {
+			error = "unknown operation " + name;
+			return false;
+		}
+		if (!ok) {
+			error = "invalid arguments for " + token;
+			return false;
+		}
+	}
+	if (ops.empty()) {
+		error = "no operations";
+		return false;
+	}
+	return true;
+}
+
+static double arg_or(const vector<double> &args, size_t i, double fallback) {
+	return i < args.size() ? args[i] : fallback;
+}
+
+bool Pipeline::run(Mat &image, string &report, string &error) {
+	const uchar *input = image.datastart;
+	bool ok = runOps(image, report, error);
+	// The swaps can leave out or scratch holding the caller's buffer; drop
+	// those so the next input is not written through a stale header
+	if (input && out.datastart == input) out.release();
+	if (input && scratch.datastart == input) scratch.release();
+	return ok;
+}
+
+bool Pipeline::runOps(Mat &image, string &report, string &error) {
+	for (size_t i = 0; i < ops.size(); ++i) {
+		const Op &op = *ops[i];
+		TRACE_SCOPE(op_stages[op.kind]);
+		bool colour = image.channels() == 3;
+		if (image.depth() != CV_8U || (image.channels() != 1 && !colour)) {
+			error = op.name + " needs an 8-bit grey or BGR image";
+			return false;
+		}
+
+		switch (op.kind) {
+		case OP_GREY:
+			if (colour) {
+				cvtColor(image, out, CV_BGR2GRAY);
+				swap(image, out);
+			}
+			break;
+		case OP_EQUALIZE:
+		case OP_ADAPTIVE:
+		case OP_SAMPLED:
+		case OP_FILTER:
+			if (colour) {
+				cvtColor(image, scratch, CV_BGR2GRAY);
+				swap(image, scratch);
+			}
+			if (op.kind == OP_EQUALIZE) equalize_global(image, out);
+			else if (op.kind == OP_ADAPTIVE) clahe.apply(image, out);
+			else if (op.kind == OP_SAMPLED) sampled.apply(image, out);
+			else spatial_filter(image, out, op.filter, op.absolute, scratch);
+			swap(image, out);
+			break;
+		case OP_TILTSHIFT: {
+			if (!colour) {
+				cvtColor(image, scratch, CV_GRAY2BGR);
+				swap(image, scratch);
+			}
+			TiltShiftParams p(arg_or(op.args, 0, 20), arg_or(op.args, 1, 100),
+							  arg_or(op.args, 2, 50), (int) arg_or(op.args, 3, 0));
+			tiltshift.setImage(image);
+			tiltshift.render(p, out);
+			swap(image, out);
+			break;
+		}
+		case OP_HOMOMORPHIC: {
+			HomomorphicParams p(arg_or(op.args, 0, 0), arg_or(op.args, 1, 0.5),
+								arg_or(op.args, 2, 12.5), arg_or(op.args, 3, 0.05));
+			homomorphic.setImage(image);
+			homomorphic.apply(p, scratch);
+			scratch.convertTo(image, CV_8U, 255);
+			break;
+		}
+		case OP_BUBBLES: {
+			BubbleStats stats = bubbles.count(image);
+			stringstream msg;
+			msg << "bubbles " << stats.bubbles << " with_holes "
+				<< stats.with_holes << "\n";
+			report += msg.str();
+			bubbles.renderColored(out);
+			swap(image, out);
+			break;
+		}
+		case OP_POINTILLISM:
+			if (!colour) {
+				cvtColor(image, scratch, CV_GRAY2BGR);
+				swap(image, scratch);
+			}
+			if (!op.args.empty())
+				pointillism.reseed((uint64) op.args[0]);
+			pointillism.render(image, out);
+			swap(image, out);
+			break;
+		case OP_NEGATE: {
+			RegionSet regions;
+			regions.build(op.rects, image.size());
+			regions.negate(image);
+			break;
+		}
+		case OP_SWAP: {
+			TileGrid grid(image.size(), op.grid_rows, op.grid_cols);
+			permute_tiles_in_place(image, grid, op.perm);
+			break;
+		}
+		case OP_SAVE:
+			if (!imwrite(op.path, image)) {
+				error = "could not write " + op.path;
+				return false;
+			}
+			break;
+		}
+	}
+	return true;
+}
+
+} // namespace pdi
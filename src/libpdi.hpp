@@ -0,0 +1,226 @@
+#ifndef LIBPDI_HPP
+#define LIBPDI_HPP
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <opencv2/opencv.hpp>
+#include "equalize_engine.hpp"
+#include "spatial_kernels.hpp"
+#include "roi_engine.hpp"
+#include "tile_permute.hpp"
+#include "buffer_pool.hpp"
+
+// Headless processing kernels behind the GUI tools, built into
+// bin/libpdi.a. Nothing in here opens a window or touches global state:
+// every object can be used from any thread as long as each thread has its
+// own, and objects keep their working buffers between calls so repeated
+// use on same-sized images does not allocate.
+//
+// The kernels that already live in headers (equalize_engine.hpp,
+// spatial_kernels.hpp, scale_space.hpp, roi_engine.hpp, tile_permute.hpp)
+// are headless as they are; this adds the rest, plus Pipeline, which
+// chains them by name for the pdi batch tool.
+
+namespace pdi {
+
+// Polled by the longer renders between stages; when it returns true they
+// stop early and return false, leaving the output unspecified
+typedef std::function<bool()> CancelCheck;
+
+// Tilt-shift: the image stays sharp in a horizontal band and fades into a
+// blurred copy above and below it, then gets its saturation raised.
+// Focus values are percentages of the image height.
+struct TiltShiftParams {
+	double start_focus;    // where the sharp band starts
+	double decay_strength; // how soft the transition is, 0 to 100
+	double center_focus;   // middle of the band
+	int hue_gain;          // added to the saturation, 0 to 255
+
+	TiltShiftParams(double start_focus = 20, double decay_strength = 100,
+					double center_focus = 50, int hue_gain = 0)
+		: start_focus(start_focus), decay_strength(decay_strength),
+		  center_focus(center_focus), hue_gain(hue_gain) {}
+};
+
+class TiltShift {
+public:
+	// blur_passes 3x3 Gaussian blurs make the blurred copy
+	explicit TiltShift(int blur_passes = 100) : passes(blur_passes) {}
+
+	// Takes a BGR image and blurs it; render() can then run any number
+	// of times with different parameters
+	void setImage(const cv::Mat &bgr);
+	const cv::Mat& image() const { return sharp; }
+	const cv::Mat& blurred() const { return blurred_image; }
+
+	// Weight of the sharp image per row, 0 to 255
+	void rowWeights(const TiltShiftParams &p, std::vector<uchar> &weights) const;
+	// The same weights as a single-channel image of the input's size
+	void focusImage(const TiltShiftParams &p, cv::Mat &dst) const;
+
+	bool render(const TiltShiftParams &p, cv::Mat &dst,
+				const CancelCheck &cancelled = CancelCheck());
+
+private:
+	int passes;
+	cv::Mat sharp, blurred_image, ping;
+	std::vector<uchar> weights;
+	cv::Mat hsv;
+};
+
+// Frequency-domain emphasis of the grey image: the spectrum is scaled by
+// (gamma_h - gamma_l) * (1 - exp(-c * d^2 / d0^2)) + gamma_l, d being the
+// distance to its centre.
+struct HomomorphicParams {
+	float gamma_l, gamma_h, d0, c;
+
+	HomomorphicParams(float gamma_l = 0, float gamma_h = 0.5, float d0 = 12.5,
+					  float c = 0.05)
+		: gamma_l(gamma_l), gamma_h(gamma_h), d0(d0), c(c) {}
+};
+
+class HomomorphicFilter {
+public:
+	// Takes a grey or BGR image and computes its centred spectrum once
+	void setImage(const cv::Mat &image);
+
+	// Filters the spectrum with p and writes the result, CV_32F normalised
+	// to [0, 1] over the padded transform, at the input's size
+	bool apply(const HomomorphicParams &p, cv::Mat &dst,
+			   const CancelCheck &cancelled = CancelCheck());
+
+	cv::Size size() const { return image_size; }
+
+private:
+	void buildFilter(const HomomorphicParams &p);
+
+	cv::Size image_size;
+	cv::Mat grey, padded, spectrum, work, filter, gain;
+	std::vector<cv::Mat> planes;
+};
+
+struct BubbleStats {
+	int bubbles;    // not touching the border
+	int with_holes;
+};
+
+// Counts the white bubbles of a black and white image with connected
+// component labelling (4-connected, like floodFill), ignoring bubbles cut
+// by the border. A bubble has holes when a black region it touches is not
+// the one around it.
+class BubbleCounter {
+public:
+	BubbleCounter() : rng(0) {}
+
+	// Any 8-bit grey or BGR image, thresholded at 128
+	BubbleStats count(const cv::Mat &image);
+
+	// Bubbles kept, CV_32S, 1 to bubbles, 0 for the background
+	const cv::Mat& labels() const { return white_labels; }
+	bool hasHoles(int label) const { return holes[label] != 0; }
+
+	// White bubbles over black, without the ones on the border
+	void renderBinary(cv::Mat &dst) const;
+	// Bubbles with holes in blue, the others in random colours
+	void renderColored(cv::Mat &dst);
+
+private:
+	int label(const cv::Mat &mask, uchar value, cv::Mat &labels);
+
+	cv::RNG rng;
+	cv::Mat grey, mask, white_labels, black_labels;
+	std::vector<int> parent, remap, outside;
+	std::vector<uchar> holes;
+	std::vector<cv::Vec3b> colors;
+	int num_bubbles;
+};
+
+// Int labels of the 4-connected components of the pixels of mask equal to
+// value, numbered from 1; 0 elsewhere. Returns the number of components.
+int label_components(const cv::Mat &mask, uchar value, cv::Mat &labels,
+					 std::vector<int> &parent);
+
+// Pointillism: jittered dots over a grid, then smaller dots along Canny
+// edges found with rising thresholds.
+struct PointillismParams {
+	int step, jitter, radius, rounds;
+	int thresh_min, thresh_max;
+
+	PointillismParams()
+		: step(5), jitter(15), radius(30), rounds(3), thresh_min(20),
+		  thresh_max(100) {}
+};
+
+class Pointillism {
+public:
+	// Seed 0 picks one from the clock
+	explicit Pointillism(uint64 seed = 0) { reseed(seed); }
+	void reseed(uint64 seed) { rng = cv::RNG(seed ? seed : cv::getTickCount()); }
+
+	void render(const cv::Mat &bgr, cv::Mat &dst,
+				const PointillismParams &p = PointillismParams());
+
+private:
+	void ranges(cv::Size size, int step);
+	void shuffle(std::vector<int> &v);
+	void dot(const cv::Mat &bgr, cv::Mat &dst, int i, int j, int jitter,
+			 int radius);
+
+	cv::RNG rng;
+	std::vector<int> xrange, yrange;
+	cv::Mat grey, border;
+};
+
+// The integer masks of laplgauss by name
+enum SpatialFilter {
+	FILTER_MEAN, FILTER_GAUSS, FILTER_HORIZONTAL, FILTER_VERTICAL,
+	FILTER_LAPLACIAN, FILTER_LOG
+};
+
+void spatial_filter(const cv::Mat &grey, cv::Mat &dst, SpatialFilter f,
+					bool absolute, cv::Mat &scratch);
+
+// Operations run one after the other over an image, given as text:
+//   grey, equalize[:global|adaptive|sampled],
+//   filter:mean|gauss|horizontal|vertical|laplacian|log[,signed],
+//   tiltshift[:start,decay,center,hue_gain], homomorphic[:gl,gh,d0,c],
+//   bubbles, pointillism[:seed], negate:<rect_file>, swap:<perm_file>,
+//   save:<path>
+// separated by spaces. Files named by the operations are read once, when
+// parsing. Each thread needs its own Pipeline.
+class Pipeline {
+public:
+	Pipeline();
+	~Pipeline();
+
+	bool parse(const std::string &spec, std::string &error);
+
+	// Runs every operation on image, which may change size and type.
+	// Anything operations report (bubble counts, say) goes to report.
+	// The pipeline keeps no reference to image's memory afterwards, so it
+	// may be a view of a buffer the caller frees (a mapped file).
+	bool run(cv::Mat &image, std::string &report, std::string &error);
+
+	size_t size() const { return ops.size(); }
+
+private:
+	struct Op;
+	Pipeline(const Pipeline&);
+	Pipeline& operator=(const Pipeline&);
+
+	bool runOps(cv::Mat &image, std::string &report, std::string &error);
+
+	std::vector<Op*> ops;
+	TiltShift tiltshift;
+	HomomorphicFilter homomorphic;
+	BubbleCounter bubbles;
+	Pointillism pointillism;
+	TiledEqualizer clahe;
+	SampledEqualizer sampled;
+	cv::Mat scratch, out;
+};
+
+} // namespace pdi
+
+#endif
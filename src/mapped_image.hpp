@@ -0,0 +1,236 @@
+#ifndef MAPPED_IMAGE_HPP
+#define MAPPED_IMAGE_HPP
+
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <string>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <opencv2/opencv.hpp>
+
+// Uncompressed images (binary PGM, binary PPM, or raw pixels at a known
+// offset) memory-mapped and exposed as a Mat over the mapping, without
+// decoding or copying. Only the pages a tool actually touches are read
+// from disk, so working on a rectangle of a huge image costs about the
+// rectangle.
+//
+// Mapped for writing back, changes to the Mat land in the file. Otherwise
+// the mapping is private: the Mat can still be modified, but touched
+// pages are copied on write and the file is left alone.
+//
+// PPM stores RGB, so a PPM view is in that order rather than OpenCV's
+// BGR; isRGB() says so.
+
+class MappedImage {
+public:
+	MappedImage() : fd(-1), map(NULL), map_size(0), rgb(false), shared(false) {}
+	~MappedImage() { close(); }
+
+	// True when path starts like a binary PGM or PPM
+	static bool isMappable(const std::string &path) {
+		FILE *f = fopen(path.c_str(), "rb");
+		if (!f) return false;
+		char magic[2] = {0, 0};
+		bool ok = fread(magic, 1, 2, f) == 2 && magic[0] == 'P' &&
+			(magic[1] == '5' || magic[1] == '6');
+		fclose(f);
+		return ok;
+	}
+
+	// Maps a binary PGM (CV_8UC1) or PPM (CV_8UC3) with maxval up to 255
+	bool open(const std::string &path, bool write_back = false) {
+		close();
+		if (!openFile(path, write_back)) return false;
+
+		// Header is at most a few lines, read it through the mapping
+		const char *p = (const char*) map, *end = p + map_size;
+		int values[3], channels;
+		if (end - p < 2 || p[0] != 'P' || (p[1] != '5' && p[1] != '6'))
+			return fail();
+		channels = p[1] == '6' ? 3 : 1;
+		p += 2;
+		for (int i = 0; i < 3; ++i) {
+			while (p < end && (isspace(*p) || *p == '#')) {
+				if (*p == '#')
+					while (p < end && *p != '\n') ++p;
+				else
+					++p;
+			}
+			if (p == end || !isdigit(*p)) return fail();
+			values[i] = 0;
+			while (p < end && isdigit(*p) && values[i] < (1 << 24))
+				values[i] = values[i] * 10 + (*p++ - '0');
+		}
+		// Exactly one whitespace byte before the pixels
+		if (p == end || !isspace(*p) || values[2] < 1 || values[2] > 255)
+			return fail();
+		++p;
+
+		rgb = channels == 3;
+		return setView(p - (const char*) map, cv::Size(values[0], values[1]),
+					   CV_MAKETYPE(CV_8U, channels));
+	}
+
+	// Maps headerless pixels of the given size and type starting at offset
+	bool openRaw(const std::string &path, cv::Size size, int type,
+				 size_t offset = 0, bool write_back = false) {
+		close();
+		if (!openFile(path, write_back)) return false;
+		rgb = false;
+		return setView(offset, size, type);
+	}
+
+	// Creates a PGM (CV_8UC1) or PPM (CV_8UC3) of the given size, mapped
+	// for writing back. Its pixels start out zero.
+	bool create(const std::string &path, cv::Size size, int type) {
+		close();
+		if (type != CV_8UC1 && type != CV_8UC3) return false;
+		char header[64];
+		int len = snprintf(header, sizeof(header), "P%c\n%d %d\n255\n",
+						   type == CV_8UC3 ? '6' : '5', size.width, size.height);
+		size_t bytes = len + (size_t) size.width * size.height *
+			(type == CV_8UC3 ? 3 : 1);
+
+		fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) return false;
+		if (ftruncate(fd, bytes) != 0 || pwrite(fd, header, len, 0) != len)
+			return fail();
+		::close(fd);
+		fd = -1;
+		return open(path, true);
+	}
+
+	void close() {
+		if (map) munmap(map, map_size);
+		if (fd >= 0) ::close(fd);
+		fd = -1; map = NULL; map_size = 0;
+		view = cv::Mat();
+	}
+
+	bool isOpen() const { return map != NULL; }
+	bool isRGB() const { return rgb; }
+
+	// The pixels, valid until close(). Copies of it share the mapping.
+	const cv::Mat& mat() const { return view; }
+
+	// Starts reading the rows under r ahead of use
+	void willNeed(const cv::Rect &r) const {
+		if (!map || r.height <= 0) return;
+		adviseRows(r.y, r.y + r.height, MADV_WILLNEED);
+	}
+
+	// Flushes changes to the file now instead of when the kernel likes
+	bool sync() const {
+		return !map || !shared || msync(map, map_size, MS_SYNC) == 0;
+	}
+
+	// Asks the kernel to drop path's clean cached pages, so the next read
+	// comes from the disk. Used to time cold reads.
+	static void dropCache(const std::string &path) {
+		int f = ::open(path.c_str(), O_RDONLY);
+		if (f < 0) return;
+		fdatasync(f);
+		posix_fadvise(f, 0, 0, POSIX_FADV_DONTNEED);
+		::close(f);
+	}
+
+private:
+	bool openFile(const std::string &path, bool write_back) {
+		fd = ::open(path.c_str(), write_back ? O_RDWR : O_RDONLY);
+		if (fd < 0) return false;
+		struct stat sb;
+		if (fstat(fd, &sb) != 0 || sb.st_size == 0) return fail();
+		map_size = sb.st_size;
+		shared = write_back;
+		void *p = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+					   write_back ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			map = NULL;
+			return fail();
+		}
+		map = p;
+		return true;
+	}
+
+	bool setView(size_t offset, cv::Size size, int type) {
+		size_t step = (size_t) size.width * CV_ELEM_SIZE(type);
+		if (size.width <= 0 || size.height <= 0 ||
+			offset + step * size.height > map_size) return fail();
+		data_offset = offset;
+		view = cv::Mat(size, type, (uchar*) map + offset, step);
+		return true;
+	}
+
+	void adviseRows(int y0, int y1, int advice) const {
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t from = data_offset + (size_t) std::max(y0, 0) * view.step;
+		size_t to = data_offset + (size_t) std::min(y1, view.rows) * view.step;
+		from -= from % page;
+		if (to > from)
+			madvise((char*) map + from, to - from, advice);
+	}
+
+	bool fail() {
+		close();
+		return false;
+	}
+
+	int fd;
+	void *map;
+	size_t map_size, data_offset;
+	bool rgb, shared;
+	cv::Mat view;
+};
+
+// Size, type and file of a raw:WIDTHxHEIGHT:bgr|grey:path spec
+inline bool parse_raw_spec(const std::string &spec, cv::Size &size, int &type,
+						   std::string &path) {
+	if (spec.compare(0, 4, "raw:") != 0) return false;
+	size_t c1 = spec.find(':', 4), c2 = spec.find(':', c1 + 1);
+	if (c1 == std::string::npos || c2 == std::string::npos) return false;
+	char x;
+	if (sscanf(spec.c_str() + 4, "%d%c%d", &size.width, &x, &size.height) != 3 ||
+		x != 'x')
+		return false;
+	std::string name = spec.substr(c1 + 1, c2 - c1 - 1);
+	if (name == "bgr")       type = CV_8UC3;
+	else if (name == "grey") type = CV_8UC1;
+	else return false;
+	path = spec.substr(c2 + 1);
+	return !path.empty();
+}
+
+// The tools' imread: a view of the mapping when path is a PGM or PPM, or
+// a raw:WIDTHxHEIGHT:bgr|grey:path spec of headerless 8-bit pixels,
+// imread(path, flags) otherwise. Empty when none works.
+inline cv::Mat load_image(const std::string &path, MappedImage &mapped,
+						  bool write_back = false,
+						  int flags = CV_LOAD_IMAGE_COLOR) {
+	cv::Size size;
+	int type;
+	std::string file;
+	if (parse_raw_spec(path, size, type, file))
+		return mapped.openRaw(file, size, type, 0, write_back) ?
+			mapped.mat() : cv::Mat();
+	if (MappedImage::isMappable(path))
+		return mapped.open(path, write_back) ? mapped.mat() : cv::Mat();
+	return cv::imread(path, flags);
+}
+
+// imshow for an image that may be a view of an RGB mapping
+inline void imshow_mapped(const std::string &window, const cv::Mat &image,
+						  const MappedImage &mapped) {
+	if (!mapped.isRGB()) {
+		cv::imshow(window, image);
+		return;
+	}
+	cv::Mat bgr;
+	cv::cvtColor(image, bgr, CV_RGB2BGR);
+	cv::imshow(window, bgr);
+}
+
+#endif
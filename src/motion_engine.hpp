@@ -0,0 +1,277 @@
+#ifndef MOTION_ENGINE_HPP
+#define MOTION_ENGINE_HPP
+
+#include <vector>
+#include <cstring>
+#include <opencv2/opencv.hpp>
+#include "background_model.hpp"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "cpu_dispatch.hpp"
+
+struct MotionRegion {
+	cv::Rect box;    // in input frame coordinates
+	int      blocks; // number of active blocks in the region
+	double   score;  // mean absolute difference over those blocks
+};
+
+#ifdef PDI_DISPATCH
+// One row of block_sad, 32 or 64 pixels at a time: each 64-bit lane of
+// vpsadbw covers 8 pixels, so it still lands in a single block. Return
+// the first column left for the narrower loops.
+PDI_AVX2 inline int block_sad_row_avx2(const uchar *pa, const uchar *pb,
+									   int width, int block_size, unsigned *row) {
+	int x = 0;
+	for (; x + 32 <= width; x += 32) {
+		__m256i s = _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(pa + x)),
+									_mm256_loadu_si256((const __m256i*)(pb + x)));
+		unsigned long long lane[4];
+		_mm256_storeu_si256((__m256i*) lane, s);
+		for (int i = 0; i < 4; ++i)
+			row[(x + 8 * i) / block_size] += (unsigned) lane[i];
+	}
+	return x;
+}
+
+PDI_AVX512 inline int block_sad_row_avx512(const uchar *pa, const uchar *pb,
+										   int width, int block_size, unsigned *row) {
+	int x = 0;
+	for (; x + 64 <= width; x += 64) {
+		__m512i s = _mm512_sad_epu8(_mm512_loadu_si512(pa + x),
+									_mm512_loadu_si512(pb + x));
+		unsigned long long lane[8];
+		_mm512_storeu_si512(lane, s);
+		for (int i = 0; i < 8; ++i)
+			row[(x + 8 * i) / block_size] += (unsigned) lane[i];
+	}
+	return x;
+}
+#endif
+
+// Sums |a - b| over every block_size x block_size block of two grey images
+// in a single pass. block_size must be a multiple of 8. sad receives
+// ceil(h/block_size) x ceil(w/block_size) sums, row major.
+inline void block_sad(const uchar *a, const uchar *b, size_t step,
+					  int width, int height, int block_size,
+					  unsigned *sad) {
+	int grid_w = (width  + block_size - 1) / block_size;
+	int grid_h = (height + block_size - 1) / block_size;
+	memset(sad, 0, sizeof(unsigned) * grid_w * grid_h);
+#ifdef PDI_DISPATCH
+	CpuLevel level = cpu_level();
+#endif
+
+	for (int y = 0; y < height; ++y) {
+		const uchar *pa = a + y * step;
+		const uchar *pb = b + y * step;
+		unsigned *row = sad + (y / block_size) * grid_w;
+		int x = 0;
+#ifdef PDI_DISPATCH
+		if (level >= CPU_AVX512)
+			x = block_sad_row_avx512(pa, pb, width, block_size, row);
+		else if (level >= CPU_AVX2)
+			x = block_sad_row_avx2(pa, pb, width, block_size, row);
+#endif
+#ifdef __SSE2__
+		// psadbw gives one sum per 8 pixels, and 8 divides block_size,
+		// so each half of the register lands in a single block
+		for (; x + 16 <= width; x += 16) {
+			__m128i va = _mm_loadu_si128((const __m128i*)(pa + x));
+			__m128i vb = _mm_loadu_si128((const __m128i*)(pb + x));
+			__m128i s  = _mm_sad_epu8(va, vb);
+			row[ x      / block_size] += _mm_cvtsi128_si32(s);
+			row[(x + 8) / block_size] += _mm_cvtsi128_si32(
+											_mm_srli_si128(s, 8));
+		}
+#endif
+		for (; x < width; ++x) {
+			int d = pa[x] - pb[x];
+			row[x / block_size] += d < 0 ? -d : d;
+		}
+	}
+}
+
+// Frame-differencing motion detector working on blocks of a (optionally
+// downscaled) grey frame. Each call compares the frame against the
+// previous one, fills a coarse activity grid with the mean absolute
+// difference per block, and groups active blocks into regions.
+//
+// With a BackgroundModel attached the frame is compared against the model
+// instead of the previous frame, and the activity of a block is the mean
+// of its foreground mask (255 when every pixel is foreground).
+class MotionEngine {
+public:
+	MotionEngine(int block_size = 16, int downscale = 1,
+				 double threshold = 10)
+		: block_size(block_size < 8 ? 8 : block_size & ~7),
+		  downscale(downscale < 1 ? 1 : downscale),
+		  threshold(threshold), model(NULL), active_blocks(0),
+		  total_score(0) {}
+
+	// Compares frames against model instead of the previous frame. The
+	// engine does not take ownership; NULL goes back to differencing.
+	void setBackgroundModel(BackgroundModel *m) { model = m; }
+
+	// Foreground mask of the last frame when a model is attached
+	const cv::Mat& foreground() const { return fg; }
+
+	// Grey, downscaled copy of the last frame given to process()
+	const cv::Mat& frame() const { return prev; }
+
+	// Mean absolute difference (0-255) above which a block is active
+	void setThreshold(double t) {
+		threshold = t;
+		thresh_map.release();
+		block_thresh.release();
+	}
+
+	// Per-block thresholds, in the same units, from a grey map of any
+	// size and depth. It is resampled to the block grid whenever the grid
+	// changes, so it can be an image painted over the scene.
+	void setBlockThresholds(const cv::Mat &t) {
+		if (t.channels() == 3) cv::cvtColor(t, thresh_map, CV_BGR2GRAY);
+		else                   thresh_map = t;
+		thresh_map.convertTo(thresh_map, CV_32F);
+		block_thresh.release();
+	}
+
+	// Feeds a BGR or grey frame. The grey conversion writes straight into
+	// the engine's own buffer, which later becomes the reference frame.
+	// Returns true when any block is active.
+	bool process(const cv::Mat &frame) {
+		const cv::Mat *grey = &frame;
+		cv::Mat &dst = downscale > 1 ? scratch : cur;
+		if (frame.channels() == 3) {
+			cv::cvtColor(frame, dst, CV_BGR2GRAY);
+			grey = &dst;
+		}
+		if (downscale > 1) {
+			cv::resize(*grey, cur, cv::Size(grey->cols / downscale,
+											grey->rows / downscale),
+					   0, 0, cv::INTER_AREA);
+		} else if (grey != &cur) {
+			grey->copyTo(cur);
+		}
+
+		int grid_w = (cur.cols + block_size - 1) / block_size;
+		int grid_h = (cur.rows + block_size - 1) / block_size;
+		act.create(grid_h, grid_w, CV_32F);
+		sad.resize(grid_w * grid_h);
+		if (!thresh_map.empty() && block_thresh.size() != act.size())
+			cv::resize(thresh_map, block_thresh, act.size(), 0, 0,
+					   cv::INTER_AREA);
+
+		regs.clear();
+		active_blocks = 0;
+		total_score = 0;
+
+		if (model) {
+			model->apply(cur, fg, &sad[0], block_size);
+		} else if (prev.size() != cur.size() || !cur.isContinuous() ||
+				   !prev.isContinuous()) {
+			act.setTo(cv::Scalar(0));
+			std::swap(prev, cur);
+			return false;
+		} else {
+			block_sad(cur.data, prev.data, cur.step, cur.cols, cur.rows,
+					  block_size, &sad[0]);
+		}
+
+		for (int by = 0; by < grid_h; ++by) {
+			int bh = std::min(block_size, cur.rows - by * block_size);
+			float *a = act.ptr<float>(by);
+			for (int bx = 0; bx < grid_w; ++bx) {
+				int bw = std::min(block_size, cur.cols - bx * block_size);
+				a[bx] = (float) sad[by * grid_w + bx] / (bw * bh);
+			}
+		}
+
+		findRegions(frame.size());
+		std::swap(prev, cur);
+		return !regs.empty();
+	}
+
+	const cv::Mat& activity() const { return act; }
+	const std::vector<MotionRegion>& regions() const { return regs; }
+	int activeBlocks() const { return active_blocks; }
+	double score() const {
+		return active_blocks ? total_score / active_blocks : 0;
+	}
+
+private:
+	bool isActive(int by, int bx) const {
+		float t = block_thresh.empty() ?
+			(float) threshold : block_thresh.at<float>(by, bx);
+		return act.at<float>(by, bx) > t;
+	}
+
+	// Groups 4-connected active blocks of the grid into regions, with boxes
+	// clipped to the input frame
+	void findRegions(const cv::Size &frame_size) {
+		const cv::Rect bounds(0, 0, frame_size.width, frame_size.height);
+		int grid_h = act.rows, grid_w = act.cols;
+		visited.assign(grid_w * grid_h, 0);
+		int unit = block_size * downscale;
+
+		for (int by = 0; by < grid_h; ++by) {
+			for (int bx = 0; bx < grid_w; ++bx) {
+				if (visited[by * grid_w + bx] || !isActive(by, bx))
+					continue;
+
+				int x0 = bx, x1 = bx, y0 = by, y1 = by, count = 0;
+				double sum = 0;
+				stack.clear();
+				stack.push_back(by * grid_w + bx);
+				visited[by * grid_w + bx] = 1;
+
+				while (!stack.empty()) {
+					int idx = stack.back(); stack.pop_back();
+					int y = idx / grid_w, x = idx % grid_w;
+					x0 = std::min(x0, x); x1 = std::max(x1, x);
+					y0 = std::min(y0, y); y1 = std::max(y1, y);
+					sum += act.at<float>(y, x);
+					count++;
+
+					const int dy[] = {-1, 1, 0, 0}, dx[] = {0, 0, -1, 1};
+					for (int k = 0; k < 4; ++k) {
+						int ny = y + dy[k], nx = x + dx[k];
+						if (ny < 0 || ny >= grid_h || nx < 0 || nx >= grid_w)
+							continue;
+						int n = ny * grid_w + nx;
+						if (!visited[n] && isActive(ny, nx)) {
+							visited[n] = 1;
+							stack.push_back(n);
+						}
+					}
+				}
+
+				MotionRegion r;
+				r.box = bounds & cv::Rect(x0 * unit, y0 * unit,
+										  (x1 - x0 + 1) * unit,
+										  (y1 - y0 + 1) * unit);
+				r.blocks = count;
+				r.score = sum / count;
+				regs.push_back(r);
+
+				active_blocks += count;
+				total_score += sum;
+			}
+		}
+	}
+
+	int block_size, downscale;
+	double threshold;
+	cv::Mat thresh_map, block_thresh; // as given, and at grid size
+	BackgroundModel *model;
+
+	cv::Mat prev, cur, scratch, act, fg;
+	std::vector<unsigned> sad;
+	std::vector<uchar> visited;
+	std::vector<int> stack;
+	std::vector<MotionRegion> regs;
+	int active_blocks;
+	double total_score;
+};
+
+#endif
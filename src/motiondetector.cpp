@@ -1,72 +1,524 @@
 #include <iostream>
 #include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <iomanip>
 #include <opencv2/opencv.hpp>
+#include "frame_ring.hpp"
+#include "motion_engine.hpp"
+#include "thread_pool.hpp"
+#include "event_log.hpp"
+#include "trace.hpp"
+#include "frame_stream.hpp"
+#include "tuning.hpp"
+
+#define BLOCK_SIZE 16
+#define DOWNSCALE  2
+#define STREAM_BATCH 8
+#define STREAM_BUDGET_MB 64
+#define EVENT_LOG_CAPACITY 65536
 
 using namespace cv;
 using namespace std;
 
+typedef chrono::steady_clock Clock;
+
+FrameRing ring(4);
+atomic<bool> running(true);
+EventLog event_log;
+
+// Grabs frames into the ring as fast as the camera delivers them, or at
+// capture_fps when it is given. Waits for the analysis only when the ring
+// is lossless (files and pipes). At the end of the input the ring is
+// stopped, and the analysis still gets the last frame.
+void capture_loop(FrameSource *cap, double capture_fps) {
+	Clock::duration period = chrono::duration_cast<Clock::duration>(
+		chrono::duration<double>(capture_fps > 0 ? 1.0/capture_fps : 0));
+	Clock::time_point next = Clock::now();
+
+	while (running) {
+		Mat &slot = ring.beginWrite();
+		{
+			TRACE_SCOPE("decode");
+			if (!cap->read(slot)) break;
+		}
+		ring.endWrite();
+
+		if (capture_fps > 0) {
+			next += period;
+			this_thread::sleep_until(next);
+		}
+	}
+	ring.stop();
+}
+
+// Background model selected by name: "diff" compares consecutive frames,
+// "mean" a running average and "var" a running average with variance.
+// Returns false for unknown names.
+bool select_model(const string &name, MotionEngine &engine,
+				  BackgroundModel &model) {
+	if (name == "diff") {
+		engine.setBackgroundModel(NULL);
+	} else if (name == "mean" || name == "var") {
+		model = BackgroundModel(5, name == "var");
+		engine.setBackgroundModel(&model);
+	} else {
+		return false;
+	}
+	return true;
+}
+
+// Per-block thresholds from a grey image of the scene: each pixel is a
+// threshold in 0-255, like 255 * thresh_motion / 100, and the image is
+// resampled to the block grid. White masks an area out.
+bool load_threshold_map(const string &path, MotionEngine &engine) {
+	Mat map = imread(path, CV_LOAD_IMAGE_GRAYSCALE);
+	if (map.empty()) return false;
+	engine.setBlockThresholds(map);
+	return true;
+}
+
+// Removes "-t file" from the arguments, like take_stream_options
+bool take_threshold_option(int &argc, char **argv, string &path) {
+	int kept = 1;
+	for (int i = 1; i < argc; ++i) {
+		if (string(argv[i]) == "-t") {
+			if (i + 1 == argc) return false;
+			path = argv[++i];
+		} else {
+			argv[kept++] = argv[i];
+		}
+	}
+	argc = kept;
+	argv[argc] = NULL;
+	return true;
+}
+
+// Times every model on synthetic BGR frames: a noisy static scene with a
+// square moving across it. It runs on one thread, and the BGR to grey
+// conversion is timed apart from the engine, which then gets grey frames:
+// its time is the model update and mask pass (the block differences for
+// diff), plus the per-block grid.
+void bench(int width, int height, int frames) {
+	setNumThreads(1);
+	Mat scene(height, width, CV_8UC3), frame, grey;
+	randu(scene, Scalar::all(0), Scalar::all(255));
+	GaussianBlur(scene, scene, Size(9, 9), 0);
+	cout << width << "x" << height << ", " << frames << " frames, "
+		 << getNumThreads() << " thread" << endl;
+
+	const char *models[] = {"diff", "mean", "var"};
+	for (int m = 0; m < 3; ++m) {
+		MotionEngine engine(BLOCK_SIZE, 1, 255 * 0.1);
+		BackgroundModel model;
+		select_model(models[m], engine, model);
+
+		int detections = 0;
+		Clock::duration convert = Clock::duration::zero();
+		Clock::duration motion = Clock::duration::zero();
+		for (int i = 0; i < frames; ++i) {
+			scene.copyTo(frame);
+			int side = height / 8;
+			rectangle(frame, Rect((i * 8) % (width - side), height / 2,
+								  side, side), Scalar(255, 255, 255), -1);
+
+			Clock::time_point t0 = Clock::now();
+			cvtColor(frame, grey, CV_BGR2GRAY);
+			Clock::time_point t1 = Clock::now();
+			detections += engine.process(grey);
+			Clock::time_point t2 = Clock::now();
+			convert += t1 - t0;
+			motion += t2 - t1;
+		}
+
+		double grey_ms = chrono::duration<double, milli>(convert).count() / frames;
+		double model_ms = chrono::duration<double, milli>(motion).count() / frames;
+		cout << models[m] << ": model " << model_ms << " ms/frame ("
+			 << 1000 / model_ms << " fps), grey " << grey_ms
+			 << " ms/frame, together " << 1000 / (grey_ms + model_ms)
+			 << " fps, " << detections << "/" << frames
+			 << " frames with motion" << endl;
+	}
+}
+
+// One source watched in headless mode. Everything a stream needs is
+// allocated once it sees its first frame, so its footprint stays fixed.
+struct Stream {
+	int id;
+	string source;
+	VideoCapture cap;
+	Mat frame;
+	MotionEngine engine;
+	BackgroundModel model;
+	bool done;
+
+	mutex stats_mtx;
+	unsigned long frames, detections;
+	double busy_ms, max_ms, media_ms;
+	Clock::time_point start;
+};
+
+// Serializes console output and, with it, the single event log writer
+mutex cout_mtx;
+
+// Smallest downscale whose buffers fit in budget bytes: the decoded BGR
+// frame, the full size grey scratch and, at analysis size, the current and
+// reference frames, the mask and the 16-bit model. Returns 0 when nothing
+// fits.
+int downscale_for_budget(int width, int height, double budget) {
+	for (int s = 1; s <= 8; ++s) {
+		double analysed = (double) (width / s) * (height / s);
+		double bytes = 3.0 * width * height + (s > 1 ? width * height : 0)
+					 + 7 * analysed;
+		if (bytes <= budget) return s;
+	}
+	return 0;
+}
+
+// Reads and analyses up to STREAM_BATCH frames, then puts the stream back
+// at the end of the pool queue so every stream gets its turn.
+void stream_step(ThreadPool *pool, Stream *st) {
+	for (int i = 0; i < STREAM_BATCH; ++i) {
+		Clock::time_point t0 = Clock::now();
+		bool read;
+		{
+			TRACE_SCOPE("decode");
+			read = st->cap.read(st->frame) && !st->frame.empty();
+		}
+		if (!read) {
+			lock_guard<mutex> lock(st->stats_mtx);
+			st->done = true;
+			return;
+		}
+		bool moving;
+		{
+			TRACE_SCOPE("motion");
+			moving = st->engine.process(st->frame);
+		}
+		double ms = chrono::duration<double, milli>(Clock::now() - t0).count();
+
+		unsigned long frame;
+		{
+			lock_guard<mutex> lock(st->stats_mtx);
+			frame = ++st->frames;
+			st->busy_ms += ms;
+			st->max_ms = max(st->max_ms, ms);
+			st->media_ms = st->cap.get(CV_CAP_PROP_POS_MSEC);
+			if (moving) st->detections++;
+		}
+		// Only after stats_mtx is released: print_stream_stats takes the
+		// two locks the other way round
+		if (moving) {
+			double score = st->engine.score();
+			int blocks = st->engine.activeBlocks();
+			lock_guard<mutex> out(cout_mtx);
+			cout << "stream " << st->id << ": Detected movement!! frame "
+				 << frame << ", " << blocks << " blocks, score " << score
+				 << endl;
+			if (event_log.isOpen())
+				event_log.append(st->id, frame, score, blocks);
+		}
+	}
+	pool->submit(bind(stream_step, pool, st));
+}
+
+// Lag is how far analysis runs behind the stream's own clock; negative
+// means it is ahead, which is normal for files read faster than real time.
+void print_stream_stats(vector<unique_ptr<Stream> > &streams) {
+	lock_guard<mutex> out(cout_mtx);
+	cout << "###### Stream statistics ######" << endl
+		 << setw(4) << "id" << setw(10) << "frames" << setw(10) << "fps"
+		 << setw(10) << "avg ms" << setw(10) << "max ms"
+		 << setw(10) << "lag ms" << setw(10) << "motion" << "  source" << endl;
+	for (size_t i = 0; i < streams.size(); ++i) {
+		Stream &st = *streams[i];
+		lock_guard<mutex> lock(st.stats_mtx);
+		double wall = chrono::duration<double, milli>(
+						Clock::now() - st.start).count();
+		cout << fixed << setprecision(1)
+			 << setw(4) << st.id << setw(10) << st.frames
+			 << setw(10) << (wall > 0 ? 1000 * st.frames / wall : 0)
+			 << setw(10) << (st.frames ? st.busy_ms / st.frames : 0)
+			 << setw(10) << st.max_ms
+			 << setw(10) << (st.media_ms > 0 ? wall - st.media_ms : 0)
+			 << setw(10) << st.detections
+			 << "  " << st.source << (st.done ? " (done)" : "") << endl;
+	}
+	cout << "###############################" << endl;
+}
+
+// Watches every source on a shared pool without any window.
+int headless(int argc, char** argv) {
+	int threads = 0;
+	double budget_mb = STREAM_BUDGET_MB;
+	string model_name = "diff", thresh_map;
+	int i = 2;
+	for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+		string opt = argv[i];
+		if (opt == "-j") threads = atoi(argv[i+1]);
+		else if (opt == "-b") budget_mb = atof(argv[i+1]);
+		else if (opt == "-m") model_name = argv[i+1];
+		else if (opt == "-t") thresh_map = argv[i+1];
+		else if (opt == "-l") {
+			if (!event_log.create(argv[i+1], EVENT_LOG_CAPACITY)) {
+				cout << "Could not open event log " << argv[i+1] << endl;
+				return 1;
+			}
+		}
+		else {
+			cout << "Unknown option " << opt << endl;
+			return 1;
+		}
+	}
+	if (argc - i < 2) {
+		cout << "Missing threshold or sources" << endl;
+		return 1;
+	}
+	float thresh_motion = atof(argv[i++]);
+
+	vector<unique_ptr<Stream> > streams;
+	for (; i < argc; ++i) {
+		unique_ptr<Stream> st(new Stream());
+		st->id = streams.size();
+		st->source = argv[i];
+		bool device = st->source.find_first_not_of("0123456789") == string::npos;
+		if (device) st->cap.open(atoi(argv[i]));
+		else        st->cap.open(st->source);
+		if (!st->cap.isOpened()) {
+			cout << "Failed to open " << st->source << endl;
+			return 1;
+		}
+
+		int width  = st->cap.get(CV_CAP_PROP_FRAME_WIDTH);
+		int height = st->cap.get(CV_CAP_PROP_FRAME_HEIGHT);
+		int scale  = downscale_for_budget(width, height, budget_mb * (1 << 20));
+		if (!scale) {
+			cout << st->source << " does not fit in " << budget_mb << " MB" << endl;
+			return 1;
+		}
+
+		st->engine = MotionEngine(BLOCK_SIZE, scale, 255 * thresh_motion / 100.0);
+		if (!select_model(model_name, st->engine, st->model)) {
+			cout << "Unknown model " << model_name << endl;
+			return 1;
+		}
+		if (!thresh_map.empty() &&
+			!load_threshold_map(thresh_map, st->engine)) {
+			cout << "Could not read threshold map " << thresh_map << endl;
+			return 1;
+		}
+		st->done = false;
+		st->frames = st->detections = 0;
+		st->busy_ms = st->max_ms = st->media_ms = 0;
+		streams.push_back(move(st));
+	}
+
+	ThreadPool pool(threads);
+	cout << "Watching " << streams.size() << " streams on "
+		 << pool.size() << " threads" << endl;
+
+	for (size_t s = 0; s < streams.size(); ++s) {
+		streams[s]->start = Clock::now();
+		pool.submit(bind(stream_step, &pool, streams[s].get()));
+	}
+
+	while (!pool.waitFor(2000))
+		print_stream_stats(streams);
+	print_stream_stats(streams);
+	return 0;
+}
+
 int main(int argc, char** argv){
-	if (argc != 2) {
-		cout << "usage: " << argv[0] << " <thresh_motion>" << endl
-			 << "Where thresh_motion is a threshold for "
-			 << "relative difference of histograms between 0 and 100." << endl;
+	apply_tuning();
+
+	if (argc >= 2 && string(argv[1]) == "--bench") {
+		bench(argc > 2 ? atoi(argv[2]) : 1920,
+			  argc > 3 ? atoi(argv[3]) : 1080,
+			  argc > 4 ? atoi(argv[4]) : 300);
+		exit(0);
+	}
+
+	if (argc >= 2 && string(argv[1]) == "--headless") {
+		exit(headless(argc, argv));
+	}
+
+	string source = "0", output, thresh_map;
+	bool options_ok = take_stream_options(argc, argv, source, output) &&
+					  take_threshold_option(argc, argv, thresh_map);
+
+	if (!options_ok || argc < 2 || argc > 6) {
+		cout << "usage: " << argv[0] << " [-i source] [-o output] [-t map] "
+			 << "<thresh_motion> "
+			 << "[capture_fps] [analysis_fps] [diff|mean|var] [event_log]"
+			 << endl
+			 << "       " << argv[0] << " --headless [-j threads] "
+			 << "[-b budget_mb] [-m diff|mean|var] [-l event_log] [-t map] "
+			 << "<thresh_motion> "
+			 << "<source>..." << endl
+			 << "       " << argv[0] << " --bench [width] [height] [frames]"
+			 << endl
+			 << "Where thresh_motion is the mean absolute difference "
+			 << "of a block, between 0 and 100, above which it counts "
+			 << "as moving." << endl
+			 << "capture_fps and analysis_fps limit the rate of each "
+			 << "thread (0 or absent means as fast as possible)." << endl
+			 << "The last argument picks what frames are compared with: "
+			 << "the previous frame (default), a running average "
+			 << "background or a running average with variance. With a "
+			 << "background, thresh_motion is the percentage of "
+			 << "foreground pixels in a block." << endl
+			 << "Headless mode watches every source (device index, file "
+			 << "or stream URL) on a shared thread pool, with a fixed "
+			 << "memory budget per stream, and prints per-stream "
+			 << "throughput and lag every two seconds." << endl
+			 << "Detections are also appended to event_log, a memory-mapped "
+			 << "ring that motionlog can follow." << endl
+			 << "-i reads a camera number (default 0), a video file, - for "
+			 << "Y4M on stdin or raw:WIDTHxHEIGHT[@FPS]:- for raw BGR. "
+			 << "-o writes the annotated frames to - (Y4M), a .y4m file or "
+			 << "raw:- / raw:file (BGR) instead of showing them." << endl
+			 << "-t gives each block its own threshold from a grey image "
+			 << "of the scene, 0-255 like 255 * thresh_motion / 100; "
+			 << "white areas never count as moving." << endl;
 		exit(1);
 	}
 
 	float thresh_motion = atof(argv[1]);
+	double capture_fps  = argc > 2 ? atof(argv[2]) : 0;
+	double analysis_fps = argc > 3 ? atof(argv[3]) : 0;
 
-	Mat image, grey;
+	Mat view, activity;
 	int width, height;
-	VideoCapture cap;
-
-	int histSize = 256;
-	float range[] = {0, 256};
-	const float* histRange = {range};
-	Mat hist;
+	FrameSource cap;
+	FrameSink sink;
+	// Streaming runs without windows, until the input ends
+	bool show = output.empty();
+	if (output == "-" || output == "raw:-") move_messages_to_stderr();
 
-	float avg = -1, prev_avg = -1;
-
-	cap.open(0);
+	MotionEngine engine(BLOCK_SIZE, DOWNSCALE, 255 * thresh_motion / 100.0);
+	BackgroundModel model;
+	if (!select_model(argc > 4 ? argv[4] : "diff", engine, model)) {
+		cout << "Unknown model " << argv[4] << endl;
+		exit(1);
+	}
+	if (!thresh_map.empty() && !load_threshold_map(thresh_map, engine)) {
+		cout << "Could not read threshold map " << thresh_map << endl;
+		exit(1);
+	}
+	if (argc > 5 && !event_log.create(argv[5], EVENT_LOG_CAPACITY)) {
+		cout << "Could not open event log " << argv[5] << endl;
+		exit(1);
+	}
 
-	if (!cap.isOpened()){
-		cout << "No cameras available" << endl;
+	if (!cap.open(source)){
+		if (source == "0") cout << "No cameras available" << endl;
+		else               cout << cap.error() << endl;
 		exit(1);
 	}
 
-	width  = cap.get(CV_CAP_PROP_FRAME_WIDTH);
-	height = cap.get(CV_CAP_PROP_FRAME_HEIGHT);
+	width  = cap.size().width;
+	height = cap.size().height;
 	
 	cout << "###### Image dimensions ######" << endl	
 		 << "Width = " << width << endl
 		 << "Height  = " << height << endl
 		 << "##############################" << endl;
 
-	namedWindow("grey", WINDOW_NORMAL);
+	if (show) {
+		namedWindow("grey", WINDOW_NORMAL);
+		namedWindow("activity", WINDOW_NORMAL);
+	}
+
+	// A file or pipe can wait for the analysis, so none of it is skipped
+	ring.setLossless(!cap.isLive());
+	thread capture_thread(capture_loop, &cap, capture_fps);
+
+	Clock::duration period = chrono::duration_cast<Clock::duration>(
+		chrono::duration<double>(analysis_fps > 0 ? 1.0/analysis_fps : 0));
+	Clock::time_point next = Clock::now();
+	unsigned long analysed = 0, late = 0;
 
-	while (1) {
-		cap >> image;
-		if(image.empty()) exit(1);
+	while (running) {
+		// Analyse the newest frame straight from the ring
+		unsigned long frame_seq;
+		const Mat *image = ring.beginRead(&frame_seq);
+		if (!image) break;
 
-		cvtColor(image, grey, CV_BGR2GRAY);
+		bool moving;
+		{
+			TRACE_SCOPE("motion");
+			moving = engine.process(*image);
+		}
+		ring.endRead();
 
-		calcHist(&grey, 1, 0, Mat(), hist, 1, &histSize, &histRange);
+		if (moving) {
+			cout << "Detected movement!! "
+				 << engine.regions().size() << " regions, "
+				 << engine.activeBlocks() << " blocks, "
+				 << "score " << engine.score() << endl;
+			if (event_log.isOpen())
+				event_log.append(0, frame_seq, engine.score(),
+								 engine.activeBlocks());
+		}
+		analysed++;
 
-		avg = 0;
-		for (int i = 0; i < 256; ++i) {
-			avg += i * hist.at<float>(i) / ( (float)(width*height) );
+		{
+			TRACE_SCOPE("annotate");
+			cvtColor(engine.frame(), view, CV_GRAY2BGR);
+			for (size_t i = 0; i < engine.regions().size(); ++i) {
+				Rect box = engine.regions()[i].box;
+				rectangle(view, Rect(box.x / DOWNSCALE, box.y / DOWNSCALE,
+									 box.width / DOWNSCALE, box.height / DOWNSCALE),
+						  Scalar(0, 0, 255), 2);
+			}
 		}
 
-		if (prev_avg > 0 && // First iteration and not zero for division
-			abs(avg-prev_avg)/prev_avg > thresh_motion/100.0 ) {
+		if (!show) {
+			// Sized by the analysis, known from the first frame on
+			if (!sink.isOpened() &&
+				!sink.open(output, view.size(), cap.fps(), false)) {
+				cout << "Could not write " << output << ": " << sink.error()
+					 << endl;
+				break;
+			}
+			TRACE_SCOPE("encode");
+			if (!sink.write(view)) break;
+		} else {
+			TRACE_SCOPE("display");
+			engine.activity().convertTo(activity, CV_8U);
+
+			imshow("grey", view);
+			imshow("activity", activity);
 
-			cout << "Detected movement!!" << endl;
+			if(waitKey(1) >= 0) break;
 		}
 
-		prev_avg = avg;
-	
-		imshow("grey", grey);
-		
-		if(waitKey(1000) >= 0) break;
+		if (analysis_fps > 0) {
+			next += period;
+			Clock::time_point now = Clock::now();
+			if (now > next) {
+				// Analysis overran its slot, resync instead of bursting
+				late++;
+				next = now;
+			} else {
+				this_thread::sleep_until(next);
+			}
+		}
 	}
+
+	running = false;
+	ring.stop();
+	capture_thread.join();
+
+	cout << "###### Frame statistics ######" << endl
+		 << "Captured = " << ring.written() << endl
+		 << "Analysed = " << analysed << endl
+		 << "Dropped  = " << ring.droppedFrames() << endl
+		 << "Late     = " << late << endl
+		 << "##############################" << endl;
+
 	exit(0);
 }
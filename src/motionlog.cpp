@@ -0,0 +1,123 @@
+#include <iostream>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include "event_log.hpp"
+
+#define BENCH_CAPACITY 65536
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+// Follows the log from its current end and prints every event. Events
+// overwritten before we got to them are reported as a gap.
+void tail(EventLog &log, bool from_start) {
+	uint64_t next = log.lastSeq() + 1;
+	if (from_start && next > log.capacity())
+		next -= log.capacity();
+	else if (from_start)
+		next = 1;
+
+	while (1) {
+		uint64_t last = log.lastSeq();
+		if (next > last) {
+			this_thread::sleep_for(chrono::milliseconds(10));
+			continue;
+		}
+		if (last - next >= log.capacity()) {
+			cout << "-- lost " << (last - next + 1 - log.capacity())
+				 << " events --" << endl;
+			next = last - log.capacity() + 1;
+		}
+
+		const MotionEvent *ev = log.at(next);
+		if (ev) {
+			int64_t ts = ev->timestamp_us;
+			uint32_t stream = ev->stream, blocks = ev->blocks;
+			uint64_t frame = ev->frame;
+			float score = ev->score;
+			if (log.stillValid(ev, next)) {
+				cout << ts << " stream " << stream << " frame " << frame
+					 << " blocks " << blocks << " score " << score << endl;
+				next++;
+				continue;
+			}
+		}
+		// Lapped while reading, resync on the next round
+		next = log.lastSeq() + 1 - log.capacity();
+	}
+}
+
+// Appends events as fast as possible while a second thread tails them,
+// then reports both rates and how many events the reader missed.
+void bench(const char *path, uint64_t events) {
+	EventLog writer, reader;
+	if (!writer.create(path, BENCH_CAPACITY) || !reader.openForReading(path)) {
+		cout << "Could not open " << path << endl;
+		exit(1);
+	}
+	uint64_t base = writer.lastSeq();
+	uint64_t seen = 0, torn = 0;
+	double checksum = 0;
+
+	Clock::time_point t0 = Clock::now();
+	thread consumer([&] {
+		uint64_t next = base + 1;
+		while (next <= base + events) {
+			uint64_t last = reader.lastSeq();
+			if (next > last) continue;
+			if (last - next >= reader.capacity())
+				next = last - reader.capacity() + 1;
+			const MotionEvent *ev = reader.at(next);
+			float score = ev ? ev->score : 0;
+			if (ev && reader.stillValid(ev, next)) {
+				checksum += score;
+				seen++;
+			} else {
+				torn++;
+			}
+			next++;
+		}
+	});
+
+	for (uint64_t i = 0; i < events; ++i)
+		writer.append(i % 16, i, (float) (i % 100), i % 64);
+	double write_s = chrono::duration<double>(Clock::now() - t0).count();
+	consumer.join();
+	double read_s = chrono::duration<double>(Clock::now() - t0).count();
+
+	cout << "Wrote " << events << " events in " << write_s << " s ("
+		 << events / write_s / 1e6 << " M events/s)" << endl
+		 << "Read  " << seen << " events in " << read_s << " s ("
+		 << seen / read_s / 1e6 << " M events/s), "
+		 << events - seen - torn << " lapped, " << torn << " torn" << endl
+		 << "Checksum " << checksum << endl;
+}
+
+int main(int argc, char** argv) {
+	if (argc >= 3 && string(argv[1]) == "--bench") {
+		bench(argv[2], argc > 3 ? strtoull(argv[3], NULL, 10) : 10000000);
+		exit(0);
+	}
+
+	bool from_start = argc == 3 && string(argv[1]) == "-a";
+	if (argc != 2 && !from_start) {
+		cout << "usage: " << argv[0] << " [-a] <event_log>" << endl
+			 << "       " << argv[0] << " --bench <event_log> [events]" << endl
+			 << "\tPrints the motion events written by motiondetector as "
+			 << "they arrive; -a starts from the oldest event still "
+			 << "in the ring." << endl
+			 << "\t--bench measures append and tail throughput on a "
+			 << "scratch log." << endl;
+		exit(1);
+	}
+
+	EventLog log;
+	if (!log.openForReading(argv[argc-1])) {
+		cout << "Could not open " << argv[argc-1] << endl;
+		exit(1);
+	}
+	tail(log, from_start);
+	exit(0);
+}
@@ -0,0 +1,137 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <cstdlib>
+#include <opencv2/opencv.hpp>
+#include "libpdi.hpp"
+#include "mapped_image.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+#include "tuning.hpp"
+
+using namespace cv;
+using namespace std;
+
+// Batch front end for libpdi: runs the same pipeline over every input,
+// several images at a time, without opening any window.
+
+void usage(const char *name) {
+	cout << "usage: " << name << " [-j threads] [-o out_dir] \"<op> <op> ...\""
+		 << " <image>..." << endl
+		 << "\tOperations, applied left to right:" << endl
+		 << "\t  grey" << endl
+		 << "\t  equalize[:global|adaptive|sampled]" << endl
+		 << "\t  filter:mean|gauss|horizontal|vertical|laplacian|log[,signed]"
+		 << endl
+		 << "\t  tiltshift[:start,decay,center,hue_gain]" << endl
+		 << "\t  homomorphic[:gamma_l,gamma_h,d0,c]" << endl
+		 << "\t  bubbles" << endl
+		 << "\t  pointillism[:seed]" << endl
+		 << "\t  negate:<rect_file>   (same format as regions -f)" << endl
+		 << "\t  swap:<perm_file>     (same format as swap_regions -f)" << endl
+		 << "\t  save:<path>" << endl
+		 << "\tThe result of each image is written to out_dir with the"
+		 << " input's file name; without -o only save: writes anything." << endl
+		 << "\tExample: " << name << " -o out \"grey equalize:adaptive"
+		 << " filter:log\" ../img/*.png" << endl;
+}
+
+string base_name(const string &path) {
+	size_t slash = path.find_last_of('/');
+	return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+int main(int argc, char** argv){
+	apply_tuning();
+
+	int threads = 0;
+	string out_dir;
+	int arg = 1;
+	for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+		string opt = argv[arg];
+		if (opt == "-j") threads = atoi(argv[arg+1]);
+		else if (opt == "-o") out_dir = argv[arg+1];
+		else break;
+	}
+	if (argc - arg < 2) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	string spec = argv[arg++], error;
+	vector<string> inputs(argv + arg, argv + argc);
+
+	// Parsed once up front so a bad pipeline fails before any work
+	{
+		pdi::Pipeline check;
+		if (!check.parse(spec, error)) {
+			cerr << "pdi: " << error << endl;
+			exit(1);
+		}
+	}
+
+	ThreadPool pool(threads);
+	atomic<size_t> next(0);
+	atomic<int> failed(0);
+	mutex print;
+
+	// One task per worker, each with its own pipeline, pulling inputs until
+	// none are left, so buffers are reused from one image to the next
+	int workers = min((size_t) pool.size(), inputs.size());
+	for (int w = 0; w < workers; ++w) {
+		pool.submit([&] {
+			pdi::Pipeline pipeline;
+			string error;
+			pipeline.parse(spec, error);
+			MappedImage mapped;
+
+			for (size_t i; (i = next++) < inputs.size(); ) {
+				const string &path = inputs[i];
+				string report;
+				Mat image;
+				{
+					TRACE_SCOPE("decode");
+					image = load_image(path, mapped);
+				}
+				bool ok = image.data != NULL;
+				if (!ok) {
+					error = "could not open";
+				} else {
+					if (mapped.isRGB()) {
+						Mat bgr;
+						cvtColor(image, bgr, CV_RGB2BGR);
+						image = bgr;
+					}
+					ok = pipeline.run(image, report, error);
+				}
+				if (ok && !out_dir.empty()) {
+					string out = out_dir + "/" + base_name(path);
+					TRACE_SCOPE("encode");
+					if (!imwrite(out, image)) {
+						error = "could not write " + out;
+						ok = false;
+					}
+				}
+				image.release();
+				mapped.close();
+
+				lock_guard<mutex> lock(print);
+				if (!ok) {
+					cerr << "pdi: " << path << ": " << error << endl;
+					failed++;
+				} else if (!report.empty()) {
+					stringstream lines(report);
+					string line;
+					while (getline(lines, line))
+						cout << path << ": " << line << endl;
+				}
+			}
+		});
+	}
+	pool.wait();
+
+	return failed ? 1 : 0;
+}
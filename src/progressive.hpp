@@ -0,0 +1,54 @@
+#ifndef PROGRESSIVE_HPP
+#define PROGRESSIVE_HPP
+
+#include <vector>
+#include <chrono>
+#include <opencv2/opencv.hpp>
+
+// Progressive rendering for the interactive tools: while a slider moves,
+// render from a small copy of the image, and redo it at full resolution
+// once the sliders have been still for a moment. Each level keeps its own
+// intermediates (blurred copy, spectrum), so a preview never touches the
+// full-size image.
+
+// levels[0] is src; every next level is the previous one halved with
+// pyrDown, until one has at most max_pixels pixels.
+inline void build_pyramid(const cv::Mat &src, std::vector<cv::Mat> &levels,
+						  size_t max_pixels) {
+	levels.assign(1, src);
+	while (levels.back().total() > max_pixels &&
+		   levels.back().rows > 1 && levels.back().cols > 1) {
+		cv::Mat half;
+		cv::pyrDown(levels.back(), half);
+		levels.push_back(half);
+	}
+}
+
+// Says when the input has been idle long enough to render at full size
+class RefineTimer {
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	explicit RefineTimer(int idle_ms = 150)
+		: idle(std::chrono::milliseconds(idle_ms)), pending(false) {}
+
+	// The input changed and a preview was shown
+	void touch() {
+		last = Clock::now();
+		pending = true;
+	}
+
+	// True once per burst of changes, idle_ms after the last one
+	bool due() {
+		if (!pending || Clock::now() - last < idle) return false;
+		pending = false;
+		return true;
+	}
+
+private:
+	Clock::duration idle;
+	Clock::time_point last;
+	bool pending;
+};
+
+#endif
@@ -1,25 +1,189 @@
 #include <iostream>
 #include <cstdlib>
+#include <chrono>
 #include <opencv2/opencv.hpp>
+#include "roi_engine.hpp"
+#include "mapped_image.hpp"
+#include "trace.hpp"
+#include "tuning.hpp"
 
 using namespace cv;
 using namespace std;
 
+typedef chrono::steady_clock Clock;
+
 #define CHECK_VALID_RANGE(x, dimension) if(x < 0 || x >= dimension) \
 	{cout << "Invalid value for "#x << endl; exit(1);}
 
+// The original per-pixel loop, one rectangle at a time
+void negate_reference(Mat &image, const Rect &r) {
+	for (int i = r.y; i < r.y + r.height; ++i) {
+		for (int j = r.x; j < r.x + r.width; ++j) {
+			image.at<Vec3b>(i,j)[0] = 255- image.at<Vec3b>(i,j)[0];
+			image.at<Vec3b>(i,j)[1] = 255- image.at<Vec3b>(i,j)[1];
+			image.at<Vec3b>(i,j)[2] = 255- image.at<Vec3b>(i,j)[2];
+		}
+	}
+}
+
+// Negates num_rects random rectangles of a synthetic image with the span
+// engine, and checks it against a coverage mask. The original loop is
+// timed too, though it inverts overlaps more than once.
+void bench(int width, int height, int num_rects, int iterations) {
+	Mat image(height, width, CV_8UC3), expected, mask(height, width, CV_8UC1);
+	randu(image, Scalar::all(0), Scalar::all(256));
+	vector<Rect> rects;
+	for (int i = 0; i < num_rects; ++i) {
+		int w = 1 + rand() % (width / 8), h = 1 + rand() % (height / 8);
+		rects.push_back(Rect(rand() % (width - w), rand() % (height - h), w, h));
+	}
+
+	RegionSet set;
+	Clock::time_point t0 = Clock::now();
+	for (int i = 0; i < iterations; ++i)
+		set.build(rects, image.size());
+	Clock::time_point t1 = Clock::now();
+	for (int i = 0; i < iterations; ++i)
+		set.negate(image);
+	Clock::time_point t2 = Clock::now();
+	for (int i = 0; i < iterations; ++i)
+		for (size_t r = 0; r < rects.size(); ++r)
+			negate_reference(image, rects[r]);
+	Clock::time_point t3 = Clock::now();
+
+	double ms_build  = chrono::duration<double, milli>(t1 - t0).count() / iterations;
+	double ms_negate = chrono::duration<double, milli>(t2 - t1).count() / iterations;
+	double ms_ref    = chrono::duration<double, milli>(t3 - t2).count() / iterations;
+
+	image.copyTo(expected);
+	mask.setTo(Scalar(0));
+	for (size_t r = 0; r < rects.size(); ++r)
+		mask(rects[r]).setTo(Scalar(255));
+	bitwise_not(expected, expected, mask);
+	set.negate(image);
+	Mat diff = image != expected;
+	int differ = countNonZero(diff.reshape(1));
+
+	double mb = set.pixels() * 3 / 1e6;
+	cout << "###### Regions " << width << "x" << height << ", " << num_rects
+		 << " rectangles ######" << endl
+		 << "Merged into " << set.rowBands().size() << " row bands, "
+		 << set.pixels() << " pixels covered" << endl
+		 << "Merge: " << ms_build << " ms" << endl
+		 << "Negate spans: " << ms_negate << " ms (" << mb / ms_negate
+		 << " GB/s)" << endl
+		 << "Per-rectangle loop: " << ms_ref << " ms (" << ms_ref / ms_negate
+		 << "x slower)" << endl
+		 << differ << " bytes differ from the mask reference" << endl
+		 << "##############################" << endl;
+}
+
+// Time from start to a negated rectangle in the middle of a PPM, reading
+// it with imread or mapping it, cold (page cache dropped) and warm. The
+// file is created first when it does not exist.
+void bench_io(const char *path, int width, int height) {
+	MappedImage mapped;
+	if (!MappedImage::isMappable(path)) {
+		cout << "Creating " << width << "x" << height << " " << path << endl;
+		if (!mapped.create(path, Size(width, height), CV_8UC3)) {
+			cout << "Could not create " << path << endl;
+			exit(1);
+		}
+		Mat image = mapped.mat();
+		for (int i = 0; i < image.rows; ++i)
+			image.row(i).setTo(Scalar(i % 256, (i / 256) % 256, 128));
+		mapped.sync();
+		mapped.close();
+	}
+	if (!mapped.open(path)) {
+		cout << "Could not open " << path << endl;
+		exit(1);
+	}
+	Size size = mapped.mat().size();
+	mapped.close();
+	double gb = (double) size.area() * 3 / 1e9;
+	Rect roi(size.width / 2 - 128, size.height / 2 - 128, 256, 256);
+	roi = roi & Rect(0, 0, size.width, size.height);
+	RegionSet set;
+	set.build(vector<Rect>(1, roi), size);
+
+	cout << "###### Time to first result, " << size.width << "x" << size.height
+		 << " (" << gb << " GB) ######" << endl;
+	Mat from_imread, from_map;
+	for (int cold = 1; cold >= 0; --cold) {
+		if (cold) MappedImage::dropCache(path);
+		Clock::time_point t0 = Clock::now();
+		from_imread = imread(path, CV_LOAD_IMAGE_COLOR);
+		set.negate(from_imread);
+		Clock::time_point t1 = Clock::now();
+
+		if (cold) MappedImage::dropCache(path);
+		Clock::time_point t2 = Clock::now();
+		mapped.open(path);
+		from_map = mapped.mat();
+		set.negate(from_map);
+		Clock::time_point t3 = Clock::now();
+
+		double ms_imread = chrono::duration<double, milli>(t1 - t0).count();
+		double ms_map    = chrono::duration<double, milli>(t3 - t2).count();
+		cout << (cold ? "cold" : "warm") << ": imread " << ms_imread
+			 << " ms, mapped " << ms_map << " ms (" << ms_imread / ms_map
+			 << "x)" << endl;
+	}
+	Mat bgr;
+	cvtColor(from_map(roi), bgr, CV_RGB2BGR);
+	Mat diff = bgr != from_imread(roi);
+	cout << countNonZero(diff.reshape(1)) << " bytes differ in the rectangle"
+		 << endl << "##############################" << endl;
+}
+
 int main(int argc, char** argv){
-	if (argc != 2 && argc != 6) {
+	apply_tuning();
+
+	if (argc >= 3 && string(argv[1]) == "--bench-io") {
+		bench_io(argv[2], argc > 3 ? atoi(argv[3]) : 32768,
+				 argc > 4 ? atoi(argv[4]) : 32768);
+		exit(0);
+	}
+
+	if (argc >= 2 && string(argv[1]) == "--bench") {
+		bench(argc > 2 ? atoi(argv[2]) : 7680,
+			  argc > 3 ? atoi(argv[3]) : 4320,
+			  argc > 4 ? atoi(argv[4]) : 5000,
+			  argc > 5 ? atoi(argv[5]) : 10);
+		exit(0);
+	}
+
+	// PGM, PPM and raw are mapped instead of read; -w writes the result back
+	bool write_back = argc > 2 && string(argv[argc-1]) == "-w";
+	if (write_back) argc--;
+
+	bool from_file = argc == 4 && string(argv[2]) == "-f";
+	if (argc != 2 && argc != 6 && !from_file) {
 		cout << "usage: " << endl
 			 << "\t" << argv[0] << "<img_path>" 
 			 << " // To get image dimensions" << endl
 			 << "\t" << argv[0] << "<img_path> <x1> <y1> <x2> <y2>" 
-			 << " // To negative the rectangular area" << endl;
+			 << " // To negative the rectangular area" << endl
+			 << "\t" << argv[0] << "<img_path> -f <rect_file>"
+			 << " // To negative every area listed, one \"x1 y1 x2 y2\" per line" << endl
+			 << "\t" << argv[0] << "--bench [width] [height] [rects] [iterations]"
+			 << " // To time the negation of many random areas" << endl
+			 << "\t" << argv[0] << "--bench-io <ppm_path> [width] [height]"
+			 << " // To time mapping a PPM against imread, creating it if needed" << endl
+			 << "\tPGM, PPM and raw:WIDTHxHEIGHT:bgr|grey:<path> images are"
+			 << " memory-mapped; a trailing -w writes the negated areas back"
+			 << " into the file." << endl;
 
 		exit(1);
 	}
 	
-	Mat image = imread(argv[1], CV_LOAD_IMAGE_COLOR);
+	MappedImage mapped;
+	Mat image;
+	{
+		TRACE_SCOPE("decode");
+		image = load_image(argv[1], mapped, write_back);
+	}
 	
 	if (!image.data)
 		cout << "Could not open " << argv[1] << endl;
@@ -34,22 +198,51 @@ int main(int argc, char** argv){
 
 	if (argc == 2) exit(0);
 
-	int x1 = atoi(argv[2]); CHECK_VALID_RANGE(x1, rows);
-	int y1 = atoi(argv[3]); CHECK_VALID_RANGE(y1, cols);
-	int x2 = atoi(argv[4]); CHECK_VALID_RANGE(x2, rows);
-	int y2 = atoi(argv[5]); CHECK_VALID_RANGE(y2, cols);
+	vector<Rect> rects;
+	if (from_file) {
+		bool opened;
+		int bad_line = read_rectangles(argv[3], rects, &opened);
+		if (!opened) {
+			cout << "Could not open " << argv[3] << endl;
+			exit(1);
+		}
+		if (bad_line) {
+			cout << "Invalid rectangle on line " << bad_line << " of "
+				 << argv[3] << endl;
+			exit(1);
+		}
+		cout << rects.size() << " rectangles read" << endl;
+	} else {
+		int x1 = atoi(argv[2]); CHECK_VALID_RANGE(x1, rows);
+		int y1 = atoi(argv[3]); CHECK_VALID_RANGE(y1, cols);
+		int x2 = atoi(argv[4]); CHECK_VALID_RANGE(x2, rows);
+		int y2 = atoi(argv[5]); CHECK_VALID_RANGE(y2, cols);
+		rects.push_back(Rect(min(y1, y2), min(x1, x2), abs(y2 - y1), abs(x2 - x1)));
+	}
 
 	namedWindow(argv[1],WINDOW_AUTOSIZE);
 
-	for (int i = min(x1, x2); i < max(x1, x2); ++i) {
-		for (int j = min(y1, y2); j < max(y1, y2); ++j) {
-			image.at<Vec3b>(i,j)[0] = 255- image.at<Vec3b>(i,j)[0];
-			image.at<Vec3b>(i,j)[1] = 255- image.at<Vec3b>(i,j)[1];
-			image.at<Vec3b>(i,j)[2] = 255- image.at<Vec3b>(i,j)[2];
-		}
+	// Overlapping areas are negated once, not once per rectangle
+	RegionSet regions;
+	{
+		TRACE_SCOPE("build_regions");
+		regions.build(rects, image.size());
+	}
+	// Only the rows under the rectangles are read from a mapped file;
+	// start reading them all at once rather than fault them in one by one
+	if (mapped.isOpen())
+		for (size_t r = 0; r < rects.size(); ++r)
+			mapped.willNeed(rects[r]);
+	{
+		TRACE_SCOPE("negate");
+		regions.negate(image);
 	}
 
-	imshow(argv[1], image);  
+	if (write_back && mapped.isOpen()) {
+		TRACE_SCOPE("sync");
+		mapped.sync();
+	}
+	imshow_mapped(argv[1], image, mapped);
 	waitKey();
 
 	exit(0);
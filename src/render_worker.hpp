@@ -0,0 +1,126 @@
+#ifndef RENDER_WORKER_HPP
+#define RENDER_WORKER_HPP
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+
+// Renders for the interactive tools on a background thread, so slider
+// callbacks return at once. Requests posted while one is pending replace
+// it; a render in progress is abandoned at its next stage boundary as soon
+// as a newer request arrives. At most the current stage of one render is
+// wasted, however fast the sliders move.
+//
+// The UI thread picks up the newest finished result with take() and
+// shows it (HighGUI calls stay on the UI thread). Results are swapped in
+// and out, so their buffers are reused from one render to the next.
+
+// Polled by a render between stages: true means a newer request is
+// waiting and the render should give up.
+class RenderCancel {
+public:
+	RenderCancel(const std::atomic<unsigned long> &latest, unsigned long mine)
+		: latest(&latest), mine(mine) {}
+
+	bool operator()() const { return latest->load() != mine; }
+
+private:
+	const std::atomic<unsigned long> *latest;
+	unsigned long mine;
+};
+
+template<class Request, class Result>
+class RenderWorker {
+public:
+	// Returns false when it stopped because cancelled() said so
+	typedef std::function<bool(const Request&, Result&,
+							   const RenderCancel&)> RenderFn;
+
+	explicit RenderWorker(const RenderFn &render)
+		: render(render), latest(0), pending(false), finished(false),
+		  stopping(false), posted(0), merged(0), cancelled(0) {
+		worker = std::thread(&RenderWorker::run, this);
+	}
+
+	~RenderWorker() {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stopping = true;
+			latest++; // cancels a render in progress
+		}
+		has_request.notify_one();
+		worker.join();
+	}
+
+	void post(const Request &r) {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			if (pending) merged++;
+			request = r;
+			pending = true;
+			posted++;
+			latest++;
+		}
+		has_request.notify_one();
+	}
+
+	// Swaps the newest finished result into out; false if there is none
+	// since the last call
+	bool take(Result &out) {
+		std::lock_guard<std::mutex> lock(mtx);
+		if (!finished) return false;
+		std::swap(out, done);
+		finished = false;
+		return true;
+	}
+
+	// Requests posted, replaced while pending, and abandoned mid-render
+	unsigned long postedCount() const { return posted; }
+	unsigned long mergedCount() const { return merged; }
+	unsigned long cancelledCount() const { return cancelled; }
+
+private:
+	RenderWorker(const RenderWorker&);
+	RenderWorker& operator=(const RenderWorker&);
+
+	void run() {
+		for (;;) {
+			Request r;
+			unsigned long id;
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				while (!pending && !stopping)
+					has_request.wait(lock);
+				if (stopping) return;
+				r = request;
+				id = latest;
+				pending = false;
+			}
+
+			bool ok = render(r, rendering, RenderCancel(latest, id));
+
+			std::lock_guard<std::mutex> lock(mtx);
+			if (!ok) {
+				cancelled++;
+				continue;
+			}
+			std::swap(rendering, done);
+			finished = true;
+		}
+	}
+
+	RenderFn render;
+	std::mutex mtx;
+	std::condition_variable has_request;
+	std::atomic<unsigned long> latest; // id of the newest request
+	Request request;
+	bool pending, finished, stopping;
+	Result rendering, done;
+	std::atomic<unsigned long> posted, merged, cancelled;
+	std::thread worker;
+};
+
+#endif
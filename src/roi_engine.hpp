@@ -0,0 +1,211 @@
+#ifndef ROI_ENGINE_HPP
+#define ROI_ENGINE_HPP
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <stdint.h>
+#include <opencv2/opencv.hpp>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Many rectangles over one image, reduced to the set of pixels that any of
+// them covers so an operation touches every such pixel exactly once.
+//
+// A sweep over the rows keeps the rectangles crossing the current row in
+// an ordered multiset of column intervals. Rectangles only start or end at
+// their top and bottom rows, so between two consecutive such boundaries
+// the covered columns do not change: each of those row bands is stored
+// once, as sorted disjoint column spans.
+
+struct ColumnSpan {
+	int x0, x1; // [x0, x1)
+};
+
+struct RowBand {
+	int y0, y1; // [y0, y1)
+	std::vector<ColumnSpan> spans;
+};
+
+// Reads "x1 y1 x2 y2" per line, x being the row and y the column as on the
+// regions command line; blank lines and lines starting with # are skipped.
+// Returns the line number of the first malformed line, 0 when all parsed.
+inline int read_rectangles(const std::string &path, std::vector<cv::Rect> &rects,
+						   bool *opened = NULL) {
+	FILE *f = fopen(path.c_str(), "r");
+	if (opened) *opened = f != NULL;
+	if (!f) return 0;
+	char line[256];
+	int n = 0;
+	while (fgets(line, sizeof(line), f)) {
+		n++;
+		const char *p = line + strspn(line, " \t");
+		if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0) continue;
+		int x1, y1, x2, y2;
+		if (sscanf(p, "%d %d %d %d", &x1, &y1, &x2, &y2) != 4) {
+			fclose(f);
+			return n;
+		}
+		rects.push_back(cv::Rect(std::min(y1, y2), std::min(x1, x2),
+								 std::abs(y2 - y1), std::abs(x2 - x1)));
+	}
+	fclose(f);
+	return 0;
+}
+
+class RegionSet {
+public:
+	RegionSet() : covered(0) {}
+
+	// Merges rects, clipped to size, into disjoint row bands
+	void build(const std::vector<cv::Rect> &rects, cv::Size size) {
+		struct Edge { int y; bool open; int x0, x1; };
+		std::vector<Edge> edges;
+		edges.reserve(2 * rects.size());
+		for (size_t i = 0; i < rects.size(); ++i) {
+			int x0 = std::max(rects[i].x, 0);
+			int x1 = std::min(rects[i].x + rects[i].width, size.width);
+			int y0 = std::max(rects[i].y, 0);
+			int y1 = std::min(rects[i].y + rects[i].height, size.height);
+			if (x0 >= x1 || y0 >= y1) continue;
+			Edge open = {y0, true, x0, x1}, close = {y1, false, x0, x1};
+			edges.push_back(open);
+			edges.push_back(close);
+		}
+		std::sort(edges.begin(), edges.end(),
+				  [](const Edge &a, const Edge &b) { return a.y < b.y; });
+
+		bands.clear();
+		covered = 0;
+		std::multiset<std::pair<int, int> > active;
+		for (size_t e = 0; e < edges.size(); ) {
+			int y = edges[e].y;
+			for (; e < edges.size() && edges[e].y == y; ++e) {
+				std::pair<int, int> iv(edges[e].x0, edges[e].x1);
+				if (edges[e].open) active.insert(iv);
+				else active.erase(active.find(iv));
+			}
+			if (active.empty()) continue;
+
+			RowBand band;
+			band.y0 = y;
+			band.y1 = edges[e].y; // a close edge is always pending here
+			std::multiset<std::pair<int, int> >::const_iterator it = active.begin();
+			ColumnSpan cur = {it->first, it->second};
+			for (++it; it != active.end(); ++it) {
+				if (it->first <= cur.x1) {
+					cur.x1 = std::max(cur.x1, it->second);
+				} else {
+					band.spans.push_back(cur);
+					cur.x0 = it->first;
+					cur.x1 = it->second;
+				}
+			}
+			band.spans.push_back(cur);
+
+			// Extend the previous band when nothing changed but the rows
+			if (!bands.empty() && bands.back().y1 == band.y0 &&
+				sameSpans(bands.back().spans, band.spans)) {
+				bands.back().y1 = band.y1;
+			} else {
+				bands.push_back(band);
+			}
+			uint64_t width = 0;
+			for (size_t s = 0; s < band.spans.size(); ++s)
+				width += band.spans[s].x1 - band.spans[s].x0;
+			covered += width * (band.y1 - band.y0);
+		}
+	}
+
+	const std::vector<RowBand>& rowBands() const { return bands; }
+
+	// Pixels covered by at least one rectangle
+	uint64_t pixels() const { return covered; }
+
+	// Inverts every covered pixel of an 8-bit image, any channel count
+	void negate(cv::Mat &image) const {
+		if (bands.empty()) return;
+		int rows = bands.back().y1 - bands.front().y0;
+		int chunks = std::max(1, std::min(rows / 16, 4 * cv::getNumThreads()));
+		cv::parallel_for_(cv::Range(0, chunks), NegateBody(*this, image, chunks));
+	}
+
+private:
+	static bool sameSpans(const std::vector<ColumnSpan> &a,
+						  const std::vector<ColumnSpan> &b) {
+		if (a.size() != b.size()) return false;
+		for (size_t i = 0; i < a.size(); ++i)
+			if (a[i].x0 != b[i].x0 || a[i].x1 != b[i].x1) return false;
+		return true;
+	}
+
+	static void invertBytes(uchar *p, size_t n) {
+		size_t i = 0;
+#ifdef __SSE2__
+		const __m128i ones = _mm_set1_epi8((char) 0xff);
+		for (; i + 64 <= n; i += 64) {
+			__m128i *q = (__m128i*) (p + i);
+			_mm_storeu_si128(q,     _mm_xor_si128(_mm_loadu_si128(q),     ones));
+			_mm_storeu_si128(q + 1, _mm_xor_si128(_mm_loadu_si128(q + 1), ones));
+			_mm_storeu_si128(q + 2, _mm_xor_si128(_mm_loadu_si128(q + 2), ones));
+			_mm_storeu_si128(q + 3, _mm_xor_si128(_mm_loadu_si128(q + 3), ones));
+		}
+		for (; i + 16 <= n; i += 16) {
+			__m128i *q = (__m128i*) (p + i);
+			_mm_storeu_si128(q, _mm_xor_si128(_mm_loadu_si128(q), ones));
+		}
+#endif
+		for (; i + 8 <= n; i += 8) {
+			uint64_t v;
+			memcpy(&v, p + i, 8);
+			v = ~v;
+			memcpy(p + i, &v, 8);
+		}
+		for (; i < n; ++i)
+			p[i] = ~p[i];
+	}
+
+	// Chunks split the covered rows evenly, each one starting from the
+	// band that holds its first row
+	class NegateBody : public cv::ParallelLoopBody {
+	public:
+		NegateBody(const RegionSet &set, cv::Mat &image, int chunks)
+			: set(set), image(image), chunks(chunks) {}
+
+		void operator()(const cv::Range &range) const {
+			const std::vector<RowBand> &bands = set.bands;
+			int first = bands.front().y0, rows = bands.back().y1 - first;
+			size_t elem = image.elemSize();
+			for (int c = range.start; c < range.end; ++c) {
+				int y0 = first + (int) ((int64_t) rows * c / chunks);
+				int y1 = first + (int) ((int64_t) rows * (c + 1) / chunks);
+				size_t b = std::upper_bound(bands.begin(), bands.end(), y0,
+					[](int y, const RowBand &band) { return y < band.y1; })
+					- bands.begin();
+				for (; b < bands.size() && bands[b].y0 < y1; ++b) {
+					const RowBand &band = bands[b];
+					for (int y = std::max(y0, band.y0); y < std::min(y1, band.y1); ++y) {
+						uchar *row = image.ptr<uchar>(y);
+						for (size_t s = 0; s < band.spans.size(); ++s)
+							invertBytes(row + band.spans[s].x0 * elem,
+										(band.spans[s].x1 - band.spans[s].x0) * elem);
+					}
+				}
+			}
+		}
+
+	private:
+		const RegionSet &set;
+		cv::Mat &image;
+		int chunks;
+	};
+
+	std::vector<RowBand> bands;
+	uint64_t covered;
+};
+
+#endif
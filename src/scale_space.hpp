@@ -0,0 +1,151 @@
+#ifndef SCALE_SPACE_HPP
+#define SCALE_SPACE_HPP
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+#include "buffer_pool.hpp"
+
+// Laplacian of Gaussian at arbitrary sigmas from a Gaussian pyramid.
+//
+// Octave o holds the frame decimated by 2^o; its base is blurred to a
+// fixed sigma in its own pixels (0.5 for the camera frame, 1 after every
+// halving), so building it costs the same small blur whatever the
+// sigmas asked for. A scale sigma is served from the octave where
+// sigma / 2^o falls in [sqrt(k), 2 sqrt(k)): two incremental separable
+// blurs of that base give L at sigma / sqrt(k) and sigma * sqrt(k), and
+// their difference approximates the derivative of L in sigma^2, that is
+// half the Laplacian. The kernels involved never exceed a few pixels in
+// octave units, so large sigmas are as cheap as small ones (cheaper, as
+// their octave is smaller).
+//
+// Responses are scale normalised, -sigma^2 times the Laplacian of the
+// blurred frame: the sign of the laplacian_of_gaussian mask, and
+// comparable between scales.
+
+class ScaleSpaceLoG {
+public:
+	// k is the ratio between the two sigmas of each difference, above 1
+	explicit ScaleSpaceLoG(double k = 1.19) : k(std::max(k, 1.01)) {}
+
+	// Sigmas below the frame's own blur (0.5) are raised to it; the
+	// difference of Gaussians has nothing to subtract below that
+	void setScales(const std::vector<double> &sigmas) {
+		scales = sigmas;
+		for (size_t i = 0; i < scales.size(); ++i)
+			scales[i] = std::max(scales[i], baseSigma(0));
+	}
+	const std::vector<double>& sigmas() const { return scales; }
+
+	// Octave scale i was computed in, valid after apply()
+	int octaveOf(int i) const { return plans[i].octave; }
+
+	// One CV_32F response per scale for a CV_8UC1 or CV_32F grey frame,
+	// at the frame's size when full_size is set, else at the octave's
+	void apply(const cv::Mat &grey, std::vector<cv::Mat> &responses,
+			   bool full_size = true) {
+		plan(grey.size());
+		buildOctaves(grey);
+		responses.resize(scales.size());
+		cv::parallel_for_(cv::Range(0, (int) scales.size()),
+						  ScaleBody(*this, responses, grey.size(), full_size));
+	}
+
+private:
+	struct Plan {
+		int octave;
+		double blur_a, blur_b; // incremental sigmas, octave units
+		double gain;           // -2 sigma^2 / (sigma_b^2 - sigma_a^2)
+	};
+
+	static double baseSigma(int octave) { return octave == 0 ? 0.5 : 1.0; }
+
+	void plan(const cv::Size &size) {
+		int max_octave = 0;
+		while (std::min(size.width, size.height) >> (max_octave + 1) >= 16)
+			max_octave++;
+
+		plans.resize(scales.size());
+		num_octaves = 1;
+		double root_k = std::sqrt(k);
+		for (size_t i = 0; i < scales.size(); ++i) {
+			Plan &p = plans[i];
+			double s = scales[i] / root_k;
+			p.octave = s >= 1 ? (int) std::floor(std::log(s) / std::log(2.0)) : 0;
+			p.octave = std::min(p.octave, max_octave);
+			num_octaves = std::max(num_octaves, p.octave + 1);
+
+			double local = scales[i] / (1 << p.octave), base = baseSigma(p.octave);
+			double sa = std::max(local / root_k, base), sb = local * root_k;
+			p.blur_a = std::sqrt(sa * sa - base * base);
+			p.blur_b = std::sqrt(sb * sb - sa * sa);
+			p.gain = -2 * local * local / (sb * sb - sa * sa);
+		}
+	}
+
+	void buildOctaves(const cv::Mat &grey) {
+		octaves.resize(num_octaves);
+		frame_pool().ensure(octaves[0], grey.size(), CV_32F);
+		grey.convertTo(octaves[0], CV_32F);
+		for (int o = 1; o < num_octaves; ++o) {
+			// To sigma 2 here, which is sigma 1 once halved. Halving with
+			// INTER_LINEAR averages 2x2 blocks, keeping pixel centres where
+			// the final INTER_LINEAR upsampling expects them.
+			double b = baseSigma(o - 1);
+			cv::Size half(octaves[o-1].cols / 2, octaves[o-1].rows / 2);
+			frame_pool().ensure(decimate, octaves[o-1].size(), CV_32F);
+			frame_pool().ensure(octaves[o], half, CV_32F);
+			blur(octaves[o-1], decimate, std::sqrt(4 - b * b));
+			cv::resize(decimate, octaves[o], half, 0, 0, cv::INTER_LINEAR);
+		}
+	}
+
+	static void blur(const cv::Mat &src, cv::Mat &dst, double sigma) {
+		if (sigma < 0.05) src.copyTo(dst);
+		else cv::GaussianBlur(src, dst, cv::Size(0, 0), sigma, sigma,
+							  cv::BORDER_REFLECT_101);
+	}
+
+	class ScaleBody : public cv::ParallelLoopBody {
+	public:
+		ScaleBody(const ScaleSpaceLoG &ss, std::vector<cv::Mat> &out,
+				  cv::Size size, bool full_size)
+			: ss(ss), out(out), size(size), full_size(full_size) {}
+
+		void operator()(const cv::Range &range) const {
+			for (int i = range.start; i < range.end; ++i) {
+				const Plan &p = ss.plans[i];
+				const cv::Mat &base = ss.octaves[p.octave];
+				PooledMat la(base.size(), CV_32F), lb(base.size(), CV_32F),
+					dog(base.size(), CV_32F);
+				blur(base, la.mat, p.blur_a);
+				blur(la.mat, lb.mat, p.blur_b);
+				cv::subtract(lb.mat, la.mat, dog.mat);
+				if (full_size && p.octave > 0) {
+					dog.mat.convertTo(dog.mat, CV_32F, p.gain);
+					frame_pool().ensure(out[i], size, CV_32F);
+					cv::resize(dog.mat, out[i], size, 0, 0, cv::INTER_LINEAR);
+				} else {
+					frame_pool().ensure(out[i], base.size(), CV_32F);
+					dog.mat.convertTo(out[i], CV_32F, p.gain);
+				}
+			}
+		}
+
+	private:
+		const ScaleSpaceLoG &ss;
+		std::vector<cv::Mat> &out;
+		cv::Size size;
+		bool full_size;
+	};
+
+	double k;
+	std::vector<double> scales;
+	std::vector<Plan> plans;
+	int num_octaves;
+	std::vector<cv::Mat> octaves;
+	cv::Mat decimate;
+};
+
+#endif
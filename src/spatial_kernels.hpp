@@ -0,0 +1,598 @@
+#ifndef SPATIAL_KERNELS_HPP
+#define SPATIAL_KERNELS_HPP
+
+#include <opencv2/opencv.hpp>
+#include "buffer_pool.hpp"
+#include "cpu_dispatch.hpp"
+#include "tuning.hpp"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Small integer convolution kernels with their coefficients as template
+// parameters. They read 8-bit grey images, accumulate in 16 bits, and
+// write 8-bit results: optionally the absolute value, saturated to
+// [0, 255], after a rounded division by the kernel's normalisation.
+// That matches filter2D on float followed by abs() and convertTo(CV_8U),
+// with the same BORDER_REFLECT_101 border, but stays in integers.
+
+// Compile-time list of taps
+template<int... K> struct Taps;
+
+template<> struct Taps<> {
+	static const int size = 0;
+	static constexpr int get(int) { return 0; }
+};
+
+template<int K0, int... K> struct Taps<K0, K...> {
+	static const int size = 1 + sizeof...(K);
+	static constexpr int get(int i) { return i == 0 ? K0 : Taps<K...>::get(i - 1); }
+};
+
+// Kernel = Col^T x Row, divided by Div
+template<class Col, class Row, int Div> struct Separable {
+	static const int radius = Col::size / 2;
+	static const int div = Div;
+};
+
+// Size x Size kernel given row by row, divided by Div
+template<int Size, int Div, int... K> struct Dense {
+	typedef Taps<K...> taps;
+	static const int size = Size;
+	static const int radius = Size / 2;
+	static const int div = Div;
+};
+
+typedef Separable<Taps<1,1,1>,  Taps<1,1,1>,  9> BoxKernel;
+typedef Separable<Taps<1,2,1>,  Taps<1,2,1>, 16> GaussKernel;
+typedef Separable<Taps<1,2,1>,  Taps<-1,0,1>, 1> HorizontalKernel;
+typedef Separable<Taps<-1,0,1>, Taps<1,2,1>,  1> VerticalKernel;
+typedef Dense<3, 1,  0,-1, 0,
+					-1, 4,-1,
+					 0,-1, 0> LaplacianKernel;
+typedef Dense<5, 1,  0,-1,-2,-1, 0,
+					-1, 0, 2, 0,-1,
+					-2, 2, 8, 2,-2,
+					-1, 0, 2, 0,-1,
+					 0,-1,-2,-1, 0> LaplacianOfGaussianKernel;
+
+// Rounded division of a non-negative sum. Powers of two round half to
+// even like cvRound; other divisors use a reciprocal multiply, exact for
+// the sums the 3x3 kernels can produce.
+template<int Div> inline int round_div(int v) {
+	if (Div == 1) return v;
+	if ((Div & (Div - 1)) == 0) {
+		int s = 0;
+		while ((1 << s) < Div) s++;
+		return (v + Div/2 - 1 + ((v >> s) & 1)) >> s;
+	}
+	return ((v + Div/2) * ((65536 + Div - 1) / Div)) >> 16;
+}
+
+inline uchar finish_pixel(int v, bool absolute) {
+	if (absolute && v < 0) v = -v;
+	return (uchar) (v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+#ifdef __SSE2__
+template<int K> inline __m128i mul_tap(__m128i v) {
+	if (K == 1)  return v;
+	if (K == -1) return _mm_sub_epi16(_mm_setzero_si128(), v);
+	if (K == 2)  return _mm_add_epi16(v, v);
+	if (K == -2) return _mm_sub_epi16(_mm_setzero_si128(), _mm_add_epi16(v, v));
+	return _mm_mullo_epi16(v, _mm_set1_epi16((short) K));
+}
+
+inline __m128i load_u8x8(const uchar *p) {
+	return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) p),
+							 _mm_setzero_si128());
+}
+
+template<int Div> inline __m128i round_div(__m128i v) {
+	if (Div == 1) return v;
+	if ((Div & (Div - 1)) == 0) {
+		int s = 0;
+		while ((1 << s) < Div) s++;
+		__m128i shift = _mm_cvtsi32_si128(s);
+		__m128i odd = _mm_and_si128(_mm_srl_epi16(v, shift), _mm_set1_epi16(1));
+		return _mm_srl_epi16(_mm_add_epi16(_mm_add_epi16(v, odd),
+										   _mm_set1_epi16(Div/2 - 1)), shift);
+	}
+	return _mm_mulhi_epu16(_mm_add_epi16(v, _mm_set1_epi16(Div/2)),
+						   _mm_set1_epi16((short) ((65536 + Div - 1) / Div)));
+}
+
+// |v| if asked, then saturate to 8 bits and store 8 pixels
+inline void finish_store(__m128i v, bool absolute, uchar *d) {
+	if (absolute)
+		v = _mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(), v));
+	_mm_storel_epi64((__m128i*) d, _mm_packus_epi16(v, v));
+}
+#endif
+
+#ifdef PDI_DISPATCH
+// The same helpers on 16 lanes, for the AVX2 variants
+template<int K> PDI_AVX2 inline __m256i mul_tap256(__m256i v) {
+	if (K == 1)  return v;
+	if (K == -1) return _mm256_sub_epi16(_mm256_setzero_si256(), v);
+	if (K == 2)  return _mm256_add_epi16(v, v);
+	if (K == -2) return _mm256_sub_epi16(_mm256_setzero_si256(), _mm256_add_epi16(v, v));
+	return _mm256_mullo_epi16(v, _mm256_set1_epi16((short) K));
+}
+
+PDI_AVX2 inline __m256i load_u8x16(const uchar *p) {
+	return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) p));
+}
+
+template<int Div> PDI_AVX2 inline __m256i round_div256(__m256i v) {
+	if (Div == 1) return v;
+	if ((Div & (Div - 1)) == 0) {
+		int s = 0;
+		while ((1 << s) < Div) s++;
+		__m128i shift = _mm_cvtsi32_si128(s);
+		__m256i odd = _mm256_and_si256(_mm256_srl_epi16(v, shift),
+									   _mm256_set1_epi16(1));
+		return _mm256_srl_epi16(_mm256_add_epi16(_mm256_add_epi16(v, odd),
+												 _mm256_set1_epi16(Div/2 - 1)), shift);
+	}
+	return _mm256_mulhi_epu16(_mm256_add_epi16(v, _mm256_set1_epi16(Div/2)),
+							  _mm256_set1_epi16((short) ((65536 + Div - 1) / Div)));
+}
+
+// packus works within 128-bit lanes: the 16 results end up in quadwords
+// 0 and 2
+PDI_AVX2 inline void finish_store256(__m256i v, bool absolute, uchar *d) {
+	if (absolute)
+		v = _mm256_abs_epi16(v);
+	__m256i p = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0x08);
+	_mm_storeu_si128((__m128i*) d, _mm256_castsi256_si128(p));
+}
+#endif
+
+// Sum of K[i] * p[i * stride] over the taps, scalar
+template<class T, int N, int I = 0> struct TapSum {
+	template<typename P> static inline int run(const P *p, int stride) {
+		const int k = T::get(I);
+		return (k ? k * (int) p[I * stride] : 0) +
+			   TapSum<T, N, I + 1>::run(p, stride);
+	}
+};
+template<class T, int N> struct TapSum<T, N, N> {
+	template<typename P> static inline int run(const P*, int) { return 0; }
+};
+
+#ifdef __SSE2__
+// Same over 8 lanes; rows[i] points at the i-th input of the first lane
+template<class T, int N, int I = 0> struct TapSumV {
+	static inline __m128i u8(const uchar *const *rows, int x) {
+		const int k = T::get(I);
+		__m128i rest = TapSumV<T, N, I + 1>::u8(rows, x);
+		return k ? _mm_add_epi16(mul_tap<k>(load_u8x8(rows[I] + x)), rest) : rest;
+	}
+	static inline __m128i s16(const short *p) {
+		const int k = T::get(I);
+		__m128i rest = TapSumV<T, N, I + 1>::s16(p);
+		return k ? _mm_add_epi16(mul_tap<k>(
+						_mm_loadu_si128((const __m128i*) (p + I))), rest) : rest;
+	}
+};
+template<class T, int N> struct TapSumV<T, N, N> {
+	static inline __m128i u8(const uchar *const *, int) { return _mm_setzero_si128(); }
+	static inline __m128i s16(const short *) { return _mm_setzero_si128(); }
+};
+#endif
+
+#ifdef PDI_DISPATCH
+template<class T, int N, int I = 0> struct TapSumV256 {
+	PDI_AVX2 static inline __m256i u8(const uchar *const *rows, int x) {
+		const int k = T::get(I);
+		__m256i rest = TapSumV256<T, N, I + 1>::u8(rows, x);
+		return k ? _mm256_add_epi16(mul_tap256<k>(load_u8x16(rows[I] + x)), rest) : rest;
+	}
+	PDI_AVX2 static inline __m256i s16(const short *p) {
+		const int k = T::get(I);
+		__m256i rest = TapSumV256<T, N, I + 1>::s16(p);
+		return k ? _mm256_add_epi16(mul_tap256<k>(
+						_mm256_loadu_si256((const __m256i*) (p + I))), rest) : rest;
+	}
+};
+template<class T, int N> struct TapSumV256<T, N, N> {
+	PDI_AVX2 static inline __m256i u8(const uchar *const *, int) { return _mm256_setzero_si256(); }
+	PDI_AVX2 static inline __m256i s16(const short *) { return _mm256_setzero_si256(); }
+};
+#endif
+
+// Rows of a row-major Size x Size tap list
+template<class T, int Row, int Size> struct RowTaps;
+template<int... K, int Row, int Size> struct RowTaps<Taps<K...>, Row, Size> {
+	static constexpr int get(int i) { return Taps<K...>::get(Row * Size + i); }
+};
+
+// Filters rows [y0, y1) of src (the image padded by the kernel radius on
+// every side) into dst, which has the unpadded size
+template<class Kernel> struct KernelRows;
+
+template<class Col, class Row, int Div>
+struct KernelRows<Separable<Col, Row, Div> > {
+	static const int n = Col::size;
+
+#ifdef PDI_DISPATCH
+	// Both passes of one row on 16 lanes; return the first column left
+	PDI_AVX2 static int vertical_avx2(const uchar *const *rows, short *buf,
+									  int width) {
+		int x = 0;
+		for (; x + 16 <= width; x += 16)
+			_mm256_storeu_si256((__m256i*) (buf + x), TapSumV256<Col, n>::u8(rows, x));
+		return x;
+	}
+
+	PDI_AVX2 static int horizontal_avx2(const short *buf, uchar *d, int out,
+										bool absolute) {
+		int x = 0;
+		for (; x + 16 <= out; x += 16)
+			finish_store256(round_div256<Div>(TapSumV256<Row, n>::s16(buf + x)),
+							absolute, d + x);
+		return x;
+	}
+#endif
+
+	static void run(const cv::Mat &src, cv::Mat &dst, int y0, int y1,
+					bool absolute, std::vector<short> &buf) {
+		int width = src.cols;
+		buf.resize(width + 16);
+		const uchar *rows[n];
+#ifdef PDI_DISPATCH
+		bool avx2 = cpu_level() >= CPU_AVX2;
+#endif
+		for (int y = y0; y < y1; ++y) {
+			for (int i = 0; i < n; ++i) rows[i] = src.ptr<uchar>(y + i);
+
+			// Vertical taps over the padded width
+			int x = 0;
+#ifdef PDI_DISPATCH
+			if (avx2) x = vertical_avx2(rows, &buf[0], width);
+#endif
+#ifdef __SSE2__
+			for (; x + 8 <= width; x += 8)
+				_mm_storeu_si128((__m128i*) &buf[x], TapSumV<Col, n>::u8(rows, x));
+#endif
+			for (; x < width; ++x) {
+				int acc = 0;
+				for (int i = 0; i < n; ++i) acc += Col::get(i) * rows[i][x];
+				buf[x] = (short) acc;
+			}
+
+			// Horizontal taps, normalisation and saturation
+			uchar *d = dst.ptr<uchar>(y);
+			int out = dst.cols;
+			x = 0;
+#ifdef PDI_DISPATCH
+			if (avx2) x = horizontal_avx2(&buf[0], d, out, absolute);
+#endif
+#ifdef __SSE2__
+			for (; x + 8 <= out; x += 8)
+				finish_store(round_div<Div>(TapSumV<Row, n>::s16(&buf[x])),
+							 absolute, d + x);
+#endif
+			for (; x < out; ++x)
+				d[x] = finish_pixel(round_div<Div>(TapSum<Row, n>::run(&buf[x], 1)),
+									absolute);
+		}
+	}
+};
+
+template<int Size, int Div, int... K>
+struct KernelRows<Dense<Size, Div, K...> > {
+	typedef Taps<K...> T;
+
+	template<int R> struct Line {
+		typedef RowTaps<T, R, Size> taps_t;
+		struct taps { static constexpr int get(int i) { return taps_t::get(i); } };
+	};
+
+	template<int R, int Dummy = 0> struct Rows {
+		static inline int scalar(const uchar *const *rows, int x) {
+			return TapSum<typename Line<R>::taps, Size>::run(rows[R] + x, 1) +
+				   Rows<R + 1>::scalar(rows, x);
+		}
+#ifdef __SSE2__
+		static inline __m128i vec(const uchar *const *rows, int x) {
+			const uchar *shifted[Size];
+			for (int j = 0; j < Size; ++j) shifted[j] = rows[R] + j;
+			return _mm_add_epi16(TapSumV<typename Line<R>::taps, Size>::u8(shifted, x),
+								 Rows<R + 1>::vec(rows, x));
+		}
+#endif
+#ifdef PDI_DISPATCH
+		PDI_AVX2 static inline __m256i vec256(const uchar *const *rows, int x) {
+			const uchar *shifted[Size];
+			for (int j = 0; j < Size; ++j) shifted[j] = rows[R] + j;
+			return _mm256_add_epi16(TapSumV256<typename Line<R>::taps, Size>::u8(shifted, x),
+									Rows<R + 1>::vec256(rows, x));
+		}
+#endif
+	};
+	template<int Dummy> struct Rows<Size, Dummy> {
+		static inline int scalar(const uchar *const *, int) { return 0; }
+#ifdef __SSE2__
+		static inline __m128i vec(const uchar *const *, int) { return _mm_setzero_si128(); }
+#endif
+#ifdef PDI_DISPATCH
+		PDI_AVX2 static inline __m256i vec256(const uchar *const *, int) {
+			return _mm256_setzero_si256();
+		}
+#endif
+	};
+
+#ifdef PDI_DISPATCH
+	PDI_AVX2 static int row_avx2(const uchar *const *rows, uchar *d, int out,
+								 bool absolute) {
+		int x = 0;
+		for (; x + 16 <= out; x += 16)
+			finish_store256(round_div256<Div>(Rows<0>::vec256(rows, x)), absolute, d + x);
+		return x;
+	}
+#endif
+
+	static void run(const cv::Mat &src, cv::Mat &dst, int y0, int y1,
+					bool absolute, std::vector<short> &) {
+		const uchar *rows[Size];
+#ifdef PDI_DISPATCH
+		bool avx2 = cpu_level() >= CPU_AVX2;
+#endif
+		for (int y = y0; y < y1; ++y) {
+			for (int i = 0; i < Size; ++i) rows[i] = src.ptr<uchar>(y + i);
+			uchar *d = dst.ptr<uchar>(y);
+			int x = 0;
+#ifdef PDI_DISPATCH
+			if (avx2) x = row_avx2(rows, d, dst.cols, absolute);
+#endif
+#ifdef __SSE2__
+			for (; x + 8 <= dst.cols; x += 8)
+				finish_store(round_div<Div>(Rows<0>::vec(rows, x)), absolute, d + x);
+#endif
+			for (; x < dst.cols; ++x)
+				d[x] = finish_pixel(round_div<Div>(Rows<0>::scalar(rows, x)), absolute);
+		}
+	}
+};
+
+// dst = saturate(|src (*) Kernel|) for a CV_8UC1 image. border is scratch
+// space for the padded copy and can be reused between calls.
+template<class Kernel>
+void apply_kernel(const cv::Mat &src, cv::Mat &dst, bool absolute,
+				  cv::Mat &border) {
+	const int r = Kernel::radius;
+	cv::copyMakeBorder(src, border, r, r, r, r, cv::BORDER_REFLECT_101);
+	dst.create(src.size(), CV_8UC1);
+	std::vector<short> buf;
+	KernelRows<Kernel>::run(border, dst, 0, src.rows, absolute, buf);
+}
+
+// Fused pipeline: BGR frame -> grey -> horizontal mirror -> Kernel ->
+// |.| -> saturate, one tile of rows at a time. Each tile converts the rows
+// it needs, plus a halo of the kernel radius, into a small padded grey
+// buffer that stays in cache, and filters straight from it, so the frame is
+// read once and the result written once. Tiles run in parallel.
+
+// Rows of output per tile are chosen so the grey buffer is about this big,
+// unless bench --autotune found a better size for this machine
+#define FUSED_TILE_BYTES (64 * 1024)
+
+inline int fused_tile_bytes() {
+	int tuned = tuning().fused_tile_bytes;
+	return tuned > 0 ? tuned : FUSED_TILE_BYTES;
+}
+
+inline int reflect_101(int i, int n) {
+	if (n == 1) return 0;
+	while (i < 0 || i >= n) i = i < 0 ? -i : 2 * n - 2 - i;
+	return i;
+}
+
+// Grey (cvtColor's 14-bit fixed point weights) of a BGR row, written
+// mirrored into d[r .. r+width) with reflected borders of r pixels
+inline void grey_mirror_row(const uchar *bgr, int width, int r, uchar *d) {
+	uchar *out = d + r + width - 1;
+	for (int x = 0; x < width; ++x, bgr += 3)
+		out[-x] = (uchar) ((bgr[0] * 1868 + bgr[1] * 9617 + bgr[2] * 4899
+							+ (1 << 13)) >> 14);
+	for (int k = 1; k <= r; ++k) {
+		d[r - k] = d[r + reflect_101(-k, width)];
+		d[r + width - 1 + k] = d[r + reflect_101(width - 1 + k, width)];
+	}
+}
+
+template<class Kernel>
+class FusedBody : public cv::ParallelLoopBody {
+public:
+	FusedBody(const cv::Mat &bgr, cv::Mat &dst, bool absolute, int tile_rows)
+		: bgr(bgr), dst(dst), absolute(absolute), tile_rows(tile_rows) {}
+
+	void operator()(const cv::Range &range) const {
+		const int r = Kernel::radius;
+		int width = bgr.cols;
+		PooledMat buf(cv::Size(width + 2 * r, tile_rows + 2 * r), CV_8UC1);
+		std::vector<short> row;
+
+		for (int t = range.start; t < range.end; ++t) {
+			int y0 = t * tile_rows;
+			int y1 = std::min(bgr.rows, y0 + tile_rows);
+			cv::Mat tile = buf.mat.rowRange(0, y1 - y0 + 2 * r);
+			for (int i = 0; i < tile.rows; ++i)
+				grey_mirror_row(bgr.ptr<uchar>(reflect_101(y0 - r + i, bgr.rows)),
+								width, r, tile.ptr<uchar>(i));
+
+			cv::Mat out = dst.rowRange(y0, y1);
+			KernelRows<Kernel>::run(tile, out, 0, y1 - y0, absolute, row);
+		}
+	}
+
+private:
+	const cv::Mat &bgr;
+	cv::Mat &dst;
+	bool absolute;
+	int tile_rows;
+};
+
+// dst = saturate(|mirror(grey(bgr)) (*) Kernel|) in one fused pass, with
+// tiles of about tile_bytes of grey
+template<class Kernel>
+void fused_filter_tiled(const cv::Mat &bgr, cv::Mat &dst, bool absolute,
+						int tile_bytes) {
+	const int r = Kernel::radius;
+	dst.create(bgr.size(), CV_8UC1);
+	int tile_rows = std::max(8, tile_bytes / (bgr.cols + 2 * r) - 2 * r);
+	int tiles = (bgr.rows + tile_rows - 1) / tile_rows;
+	cv::parallel_for_(cv::Range(0, tiles),
+					  FusedBody<Kernel>(bgr, dst, absolute, tile_rows));
+}
+
+template<class Kernel>
+void fused_filter(const cv::Mat &bgr, cv::Mat &dst, bool absolute) {
+	fused_filter_tiled<Kernel>(bgr, dst, absolute, fused_tile_bytes());
+}
+
+// Filter bank: mean, Gauss, horizontal, vertical, Laplacian and LoG in one
+// traversal. Per output row the five input rows are loaded once into
+// shared vertical sums (1-1-1, 1-2-1 and -1-0-1 over the middle three
+// rows, outer and inner row pairs for the symmetric LoG), and every
+// filter is a short horizontal combination of those.
+enum {
+	BANK_MEAN, BANK_GAUSS, BANK_HORIZONTAL, BANK_VERTICAL,
+	BANK_LAPLACIAN, BANK_LOG, BANK_SIZE
+};
+
+class FilterBankBody : public cv::ParallelLoopBody {
+public:
+	// src is padded by 2 on every side, planes[f] have the unpadded size
+	FilterBankBody(const cv::Mat &src, cv::Mat *planes, bool absolute,
+				   int bands)
+		: src(src), planes(planes), absolute(absolute), bands(bands) {}
+
+	void operator()(const cv::Range &range) const {
+		int width = src.cols, out = width - 4;
+		std::vector<short> buf(6 * (width + 8));
+		short *s111 = &buf[0],             *s121 = s111 + width + 8;
+		short *dcol = s121 + width + 8,    *mid  = dcol + width + 8;
+		short *p04  = mid + width + 8,     *p13  = p04 + width + 8;
+
+		int rows = out ? planes[0].rows : 0;
+		for (int b = range.start; b < range.end; ++b) {
+			for (int y = rows * b / bands; y < rows * (b + 1) / bands; ++y) {
+				const uchar *r0 = src.ptr<uchar>(y),     *r1 = src.ptr<uchar>(y + 1);
+				const uchar *r2 = src.ptr<uchar>(y + 2), *r3 = src.ptr<uchar>(y + 3);
+				const uchar *r4 = src.ptr<uchar>(y + 4);
+
+				int x = 0;
+#ifdef __SSE2__
+				for (; x + 8 <= width; x += 8) {
+					__m128i a = load_u8x8(r1 + x), c = load_u8x8(r2 + x);
+					__m128i e = load_u8x8(r3 + x);
+					__m128i ae = _mm_add_epi16(a, e);
+					_mm_storeu_si128((__m128i*) (s111 + x), _mm_add_epi16(ae, c));
+					_mm_storeu_si128((__m128i*) (s121 + x),
+									 _mm_add_epi16(ae, _mm_add_epi16(c, c)));
+					_mm_storeu_si128((__m128i*) (dcol + x), _mm_sub_epi16(e, a));
+					_mm_storeu_si128((__m128i*) (mid  + x), c);
+					_mm_storeu_si128((__m128i*) (p04  + x),
+									 _mm_add_epi16(load_u8x8(r0 + x), load_u8x8(r4 + x)));
+					_mm_storeu_si128((__m128i*) (p13  + x), ae);
+				}
+#endif
+				for (; x < width; ++x) {
+					s111[x] = r1[x] + r2[x] + r3[x];
+					s121[x] = r1[x] + 2 * r2[x] + r3[x];
+					dcol[x] = r3[x] - r1[x];
+					mid[x]  = r2[x];
+					p04[x]  = r0[x] + r4[x];
+					p13[x]  = r1[x] + r3[x];
+				}
+
+				uchar *d[BANK_SIZE];
+				for (int f = 0; f < BANK_SIZE; ++f) d[f] = planes[f].ptr<uchar>(y);
+
+				// Column x of the output is column x + 2 of the buffers
+				x = 0;
+#ifdef __SSE2__
+				for (; x + 8 <= out; x += 8) {
+#define L(p, dx) _mm_loadu_si128((const __m128i*) ((p) + x + 2 + (dx)))
+					__m128i m0 = L(mid, 0);
+					__m128i mean = _mm_add_epi16(_mm_add_epi16(L(s111, -1), L(s111, 1)),
+												 L(s111, 0));
+					__m128i gauss = _mm_add_epi16(_mm_add_epi16(L(s121, -1), L(s121, 1)),
+												  _mm_slli_epi16(L(s121, 0), 1));
+					__m128i hor = _mm_sub_epi16(L(s121, 1), L(s121, -1));
+					__m128i ver = _mm_add_epi16(_mm_add_epi16(L(dcol, -1), L(dcol, 1)),
+												_mm_slli_epi16(L(dcol, 0), 1));
+					__m128i lap = _mm_sub_epi16(_mm_sub_epi16(
+						_mm_add_epi16(_mm_slli_epi16(m0, 2), m0), L(s111, 0)),
+						_mm_add_epi16(L(mid, -1), L(mid, 1)));
+					__m128i log = _mm_sub_epi16(
+						_mm_add_epi16(_mm_slli_epi16(m0, 3),
+							_mm_slli_epi16(_mm_add_epi16(_mm_sub_epi16(
+								_mm_add_epi16(L(mid, -1), L(mid, 1)),
+								_mm_add_epi16(L(mid, -2), L(mid, 2))), L(p13, 0)), 1)),
+						_mm_add_epi16(_mm_add_epi16(L(p04, -1), L(p04, 1)),
+							_mm_add_epi16(_mm_slli_epi16(L(p04, 0), 1),
+										  _mm_add_epi16(L(p13, -2), L(p13, 2)))));
+#undef L
+					finish_store(round_div<9>(mean),   absolute, d[BANK_MEAN] + x);
+					finish_store(round_div<16>(gauss), absolute, d[BANK_GAUSS] + x);
+					finish_store(hor, absolute, d[BANK_HORIZONTAL] + x);
+					finish_store(ver, absolute, d[BANK_VERTICAL] + x);
+					finish_store(lap, absolute, d[BANK_LAPLACIAN] + x);
+					finish_store(log, absolute, d[BANK_LOG] + x);
+				}
+#endif
+				for (; x < out; ++x) {
+					int c = x + 2;
+					int m0 = mid[c];
+					d[BANK_MEAN][x] = finish_pixel(round_div<9>(
+						s111[c-1] + s111[c] + s111[c+1]), absolute);
+					d[BANK_GAUSS][x] = finish_pixel(round_div<16>(
+						s121[c-1] + 2 * s121[c] + s121[c+1]), absolute);
+					d[BANK_HORIZONTAL][x] = finish_pixel(s121[c+1] - s121[c-1], absolute);
+					d[BANK_VERTICAL][x] = finish_pixel(
+						dcol[c-1] + 2 * dcol[c] + dcol[c+1], absolute);
+					d[BANK_LAPLACIAN][x] = finish_pixel(
+						5 * m0 - s111[c] - mid[c-1] - mid[c+1], absolute);
+					d[BANK_LOG][x] = finish_pixel(8 * m0
+						+ 2 * (mid[c-1] + mid[c+1] - mid[c-2] - mid[c+2] + p13[c])
+						- p04[c-1] - p04[c+1] - 2 * p04[c] - p13[c-2] - p13[c+2],
+						absolute);
+				}
+			}
+		}
+	}
+
+private:
+	const cv::Mat &src;
+	cv::Mat *planes;
+	bool absolute;
+	int bands;
+};
+
+// Runs every filter of the bank over a CV_8UC1 image into planes, which
+// must already have src's size (they may be views into one mosaic).
+inline void filter_bank(const cv::Mat &src, cv::Mat planes[BANK_SIZE],
+						bool absolute, cv::Mat &border) {
+	cv::copyMakeBorder(src, border, 2, 2, 2, 2, cv::BORDER_REFLECT_101);
+	int bands = std::max(1, std::min(cv::getNumThreads(), src.rows));
+	cv::parallel_for_(cv::Range(0, bands),
+					  FilterBankBody(border, planes, absolute, bands));
+}
+
+// Same, laid out as a 3x2 mosaic: mean, Gauss, horizontal on top, then
+// vertical, Laplacian and LoG
+inline void filter_bank_mosaic(const cv::Mat &src, cv::Mat &mosaic,
+							   bool absolute, cv::Mat &border) {
+	mosaic.create(2 * src.rows, 3 * src.cols, CV_8UC1);
+	cv::Mat planes[BANK_SIZE];
+	for (int f = 0; f < BANK_SIZE; ++f)
+		planes[f] = mosaic(cv::Rect((f % 3) * src.cols, (f / 3) * src.rows,
+									src.cols, src.rows));
+	filter_bank(src, planes, absolute, border);
+}
+
+#endif
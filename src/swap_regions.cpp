@@ -1,56 +1,148 @@
 #include <iostream>
 #include <cstdlib>
+#include <chrono>
 #include <opencv2/opencv.hpp>
+#include "tile_permute.hpp"
+#include "mapped_image.hpp"
+#include "trace.hpp"
+#include "tuning.hpp"
 
 using namespace cv;
 using namespace std;
 
+typedef chrono::steady_clock Clock;
+
 #define CHECK_VALID_RANGE(x) if (x < 0 || x > 3) \
 	{cout << "Invalid region number in sequence" << endl; exit(1);}
 
+// Shuffles an n x m grid of a synthetic image with a random permutation,
+// into a second image and in place, and checks both agree.
+void bench(int width, int height, int n, int m, int iterations) {
+	Mat image(height, width, CV_8UC3), swapped, in_place;
+	randu(image, Scalar::all(0), Scalar::all(256));
+	TileGrid grid(image.size(), n, m);
+	vector<int> perm(grid.count());
+	for (int i = 0; i < grid.count(); ++i) perm[i] = i;
+	random_shuffle(perm.begin(), perm.end());
+
+	Clock::time_point t0 = Clock::now();
+	for (int i = 0; i < iterations; ++i)
+		permute_tiles(image, swapped, grid, perm);
+	Clock::time_point t1 = Clock::now();
+	// The same permutation over and over, so start from a known state
+	image.copyTo(in_place);
+	permute_tiles_in_place(in_place, grid, perm);
+	Clock::time_point t2 = Clock::now();
+	for (int i = 1; i < iterations; ++i)
+		permute_tiles_in_place(in_place, grid, perm);
+	Clock::time_point t3 = Clock::now();
+
+	double ms_copy = chrono::duration<double, milli>(t1 - t0).count() / iterations;
+	double ms_in_place = chrono::duration<double, milli>(t3 - t2).count()
+		/ max(1, iterations - 1);
+	image.copyTo(in_place);
+	permute_tiles_in_place(in_place, grid, perm);
+	Rect tiled(0, 0, grid.cols * grid.tile_cols, grid.rows * grid.tile_rows);
+	Mat diff = swapped(tiled) != in_place(tiled);
+
+	double mb = (double) tiled.area() * image.elemSize() / 1e6;
+	cout << "###### Swap regions " << width << "x" << height << ", "
+		 << n << "x" << m << " tiles ######" << endl
+		 << "Copy: " << ms_copy << " ms (" << mb / ms_copy << " GB/s), "
+		 << mb << " MB extra" << endl
+		 << "In place: " << ms_in_place << " ms (" << mb / ms_in_place
+		 << " GB/s), " << (double) grid.tile_rows * grid.tile_cols
+			* image.elemSize() * getNumThreads() / 1e6
+		 << " MB scratch at most" << endl
+		 << countNonZero(diff.reshape(1)) << " bytes differ" << endl
+		 << "##############################" << endl;
+}
+
 int main(int argc, char** argv){
-	if (argc != 6) {
+	apply_tuning();
+
+	if (argc >= 2 && string(argv[1]) == "--bench") {
+		bench(argc > 2 ? atoi(argv[2]) : 7680,
+			  argc > 3 ? atoi(argv[3]) : 4320,
+			  argc > 4 ? atoi(argv[4]) : 16,
+			  argc > 5 ? atoi(argv[5]) : 16,
+			  argc > 6 ? atoi(argv[6]) : 10);
+		exit(0);
+	}
+
+	// PGM, PPM and raw are mapped instead of read; -w swaps in place and
+	// writes the result back into the file
+	bool write_back = argc > 2 && string(argv[argc-1]) == "-w";
+	if (write_back) argc--;
+
+	bool from_file = (argc == 4 || argc == 5) && string(argv[2]) == "-f";
+	if (argc != 6 && !from_file) {
 		cout << "usage: " << endl
-			 << "\t" << argv[0] << " <img_path> <sequence with 4 numbers from 1 to 4" 
+			 << "\t" << argv[0] << " <img_path> <sequence with 4 numbers from 1 to 4"
 			 << " separated by spaces>" << endl
 			 << "\tExample: " << argv[0] << " ../img/lenna.png 4 3 2 1" << endl
-			 << "\tThe sequence 1 2 3 4 is the original image, swapping these numbers" 
-			 << " swaps the four regions of the image." << endl;
+			 << "\tThe sequence 1 2 3 4 is the original image, swapping these numbers"
+			 << " swaps the four regions of the image." << endl
+			 << "\t" << argv[0] << " <img_path> -f <perm_file> [-i]" << endl
+			 << "\tThe file holds the grid's rows and columns, then the sequence"
+			 << " of its rows * cols regions, numbered row by row from 1." << endl
+			 << "\t-i swaps the regions in place, without a second image." << endl
+			 << "\tPGM, PPM and raw:WIDTHxHEIGHT:bgr|grey:<path> images are"
+			 << " memory-mapped; a trailing -w swaps in place and writes the"
+			 << " result back into the file." << endl
+			 << "\t" << argv[0] << " --bench [width] [height] [rows] [cols] [iterations]"
+			 << endl;
 
 		exit(1);
 	}
-	
-	Mat image = imread(argv[1], CV_LOAD_IMAGE_COLOR);
-	
+
+	MappedImage mapped;
+	Mat image;
+	{
+		TRACE_SCOPE("decode");
+		image = load_image(argv[1], mapped, write_back);
+	}
+
 	if (!image.data)
 		cout << "Could not open " << argv[1] << endl;
 
-	int sequence[4];
-	for (int i = 0; i < 4; ++i) {
-		sequence[i] = atoi(argv[i+2]) - 1;
-		CHECK_VALID_RANGE(sequence[i]);
+	int grid_rows = 2, grid_cols = 2;
+	vector<int> sequence(4);
+	if (from_file) {
+		if (!read_permutation(argv[3], grid_rows, grid_cols, sequence)) {
+			cout << "Invalid region sequence in " << argv[3] << endl;
+			exit(1);
+		}
+	} else {
+		for (int i = 0; i < 4; ++i) {
+			sequence[i] = atoi(argv[i+2]) - 1;
+			CHECK_VALID_RANGE(sequence[i]);
+		}
 	}
+	bool in_place = write_back || (argc == 5 && string(argv[4]) == "-i");
 
 	int rows = image.rows;
 	int cols = image.cols;
-
-	Rect rois[4] = {
-		Rect(     0,      0, rows/2, cols/2),
-		Rect(rows/2,      0, rows/2, cols/2),
-		Rect(     0, cols/2, rows/2, cols/2),
-		Rect(rows/2, cols/2, rows/2, cols/2)
-	};
+	TileGrid grid(image.size(), grid_rows, grid_cols);
 
 	namedWindow(argv[1],WINDOW_AUTOSIZE);
 
-	Mat3b swapped (rows, cols, Vec3b(0, 0, 0));
-
-	for (int i = 0; i < 4; ++i) {
-		Mat region (image, rois[ sequence[i] ]);
-		region.copyTo(swapped(rois[i]));
+	if (in_place) {
+		{
+			TRACE_SCOPE("swap_in_place");
+			permute_tiles_in_place(image, grid, sequence);
+		}
+		if (write_back && mapped.isOpen()) {
+			TRACE_SCOPE("sync");
+			mapped.sync();
+		}
+		imshow_mapped(argv[1], image, mapped);
+	} else {
+		Mat swapped (rows, cols, image.type(), Scalar::all(0));
+		TRACE_SCOPE("swap");
+		permute_tiles(image, swapped, grid, sequence);
+		imshow_mapped(argv[1], swapped, mapped);
 	}
-
-	imshow(argv[1], swapped);  
 	waitKey();
 
 	exit(0);
@@ -0,0 +1,90 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+
+// Fixed set of worker threads draining a FIFO of tasks. Tasks may submit
+// further tasks, and wait() returns once the queue is empty and every
+// worker is idle.
+class ThreadPool {
+public:
+	explicit ThreadPool(int num_threads = 0) : busy(0), stopping(false) {
+		if (num_threads <= 0)
+			num_threads = std::thread::hardware_concurrency();
+		if (num_threads <= 0)
+			num_threads = 1;
+		for (int i = 0; i < num_threads; ++i)
+			workers.push_back(std::thread(&ThreadPool::work, this));
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stopping = true;
+		}
+		has_task.notify_all();
+		for (size_t i = 0; i < workers.size(); ++i)
+			workers[i].join();
+	}
+
+	int size() const { return workers.size(); }
+
+	void submit(const std::function<void()> &task) {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			tasks.push_back(task);
+		}
+		has_task.notify_one();
+	}
+
+	void wait() {
+		std::unique_lock<std::mutex> lock(mtx);
+		while (!tasks.empty() || busy > 0)
+			idle.wait(lock);
+	}
+
+	// Like wait(), but gives up after timeout_ms. Returns true when idle.
+	bool waitFor(int timeout_ms) {
+		std::unique_lock<std::mutex> lock(mtx);
+		return idle.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+							 [this] { return tasks.empty() && busy == 0; });
+	}
+
+private:
+	void work() {
+		for (;;) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				while (!stopping && tasks.empty())
+					has_task.wait(lock);
+				if (stopping && tasks.empty()) return;
+				task = tasks.front();
+				tasks.pop_front();
+				busy++;
+			}
+			task();
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				busy--;
+				if (tasks.empty() && busy == 0) idle.notify_all();
+			}
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()> > tasks;
+	int busy;
+	bool stopping;
+
+	std::mutex mtx;
+	std::condition_variable has_task, idle;
+};
+
+#endif
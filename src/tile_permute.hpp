@@ -0,0 +1,123 @@
+#ifndef TILE_PERMUTE_HPP
+#define TILE_PERMUTE_HPP
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+
+// Rearranges an image cut into a grid of equal tiles, numbered row by row
+// from 0. perm[i] is the tile whose content ends up at tile i. Rows and
+// columns left over when the grid does not divide the image are not
+// touched.
+
+struct TileGrid {
+	int rows, cols;           // tiles
+	int tile_rows, tile_cols; // pixels
+
+	TileGrid(cv::Size size, int rows, int cols)
+		: rows(rows), cols(cols), tile_rows(size.height / rows),
+		  tile_cols(size.width / cols) {}
+
+	int count() const { return rows * cols; }
+	cv::Rect tile(int i) const {
+		return cv::Rect((i % cols) * tile_cols, (i / cols) * tile_rows,
+						tile_cols, tile_rows);
+	}
+};
+
+// Reads "rows cols" followed by rows * cols tile numbers counting from 1,
+// separated by any whitespace. Returns false unless it is a permutation.
+inline bool read_permutation(const std::string &path, int &rows, int &cols,
+							 std::vector<int> &perm) {
+	FILE *f = fopen(path.c_str(), "r");
+	if (!f) return false;
+	bool ok = fscanf(f, "%d %d", &rows, &cols) == 2 && rows > 0 && cols > 0;
+	perm.clear();
+	std::vector<bool> seen(ok ? rows * cols : 0, false);
+	for (int i = 0; ok && i < rows * cols; ++i) {
+		int t;
+		ok = fscanf(f, "%d", &t) == 1 && t >= 1 && t <= rows * cols && !seen[t-1];
+		if (ok) {
+			seen[t-1] = true;
+			perm.push_back(t - 1);
+		}
+	}
+	fclose(f);
+	return ok;
+}
+
+inline void copy_tile(const cv::Mat &src, const cv::Rect &from,
+					  cv::Mat &dst, const cv::Rect &to) {
+	size_t bytes = from.width * src.elemSize();
+	for (int y = 0; y < from.height; ++y)
+		memcpy(dst.ptr<uchar>(to.y + y) + to.x * dst.elemSize(),
+			   src.ptr<uchar>(from.y + y) + from.x * src.elemSize(), bytes);
+}
+
+// Out of place: dst gets src's type and size, each tile copied once
+inline void permute_tiles(const cv::Mat &src, cv::Mat &dst, const TileGrid &grid,
+						  const std::vector<int> &perm) {
+	dst.create(src.size(), src.type());
+	for (int i = 0; i < grid.count(); ++i)
+		copy_tile(src, grid.tile(perm[i]), dst, grid.tile(i));
+}
+
+// In place, for images too large to hold twice. The permutation splits
+// into disjoint cycles; along one, the first tile is parked in a scratch
+// tile, every other tile moves into the place of the one before it, and
+// the parked tile closes the cycle. Cycles share no tiles, so they run in
+// parallel, each worker with its own single scratch tile.
+class TileCycleBody : public cv::ParallelLoopBody {
+public:
+	TileCycleBody(cv::Mat &image, const TileGrid &grid,
+				  const std::vector<std::vector<int> > &cycles)
+		: image(image), grid(grid), cycles(cycles) {}
+
+	void operator()(const cv::Range &range) const {
+		cv::Mat scratch(grid.tile_rows, grid.tile_cols, image.type());
+		cv::Rect whole(0, 0, grid.tile_cols, grid.tile_rows);
+		for (int c = range.start; c < range.end; ++c) {
+			const std::vector<int> &cycle = cycles[c];
+			copy_tile(image, grid.tile(cycle[0]), scratch, whole);
+			for (size_t k = 0; k + 1 < cycle.size(); ++k)
+				copy_tile(image, grid.tile(cycle[k+1]), image, grid.tile(cycle[k]));
+			copy_tile(scratch, whole, image, grid.tile(cycle.back()));
+		}
+	}
+
+private:
+	cv::Mat &image;
+	const TileGrid &grid;
+	const std::vector<std::vector<int> > &cycles;
+};
+
+inline void permute_tiles_in_place(cv::Mat &image, const TileGrid &grid,
+								   const std::vector<int> &perm) {
+	// cycle[k+1] = perm[cycle[k]]: tile cycle[k] takes cycle[k+1]'s content.
+	// Fixed points need no copy at all.
+	std::vector<std::vector<int> > cycles;
+	std::vector<bool> done(grid.count(), false);
+	for (int i = 0; i < grid.count(); ++i) {
+		if (done[i] || perm[i] == i) continue;
+		std::vector<int> cycle;
+		for (int j = i; !done[j]; j = perm[j]) {
+			done[j] = true;
+			cycle.push_back(j);
+		}
+		cycles.push_back(cycle);
+	}
+	if (cycles.empty()) return;
+
+	// Longest first, so a long cycle does not start last
+	std::sort(cycles.begin(), cycles.end(),
+			  [](const std::vector<int> &a, const std::vector<int> &b) {
+				  return a.size() > b.size();
+			  });
+	cv::parallel_for_(cv::Range(0, (int) cycles.size()),
+					  TileCycleBody(image, grid, cycles));
+}
+
+#endif
@@ -1,6 +1,11 @@
 #include <iostream>
 #include <cmath>
 #include <opencv2/opencv.hpp>
+#include "libpdi.hpp"
+#include "trace.hpp"
+#include "progressive.hpp"
+#include "render_worker.hpp"
+#include "tuning.hpp"
 
 using namespace cv;
 using namespace std;
@@ -21,84 +26,68 @@ int hue_gain = 0;
 int hue_gain_slider = 0;
 int hue_gain_slider_max = 255;
 
-Mat image, temp_image, blurred_image;
-Mat func_image, compl_image;
-Mat m_image, m_bimage;
-Mat result;
+// Blurred copy and blend live in the library, see libpdi.hpp. Blur passes
+// add up their variance, so a preview at 1/2^l of the size needs 1/4^l of
+// the passes for the same look.
+#define BLUR_PASSES 100
 
-char TrackbarName[50];
-
-void drawFuncImage() {
-	uchar pixel_value;
-	double x;
-	double den = (decay_strength > 0 ? decay_strength/10 : 0.1);
-	double func_val;
-	for (int i = 0; i < func_image.rows; ++i) {
-		x = (double) i*100.0 /func_image.rows;
-		func_val =
-		   	( tanh( (x-start_focus)/den ) - 
-			  tanh ( ( x-(2*center_focus-start_focus) )/den ) ) / 2;
-		pixel_value = (uchar) (255*func_val);
-		for (int j = 0; j < func_image.cols; ++j) {
-			func_image.at<uchar>(i,j) = pixel_value;
-			compl_image.at<uchar>(i,j) = 255 - pixel_value;
-		}
-	}
-	imshow( "func_image",  func_image);
-}
+// While a slider moves, render from a copy with at most this many pixels,
+// and at full size once the sliders have been still for REFINE_IDLE_MS
+#define PREVIEW_PIXELS (1280 * 720)
+#define REFINE_IDLE_MS 150
 
-void composeResult() {
-	drawFuncImage();
-	
-	Mat image_f, blurred_image_f;
-	image.convertTo(image_f, CV_32F);
-	blurred_image.convertTo(blurred_image_f, CV_32F);
-
-	Mat func_image3, compl_image3;
-	
-	Mat t_func[]  = { func_image,  func_image,  func_image};
-	Mat t_compl[] = {compl_image, compl_image, compl_image};
-
-	merge( t_func, 3,  func_image3);
-	merge(t_compl, 3, compl_image3);
+pdi::TiltShift tiltshift(BLUR_PASSES), preview(BLUR_PASSES);
+bool progressive = false;
+RefineTimer refine(REFINE_IDLE_MS);
 
-	Mat func_image3_f, compl_image3_f;
-	func_image3.convertTo(func_image3_f, CV_32F, 1.0/255.0);
-	compl_image3.convertTo(compl_image3_f, CV_32F, 1.0/255.0);
-
-	multiply(image_f, func_image3_f, m_image);
-	multiply(blurred_image_f, compl_image3_f, m_bimage);
+char TrackbarName[50];
 
-	Mat result_f;
+// The callbacks only post requests; the rendering runs on a worker
+// thread, and the main loop shows whatever it finished last
+struct Request {
+	pdi::TiltShiftParams params;
+	bool full;
+};
+
+struct Frame {
+	Mat focus, result;
+};
+
+bool render(const Request &r, Frame &frame, const RenderCancel &cancelled) {
+	pdi::TiltShift &level = r.full ? tiltshift : preview;
+	TRACE_SCOPE(r.full ? "compose" : "compose_preview");
+	level.focusImage(r.params, frame.focus);
+	if (cancelled()) return false;
+	return level.render(r.params, frame.result, cancelled);
+}
 
-	addWeighted(m_image, 1, m_bimage, 1, 0, result_f);
+RenderWorker<Request, Frame> *worker;
 
-	result_f.convertTo(result, CV_8UC3);
+// Set when a callback had to pull a slider back inside the band's limits;
+// the main loop moves the slider, callbacks never call setTrackbarPos
+bool fix_sliders = false;
 
-	Mat result_hsv;
-	Mat planes_hsv[3];
-	Mat hue_saturated;
+void postRender(bool full) {
+	Request r;
+	r.params = pdi::TiltShiftParams(start_focus, decay_strength,
+									center_focus, hue_gain);
+	r.full = full;
+	worker->post(r);
+}
 
-	cvtColor(result, result_hsv, CV_BGR2HSV);
-	split(result_hsv, planes_hsv);
-	planes_hsv[1].convertTo(hue_saturated, -1, 1, hue_gain);
-	hue_saturated.copyTo(planes_hsv[1]);
-	merge(planes_hsv, 3, result_hsv);
-	
-	cvtColor(result_hsv, result, CV_HSV2BGR);
-	imshow("result", result);
+void composeResult() {
+	postRender(!progressive);
+	if (progressive)
+		refine.touch();
 }
 
 void on_trackbar_start_focus(int, void*) {
 	if (start_focus_slider > center_focus_slider) {
-		setTrackbarPos("Start", "func_image", center_focus_slider);
-		start_focus = (double) center_focus_slider;
+		start_focus_slider = center_focus_slider;
+		fix_sliders = true;
 	} else if (2*center_focus_slider - start_focus_slider > 100) {
-		setTrackbarPos("Start", "func_image", 
-					   2*center_focus_slider - 100);
-		start_focus = 2*center_focus_slider - 100;
-	} else {
-		start_focus = (double) start_focus_slider;
+		start_focus_slider = 2*center_focus_slider - 100;
+		fix_sliders = true;
 	}
 	start_focus = (double) start_focus_slider;
 	composeResult();
@@ -111,15 +100,13 @@ void on_trackbar_decay_strength(int, void*) {
 
 void on_trackbar_center_focus(int, void*) {
 	if ( center_focus_slider < start_focus_slider ) {
-		setTrackbarPos("Center", "func_image", start_focus_slider);
-		center_focus = (double) start_focus_slider;
+		center_focus_slider = start_focus_slider;
+		fix_sliders = true;
 	} else if (2*center_focus_slider - start_focus_slider > 100) { 
-		setTrackbarPos("Center", "func_image",
-					   (100 + start_focus_slider)/2);
-		center_focus = (100 + start_focus_slider)/2;
-	} else {	
-		center_focus = (double) center_focus_slider;
+		center_focus_slider = (100 + start_focus_slider)/2;
+		fix_sliders = true;
 	}
+	center_focus = (double) center_focus_slider;
 	composeResult();
 }
 
@@ -129,21 +116,36 @@ void on_trackbar_hue_gain(int, void*) {
 }
 
 int main(int argc, char** argv) {
+	apply_tuning();
+
 	if (argc != 2) {
 		cout << "usage: " << argv[0] << " <img1>"
 			 << endl;
 		exit(1);
 	}
 
-	image = imread(argv[1]);
-	temp_image = image.clone();
-	for (int i = 0; i < 100; ++i) {
-		GaussianBlur(temp_image, blurred_image, Size(3, 3), 0, 0);
-		temp_image = blurred_image.clone();
+	Mat image;
+	{
+		TRACE_SCOPE("decode");
+		image = imread(argv[1]);
+	}
+	if (!image.data) {
+		cout << "Could not open " << argv[1] << endl;
+		exit(1);
+	}
+	tiltshift.setImage(image);
+
+	vector<Mat> pyramid;
+	build_pyramid(image, pyramid, PREVIEW_PIXELS);
+	progressive = pyramid.size() > 1;
+	if (progressive) {
+		int level = pyramid.size() - 1;
+		preview = pdi::TiltShift(max(1, BLUR_PASSES >> (2 * level)));
+		preview.setImage(pyramid.back());
 	}
 
-	func_image = Mat(image.rows, image.cols, CV_8UC1, Scalar(255));
-	compl_image = Mat(image.rows, image.cols, CV_8UC1, Scalar(255));
+	RenderWorker<Request, Frame> render_worker(render);
+	worker = &render_worker;
 
 	namedWindow("func_image", WINDOW_NORMAL);
 	namedWindow(    "result", WINDOW_NORMAL);
@@ -178,7 +180,23 @@ int main(int argc, char** argv) {
 	on_trackbar_hue_gain(hue_gain_slider, 0);
 
 
-	waitKey(0);
+	// Any key quits
+	Frame frame;
+	while (waitKey(10) < 0) {
+		if (fix_sliders) {
+			fix_sliders = false;
+			setTrackbarPos("Start", "func_image", start_focus_slider);
+			setTrackbarPos("Center", "func_image", center_focus_slider);
+		}
+		if (refine.due())
+			postRender(true);
+		if (worker->take(frame)) {
+			imshow("func_image", frame.focus);
+			imshow("result", frame.result);
+		}
+	}
 
-	exit(0);
+	// Returning, not exit(), so the worker is stopped before the
+	// globals it renders from go away
+	return 0;
 }
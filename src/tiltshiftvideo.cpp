@@ -1,6 +1,10 @@
 #include <iostream>
 #include <cmath>
 #include <opencv2/opencv.hpp>
+#include "libpdi.hpp"
+#include "trace.hpp"
+#include "frame_stream.hpp"
+#include "tuning.hpp"
 
 using namespace cv;
 using namespace std;
@@ -10,73 +14,14 @@ double decay_strength = 50;
 double center_focus   = 50;
 int    hue_gain       = 20;
 
-Mat image, temp_image, blurred_image;
-Mat func_image, compl_image;
-Mat m_image, m_bimage;
-Mat result;
+Mat image, result;
+pdi::TiltShift tiltshift;
 
 int num_frame = 1;
 
-void drawFuncImage() {
-	uchar pixel_value;
-	double x;
-	double den = (decay_strength > 0 ? decay_strength/10 : 0.1);
-	double func_val;
-	for (int i = 0; i < func_image.rows; ++i) {
-		x = (double) i*100.0 /func_image.rows;
-		func_val =
-		   	( tanh( (x-start_focus)/den ) - 
-			  tanh ( ( x-(2*center_focus-start_focus) )/den ) ) / 2;
-		pixel_value = (uchar) (255*func_val);
-		for (int j = 0; j < func_image.cols; ++j) {
-			func_image.at<uchar>(i,j) = pixel_value;
-			compl_image.at<uchar>(i,j) = 255 - pixel_value;
-		}
-	}
-}
-
-void composeResult() {
-	drawFuncImage();
-	
-	Mat image_f, blurred_image_f;
-	image.convertTo(image_f, CV_32F);
-	blurred_image.convertTo(blurred_image_f, CV_32F);
-
-	Mat func_image3, compl_image3;
-	
-	Mat t_func[]  = { func_image,  func_image,  func_image};
-	Mat t_compl[] = {compl_image, compl_image, compl_image};
-
-	merge( t_func, 3,  func_image3);
-	merge(t_compl, 3, compl_image3);
-
-	Mat func_image3_f, compl_image3_f;
-	func_image3.convertTo(func_image3_f, CV_32F, 1.0/255.0);
-	compl_image3.convertTo(compl_image3_f, CV_32F, 1.0/255.0);
-
-	multiply(image_f, func_image3_f, m_image);
-	multiply(blurred_image_f, compl_image3_f, m_bimage);
-
-	Mat result_f;
-
-	addWeighted(m_image, 1, m_bimage, 1, 0, result_f);
-	result_f.convertTo(result, CV_8UC3);
-	
-	Mat result_hsv;
-	Mat planes_hsv[3];
-	Mat hue_saturated;
-
-	cvtColor(result, result_hsv, CV_BGR2HSV);
-	split(result_hsv, planes_hsv);
-	planes_hsv[1].convertTo(hue_saturated, -1, 1, hue_gain);
-	hue_saturated.copyTo(planes_hsv[1]);
-	merge(planes_hsv, 3, result_hsv);
-	
-	cvtColor(result_hsv, result, CV_HSV2BGR);
-}
-
-
 int main(int argc, char** argv) {
+	apply_tuning();
+
 	if (argc != 8) {
 		cout << "usage: " << argv[0] << " <video_input> "
 			 << "<video_output> "
@@ -87,26 +32,47 @@ int main(int argc, char** argv) {
 			 << "<hue_gain> goes between 0 and 255;" << endl
 			 << "\t<num_frame> is the number of frames in the original to "
 			 << "the created. (stop motion effect)"
-			 << "\tAnd the output video must have an extension .avi"
-			 << endl;
+			 << "\tAnd the output video must have an extension .avi, "
+			 << "or be a stream:" << endl
+			 << "\t- or name.y4m for Y4M, raw:- or raw:name for raw BGR;"
+			 << endl
+			 << "\tthe input may be - (Y4M on stdin) or "
+			 << "raw:WIDTHxHEIGHT[@FPS]:- likewise." << endl
+			 << "\te.g. ffmpeg -i in.mp4 -f yuv4mpegpipe - | " << argv[0]
+			 << " - - 20 50 50 20 1 | ffmpeg -i - out.mp4" << endl;
 		exit(1);
 	}
 
-	VideoCapture cap (argv[1]);
+	FrameSource cap;
 
-	if (!cap.isOpened()){
-		cout << "Failed to open input file " << argv[1] << endl;
+	if (!cap.open(argv[1])){
+		cout << "Failed to open input file " << argv[1] << ": "
+			 << cap.error() << endl;
 		exit(1);
 	}
 
 	num_frame = atoi(argv[7]);
 
-	VideoWriter wri (argv[2], CV_FOURCC('D','I','V','X'), 
-					 cap.get(CV_CAP_PROP_FPS)/num_frame,
-					 Size(cap.get(CV_CAP_PROP_FRAME_WIDTH), 
-						  cap.get(CV_CAP_PROP_FRAME_HEIGHT)));
-	
-	if (!wri.isOpened()){
+	// Y4M and raw outputs are written uncompressed, anything else through
+	// VideoWriter
+	string output = argv[2];
+	bool stream = is_y4m_name(output) || output.compare(0, 4, "raw:") == 0;
+	double fps = (cap.fps() > 0 ? cap.fps() : 30) / num_frame;
+	FrameSink sink;
+	VideoWriter wri;
+
+	if (stream) {
+		if (!sink.open(output, cap.size(), fps, false)) {
+			cout << "Failed to open output " << output << ": "
+				 << sink.error() << endl;
+			exit(1);
+		}
+		if (sink.toStdout()) move_messages_to_stderr();
+	} else {
+		wri.open(output, CV_FOURCC('D','I','V','X'), fps, cap.size());
+	}
+
+	if (!stream && !wri.isOpened()){
 		cout << "Failed to open output file " << argv[2] << endl;
 		exit(1);
 	}
@@ -117,28 +83,27 @@ int main(int argc, char** argv) {
 	center_focus   = atof(argv[5]);
 	hue_gain       = atoi(argv[6]);
 
-	cap >> image;
-	if(image.empty()) exit(0);
+	pdi::TiltShiftParams params(start_focus, decay_strength, center_focus,
+								hue_gain);
 
-	func_image  = Mat(image.rows, image.cols, CV_8UC1, Scalar(255));
-	compl_image = Mat(image.rows, image.cols, CV_8UC1, Scalar(255));
+	if(!cap.read(image)) exit(0);
 
 	while(1) {
 		
 		for(int i = 0; i < num_frame; ++i) {
-			cap >> image;
-			if(image.empty()) exit(0);
+			TRACE_SCOPE("decode");
+			if(!cap.read(image)) exit(0);
 		}
 
-		temp_image = image.clone();
-		for (int i = 0; i < 100; ++i) {
-			GaussianBlur(temp_image, blurred_image, Size(3, 3), 0, 0);
-			temp_image = blurred_image.clone();
-		}
-
-		composeResult();
+		tiltshift.setImage(image);
+		tiltshift.render(params, result);
 
-		wri << result;
+		TRACE_SCOPE("encode");
+		if (!stream) {
+			wri << result;
+		} else if (!sink.write(result)) {
+			exit(0); // the reader went away
+		}
 	}
 
 	exit(0);
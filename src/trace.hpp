@@ -0,0 +1,191 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+// Scoped stage timers. TRACE_SCOPE("blur") records how long the enclosing
+// block took, on the calling thread's own buffer, without locks.
+//
+// Tracing is off unless the PDI_TRACE environment variable names a file.
+// Then, at exit, the events are written there as Chrome trace-event JSON
+// (load it in chrome://tracing or Perfetto), and a table of per-stage
+// totals and percentiles goes to stderr. Off, a scope costs one branch on
+// a cached flag. Building with -DPDI_NO_TRACE (make TRACE=0) removes it
+// completely.
+//
+// Names must be string literals, or otherwise outlive the program.
+
+#ifdef PDI_NO_TRACE
+
+#define TRACE_SCOPE(name)
+
+#else
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+namespace trace {
+
+struct Event {
+	const char *name;
+	long long start_ns, duration_ns;
+};
+
+// One per thread, written only by its thread. The size is published with
+// a release store, so the dump at exit reads whole events only.
+struct Buffer {
+	enum { CAPACITY = 1 << 16 };
+
+	explicit Buffer(int tid) : tid(tid), size(0), dropped(0), events(CAPACITY) {}
+
+	int tid;
+	std::atomic<size_t> size;
+	size_t dropped;
+	std::vector<Event> events;
+};
+
+struct Registry {
+	std::mutex mtx;
+	std::vector<Buffer*> buffers; // never freed, threads may outlive main
+	std::string path;
+	bool enabled;
+	std::chrono::steady_clock::time_point origin;
+};
+
+inline void dump();
+
+inline Registry& registry() {
+	static Registry *r = NULL;
+	static std::once_flag once;
+	std::call_once(once, [] {
+		r = new Registry();
+		const char *path = getenv("PDI_TRACE");
+		r->enabled = path && *path;
+		if (r->enabled) {
+			r->path = path;
+			atexit(dump);
+		}
+		r->origin = std::chrono::steady_clock::now();
+	});
+	return *r;
+}
+
+inline bool enabled() {
+	static const bool on = registry().enabled;
+	return on;
+}
+
+inline long long now_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - registry().origin).count();
+}
+
+inline Buffer& thread_buffer() {
+	static thread_local Buffer *buffer = NULL;
+	if (!buffer) {
+		Registry &r = registry();
+		std::lock_guard<std::mutex> lock(r.mtx);
+		buffer = new Buffer((int) r.buffers.size());
+		r.buffers.push_back(buffer);
+	}
+	return *buffer;
+}
+
+inline void record(const char *name, long long start_ns, long long end_ns) {
+	Buffer &b = thread_buffer();
+	size_t n = b.size.load(std::memory_order_relaxed);
+	if (n == Buffer::CAPACITY) {
+		b.dropped++;
+		return;
+	}
+	Event &e = b.events[n];
+	e.name = name;
+	e.start_ns = start_ns;
+	e.duration_ns = end_ns - start_ns;
+	b.size.store(n + 1, std::memory_order_release);
+}
+
+class Scope {
+public:
+	explicit Scope(const char *name) : name(name), start(-1) {
+		if (enabled()) start = now_ns();
+	}
+	~Scope() {
+		if (start >= 0) record(name, start, now_ns());
+	}
+
+private:
+	Scope(const Scope&);
+	Scope& operator=(const Scope&);
+
+	const char *name;
+	long long start;
+};
+
+inline double percentile(const std::vector<long long> &sorted, double p) {
+	size_t rank = (size_t) (p * sorted.size() + 0.999999);
+	return sorted[std::min(sorted.size(), std::max(rank, (size_t) 1)) - 1] / 1e6;
+}
+
+inline void dump() {
+	Registry &r = registry();
+	std::lock_guard<std::mutex> lock(r.mtx);
+
+	FILE *f = fopen(r.path.c_str(), "w");
+	if (!f)
+		fprintf(stderr, "trace: could not write %s\n", r.path.c_str());
+
+	std::map<std::string, std::vector<long long> > stages;
+	size_t dropped = 0;
+	bool first = true;
+	if (f) fprintf(f, "{\"traceEvents\": [");
+	for (size_t i = 0; i < r.buffers.size(); ++i) {
+		const Buffer &b = *r.buffers[i];
+		size_t n = b.size.load(std::memory_order_acquire);
+		dropped += b.dropped;
+		for (size_t k = 0; k < n; ++k) {
+			const Event &e = b.events[k];
+			stages[e.name].push_back(e.duration_ns);
+			if (!f) continue;
+			fprintf(f, "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+					"\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+					first ? "" : ",", e.name, b.tid, e.start_ns / 1e3,
+					e.duration_ns / 1e3);
+			first = false;
+		}
+	}
+	if (f) {
+		fprintf(f, "\n], \"displayTimeUnit\": \"ms\"}\n");
+		fclose(f);
+	}
+
+	fprintf(stderr, "%-24s %8s %12s %10s %10s %10s %10s\n", "stage", "count",
+			"total ms", "mean ms", "p50 ms", "p90 ms", "p99 ms");
+	for (std::map<std::string, std::vector<long long> >::iterator it =
+			 stages.begin(); it != stages.end(); ++it) {
+		std::vector<long long> &d = it->second;
+		std::sort(d.begin(), d.end());
+		long long total = 0;
+		for (size_t k = 0; k < d.size(); ++k) total += d[k];
+		fprintf(stderr, "%-24s %8zu %12.3f %10.3f %10.3f %10.3f %10.3f\n",
+				it->first.c_str(), d.size(), total / 1e6, total / 1e6 / d.size(),
+				percentile(d, 0.5), percentile(d, 0.9), percentile(d, 0.99));
+	}
+	if (dropped)
+		fprintf(stderr, "trace: %zu events dropped, buffers full\n", dropped);
+}
+
+} // namespace trace
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) trace::Scope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+#endif
+
+#endif
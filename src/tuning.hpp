@@ -0,0 +1,102 @@
+#ifndef TUNING_HPP
+#define TUNING_HPP
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <fstream>
+#include <unistd.h>
+#include <opencv2/opencv.hpp>
+#include "cpu_dispatch.hpp"
+
+// Per-machine settings found by bench --autotune: the thread count for
+// OpenCV's parallel_for_, applied by each tool's main(), and the tile
+// size of the fused filters. They are kept in $PDI_TUNING, or
+// ~/.pdi_tuning, as "key = value" lines:
+//
+//   host = render07
+//   isa = avx2
+//   threads = 12
+//   fused_tile_bytes = 131072
+//
+// A file written on another host or for another ISA level is ignored, so
+// a home directory shared across different machines does no harm.
+
+struct Tuning {
+	int threads;          // 0: OpenCV's default
+	int fused_tile_bytes; // 0: FUSED_TILE_BYTES
+
+	Tuning() : threads(0), fused_tile_bytes(0) {}
+};
+
+inline std::string tuning_path() {
+	const char *path = getenv("PDI_TUNING");
+	if (path && *path) return path;
+	const char *home = getenv("HOME");
+	return home ? std::string(home) + "/.pdi_tuning" : std::string();
+}
+
+inline std::string host_name() {
+	char name[256];
+	if (gethostname(name, sizeof(name)) != 0) return "";
+	name[sizeof(name) - 1] = 0;
+	return name;
+}
+
+inline std::string tuning_trim(const std::string &s) {
+	size_t b = s.find_first_not_of(" \t\r");
+	if (b == std::string::npos) return "";
+	return s.substr(b, s.find_last_not_of(" \t\r") - b + 1);
+}
+
+// False when there is no file, or it is for another machine
+inline bool load_tuning(const std::string &path, Tuning &t) {
+	std::ifstream in(path.c_str());
+	if (!in) return false;
+	Tuning loaded;
+	std::string line, host, isa;
+	while (std::getline(in, line)) {
+		size_t eq = line.find('=');
+		if (line.empty() || line[0] == '#' || eq == std::string::npos) continue;
+		std::string key = tuning_trim(line.substr(0, eq));
+		std::string value = tuning_trim(line.substr(eq + 1));
+		if (key == "host") host = value;
+		else if (key == "isa") isa = value;
+		else if (key == "threads") loaded.threads = atoi(value.c_str());
+		else if (key == "fused_tile_bytes") loaded.fused_tile_bytes = atoi(value.c_str());
+	}
+	if (host != host_name() || isa != cpu_level_name(cpu_level()))
+		return false;
+	t = loaded;
+	return true;
+}
+
+inline bool save_tuning(const std::string &path, const Tuning &t) {
+	FILE *f = fopen(path.c_str(), "w");
+	if (!f) return false;
+	fprintf(f, "# written by bench --autotune\n"
+			   "host = %s\nisa = %s\nthreads = %d\nfused_tile_bytes = %d\n",
+			host_name().c_str(), cpu_level_name(cpu_level()), t.threads,
+			t.fused_tile_bytes);
+	return fclose(f) == 0;
+}
+
+// This machine's settings, read once. Kernels may call this; it changes
+// nothing.
+inline const Tuning& tuning() {
+	static const Tuning t = [] {
+		Tuning t;
+		load_tuning(tuning_path(), t);
+		return t;
+	}();
+	return t;
+}
+
+// For the tools' main(): sets OpenCV's thread count to the tuned one, if
+// there is one
+inline void apply_tuning() {
+	if (tuning().threads > 0)
+		cv::setNumThreads(tuning().threads);
+}
+
+#endif